@@ -0,0 +1,337 @@
+#ifndef venom_aot_h
+#define venom_aot_h
+
+/* The runtime of the programs that venom compiles to C ahead of time
+ * (see cgen.c). The generated translation unit includes this header,
+ * and it is linked against object.c, table.c and util.c, so the obj-
+ * ects and the refcounting are the very same as in the vm. Each of
+ * the helpers below does what the vm's handler of the same opcode
+ * does, including the refcounting, and the runtime errors are repor-
+ * ted the same way. */
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compiler.h"
+#include "dynarray.h"
+#include "object.h"
+#include "table.h"
+#include "util.h"
+
+#define RUNTIME_ERROR(...)                                                     \
+  do {                                                                         \
+    fprintf(stderr, "vm: ");                                                   \
+    fprintf(stderr, __VA_ARGS__);                                              \
+    fprintf(stderr, "\n");                                                     \
+    exit(1);                                                                   \
+  } while (0)
+
+/* The numeric constants are emitted as their bit patterns (see the
+ * OP_CONST case in cgen.c), since C has no literals for -0, the inf-
+ * inities and the nans that %g could print. */
+static inline double aot_num_from_bits(uint64_t bits) {
+  double d;
+  memcpy(&d, &bits, sizeof(d));
+  return d;
+}
+
+static inline uint64_t aot_clamp(double d) {
+  if (d < 0.0) {
+    return 0;
+  } else if (d > UINT64_MAX) {
+    return UINT64_MAX;
+  } else {
+    return (uint64_t)d;
+  }
+}
+
+/* Raised by the arithmetic and the comparisons (see emit_binary() in
+ * cgen.c) when one of the operands is not a number. */
+static inline void aot_check_numbers(const char *op, Object a, Object b) {
+  if (!IS_NUM(a) || !IS_NUM(b)) {
+    RUNTIME_ERROR(
+        "'%s' operator used on objects of unsupported types: %s and %s", op,
+        get_object_type(&a), get_object_type(&b));
+  }
+}
+
+/* Drop the object in a slot. objdecref() would take the address of
+ * the slot, and once the address of any slot has escaped (to dealloc),
+ * the C compiler no longer turns the tail calls into jumps. */
+static inline void aot_drop(Object object) { objdecref(&object); }
+
+static inline void aot_print(Object object) {
+#ifdef venom_debug_vm
+  printf("dbg print :: ");
+#endif
+
+  print_object(&object);
+  printf("\n");
+
+  objdecref(&object);
+}
+
+static inline bool aot_check_equality(Object *left, Object *right) {
+#ifdef NAN_BOXING
+  if (IS_NUM(*left) && IS_NUM(*right)) {
+    return AS_NUM(*left) == AS_NUM(*right);
+  }
+  if (IS_STRING(*left) && IS_STRING(*right)) {
+    return string_equal(AS_STRING(*left), AS_STRING(*right));
+  }
+  return *left == *right;
+#else
+  if (IS_STRING(*left) && IS_STRING(*right)) {
+    return string_equal(AS_STRING(*left), AS_STRING(*right));
+  }
+
+  if (left->type != right->type) {
+    return false;
+  }
+
+  switch (left->type) {
+  case OBJ_STRUCT:
+    return AS_STRUCT(*left) == AS_STRUCT(*right);
+  case OBJ_NULL:
+    return true;
+  case OBJ_BOOLEAN:
+    return AS_BOOL(*left) == AS_BOOL(*right);
+  case OBJ_NUMBER:
+    return AS_NUM(*left) == AS_NUM(*right);
+  default:
+    assert(0);
+  }
+#endif
+}
+
+/* Unlike OP_EQ, the objects are compared before they are dropped, so
+ * that two strings are not compared after they have been freed. */
+static inline Object aot_eq(Object a, Object b) {
+  bool result = aot_check_equality(&a, &b);
+  objdecref(&a);
+  objdecref(&b);
+  return BOOL_VAL(result);
+}
+
+static inline Object aot_strcat(Object a, Object b) {
+  if (!IS_STRING(a) || !IS_STRING(b)) {
+    RUNTIME_ERROR(
+        "'++' operator used on objects of unsupported types: %s and %s",
+        get_object_type(&a), get_object_type(&b));
+  }
+
+  /* As in OP_STRCAT, a left string that nothing else refers to is
+   * appended to in place. */
+  if (IS_REFCOUNTED(a) && AS_STRING(a)->refcount == 1 &&
+      append_in_place(AS_STRING(a), AS_STRING(b))) {
+    objdecref(&b);
+    return a;
+  }
+
+  String *result = concatenate_strings(AS_STRING(a), AS_STRING(b));
+
+  objdecref(&b);
+  objdecref(&a);
+
+  return STRING_VAL(result);
+}
+
+static inline Object aot_array(uint32_t count, Object *elements) {
+  DynArray_Object array_elements = {0};
+  for (size_t i = 0; i < count; i++) {
+    dynarray_insert(&array_elements, elements[i]);
+  }
+
+  Array array = {.refcount = 1, .elements = array_elements};
+
+  return ARRAY_VAL(ALLOC(array));
+}
+
+static inline void aot_arrayset(Object subscriptee, Object index,
+                                Object value) {
+  AS_ARRAY(subscriptee)->elements.data[(int)AS_NUM(index)] = value;
+  objdecref(&subscriptee);
+}
+
+static inline Object aot_subscript(Object object, Object index) {
+  Object value = AS_ARRAY(object)->elements.data[(int)AS_NUM(index)];
+  objincref(&value);
+  objdecref(&object);
+  return value;
+}
+
+static inline Object aot_deref(Object ptr) {
+  Object object = *AS_PTR(ptr);
+  objincref(&object);
+  return object;
+}
+
+static inline void aot_blueprint(Table_StructBlueprint *blueprints, char *name,
+                                 uint32_t propcount, char **properties,
+                                 uint32_t *indexes) {
+  StructBlueprint sb = {.name = name,
+                        .property_indexes = calloc(1, sizeof(Table_int)),
+                        .methods = calloc(1, sizeof(Table_Function))};
+
+  for (size_t i = 0; i < propcount; i++) {
+    table_insert(sb.property_indexes, properties[i], indexes[i]);
+  }
+
+  table_insert(blueprints, name, sb);
+}
+
+static inline void aot_impl(Table_StructBlueprint *blueprints, char *name,
+                            uint32_t method_count, char **names,
+                            uint32_t *paramcounts, uint32_t *locations) {
+  StructBlueprint *sb = table_get(blueprints, name);
+  if (!sb) {
+    RUNTIME_ERROR("struct '%s' is not defined", name);
+  }
+
+  for (size_t i = 0; i < method_count; i++) {
+    Function method = {
+        .location = locations[i],
+        .paramcount = paramcounts[i],
+        .name = names[i],
+    };
+
+    table_insert(sb->methods, names[i], method);
+  }
+}
+
+static inline Object aot_struct(Table_StructBlueprint *blueprints,
+                                String *name) {
+  StructBlueprint *sb = table_get_hashed(blueprints, name->value, name->hash);
+  if (!sb) {
+    RUNTIME_ERROR("struct '%s' is not defined", name->value);
+  }
+
+  Struct s = {.name = name->value,
+              .blueprint = sb,
+              .propcount = sb->property_indexes->count,
+              .refcount = 1,
+              .properties =
+                  malloc(sizeof(Object) * sb->property_indexes->count)};
+
+  for (size_t i = 0; i < s.propcount; i++) {
+    s.properties[i] = NULL_VAL;
+  }
+
+  return STRUCT_VAL(ALLOC(s));
+}
+
+static inline uint32_t aot_resolve_property(Struct *obj, char *name,
+                                            PropertyCache *cache) {
+  if (cache->blueprint == obj->blueprint) {
+    return cache->idx;
+  }
+
+  int *idx = table_get(obj->blueprint->property_indexes, name);
+  if (!idx) {
+    RUNTIME_ERROR("struct '%s' does not have property '%s'", obj->name, name);
+  }
+
+  cache->blueprint = obj->blueprint;
+  cache->idx = *idx;
+
+  return *idx;
+}
+
+static inline void aot_setattr(Object obj, Object value, char *name,
+                               PropertyCache *cache) {
+  uint32_t idx = aot_resolve_property(AS_STRUCT(obj), name, cache);
+  AS_STRUCT(obj)->properties[idx] = value;
+}
+
+static inline Object aot_getattr(Object obj, char *name,
+                                 PropertyCache *cache) {
+  uint32_t idx = aot_resolve_property(AS_STRUCT(obj), name, cache);
+  Object property = AS_STRUCT(obj)->properties[idx];
+  objincref(&property);
+  objdecref(&obj);
+  return property;
+}
+
+static inline Object aot_getattr_ptr(Object obj, char *name,
+                                     PropertyCache *cache) {
+  uint32_t idx = aot_resolve_property(AS_STRUCT(obj), name, cache);
+  Object *property = &AS_STRUCT(obj)->properties[idx];
+  objdecref(&obj);
+  return PTR_VAL(property);
+}
+
+/* Find the location of the method 'name' on the struct 'obj', going
+ * through the inline cache, the same way OP_CALL_METHOD does. */
+static inline uint32_t aot_resolve_method(MethodCache *cache, Object obj,
+                                          char *name, uint32_t argcount) {
+  StructBlueprint *sb = AS_STRUCT(obj)->blueprint;
+
+  for (size_t i = 0; i < cache->count; i++) {
+    if (cache->entries[i].blueprint == sb) {
+      return cache->entries[i].location;
+    }
+  }
+
+  Function *method = table_get(sb->methods, name);
+  if (!method) {
+    RUNTIME_ERROR("method '%s' is not defined on struct '%s'.", name,
+                  sb->name);
+  }
+
+  if (argcount != method->paramcount - 1) {
+    RUNTIME_ERROR("method '%s' expects %ld arguments, but %d were provided.",
+                  method->name, method->paramcount - 1, argcount);
+  }
+
+  if (cache->count < METHOD_CACHE_SIZE) {
+    cache->entries[cache->count++] =
+        (MethodCacheEntry){.blueprint = sb,
+                           .location = method->location,
+                           .paramcount = method->paramcount};
+  }
+
+  return method->location;
+}
+
+/* Build the immortal, interned Strings of the literals, as load_strings()
+ * in vm.c does. */
+static inline void aot_load_strings(String **strings, char **sp,
+                                    size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    strings[i] = intern(new_string(sp[i], strlen(sp[i])));
+  }
+}
+
+static inline void aot_free_strings(String **strings, size_t count) {
+  free_intern_table();
+  for (size_t i = 0; i < count; i++) {
+    free(strings[i]);
+  }
+}
+
+static inline void aot_free_table(Bucket **indexes) {
+  for (size_t i = 0; i < TABLE_MAX; i++) {
+    list_free(indexes[i]);
+  }
+}
+
+static inline void aot_free(Object *globals, size_t global_count,
+                            Table_StructBlueprint *blueprints) {
+  for (size_t i = 0; i < global_count; i++) {
+    objdecref(&globals[i]);
+  }
+
+  for (size_t i = 0; i < blueprints->count; i++) {
+    aot_free_table(blueprints->items[i].property_indexes->indexes);
+    free(blueprints->items[i].property_indexes);
+    aot_free_table(blueprints->items[i].methods->indexes);
+    free(blueprints->items[i].methods);
+  }
+  aot_free_table(blueprints->indexes);
+}
+
+#endif
@@ -0,0 +1,658 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cgen.h"
+#include "optimizer.h"
+#include "register.h"
+
+/* Ahead-of-time compilation to C. The bytecode (as emitted by the co-
+ * mpiler, before any superinstructions are fused) is translated into
+ * a C translation unit that includes aot.h and links against the obj-
+ * ect runtime, so a program can be compiled once into a native binary.
+ *
+ * Just like the register engine and the jit, the translation relies
+ * on the depth of the stack being the same every time an instruction
+ * is executed (see compute_depths() in register.c). Each stack slot
+ * of a frame becomes a C variable: s0..sn, with the parameters first,
+ * then the locals, then the temporaries. The C compiler is then free
+ * to keep them in registers, and to get rid of the ones that are just
+ * moved around.
+ *
+ * Each function becomes a C function that takes its parameters by
+ * value and returns the value on top of its frame, dropping the rest
+ * of the frame the way OP_RET does. An OP_CALL becomes a direct C
+ * call, and an OP_CALL_METHOD goes through call_method(), which sw-
+ * itches on the location of the method that was looked up. A tail ca-
+ * ll drops the frame before the call, and returns what the call does,
+ * which leaves the C compiler free to turn it into a jump. The top-
+ * level code becomes run_toplevel(), and the jumps become gotos to
+ * the labels of their targets.
+ *
+ * Every instruction does exactly what its handler in the vm does, inc-
+ * luding the refcounting, so the program behaves (and leaks, or does
+ * not) the same way as it would on the vm. */
+
+#define OUT(...) fprintf(cg->out, __VA_ARGS__)
+
+typedef struct {
+  Bytecode *code;
+  FILE *out;
+  int *depths;
+  bool *owned;  /* the instructions of the function being emitted */
+  bool *labels; /* the instructions that are jumped to */
+} CGen;
+
+static Function *find_function(Bytecode *code, size_t location) {
+  for (size_t i = 0; i < code->functions.count; i++) {
+    if (code->functions.data[i].location == location) {
+      return &code->functions.data[i];
+    }
+  }
+  return NULL;
+}
+
+/* The location of the function that the OP_CALL at 'offset' calls. */
+static size_t call_target(Bytecode *code, size_t offset) {
+  return operand_at(&code->code.data[offset], 1);
+}
+
+/* The offset that the instruction at 'offset' falls through to, or 0
+ * if it never falls through. */
+static size_t fallthrough(Bytecode *code, size_t offset) {
+  size_t next = offset + instruction_length(code, offset);
+  switch (code->code.data[offset]) {
+  case OP_JMP:
+  case OP_TAILCALL:
+  case OP_TAILCALL_METHOD:
+  case OP_RET:
+  case OP_HLT:
+    return 0;
+  default:
+    return next;
+  }
+}
+
+/* Check that every instruction that can be reached can be translated:
+ * the superinstructions cannot, and every direct call must call one of
+ * the chunk's functions. */
+static bool check(CGen *cg) {
+  Bytecode *code = cg->code;
+  for (size_t offset = 0; offset < code->code.count;
+       offset += instruction_length(code, offset)) {
+    if (cg->depths[offset] == UNREACHABLE) {
+      continue;
+    }
+    uint8_t opcode = code->code.data[offset];
+    if (opcode > OP_HLT) {
+      return false;
+    }
+    if ((opcode == OP_CALL || opcode == OP_TAILCALL) &&
+        !find_function(code, call_target(code, offset))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Find the instructions of the function at 'entry', and the ones that
+ * need a label, since they are jumped to or are not right after the
+ * instruction that falls through to them. Returns the number of stack
+ * slots the function needs. */
+static int collect(CGen *cg, size_t entry) {
+  Bytecode *code = cg->code;
+  memset(cg->owned, 0, code->code.count);
+  memset(cg->labels, 0, code->code.count);
+
+  DynArray(size_t) worklist = {0};
+  dynarray_insert(&worklist, entry);
+
+  while (worklist.count > 0) {
+    size_t offset = worklist.data[--worklist.count];
+    if (cg->owned[offset]) {
+      continue;
+    }
+    cg->owned[offset] = true;
+
+    uint8_t *p = &code->code.data[offset];
+    if (*p == OP_JMP || *p == OP_JZ) {
+      size_t target = jump_target(code->code.data, offset);
+      cg->labels[target] = true;
+      dynarray_insert(&worklist, target);
+    }
+
+    size_t next = fallthrough(code, offset);
+    if (next) {
+      dynarray_insert(&worklist, next);
+    }
+  }
+
+  dynarray_free(&worklist);
+
+  int slots = 1;
+  size_t expected = 0;
+  for (size_t offset = 0; offset < code->code.count;
+       offset += instruction_length(code, offset)) {
+    if (!cg->owned[offset]) {
+      continue;
+    }
+    if (expected && offset != expected) {
+      cg->labels[expected] = true;
+    }
+    expected = fallthrough(code, offset);
+    if (cg->depths[offset] + 1 > slots) {
+      slots = cg->depths[offset] + 1;
+    }
+  }
+  if (expected) {
+    cg->labels[expected] = true;
+  }
+
+  return slots;
+}
+
+static void emit_string(CGen *cg, const char *s) {
+  OUT("\"");
+  for (; *s; s++) {
+    unsigned char c = *s;
+    if (c == '"' || c == '\\') {
+      OUT("\\%c", c);
+    } else if (c == '\n') {
+      OUT("\\n");
+    } else if (c < 0x20 || c >= 0x7f) {
+      OUT("\\%03o", c);
+    } else {
+      OUT("%c", c);
+    }
+  }
+  OUT("\"");
+}
+
+static void emit_function_name(CGen *cg, Function *function) {
+  OUT("fn_%s_%zu", function->name, function->location);
+}
+
+static void emit_check_numbers(CGen *cg, int d, const char *op) {
+  OUT("  aot_check_numbers(\"%s\", s%d, s%d);\n", op, d - 2, d - 1);
+}
+
+static void emit_binary(CGen *cg, int d, const char *wrapper, const char *op) {
+  emit_check_numbers(cg, d, op);
+  OUT("  s%d = %s(AS_NUM(s%d) %s AS_NUM(s%d));\n", d - 2, wrapper, d - 2, op,
+      d - 1);
+}
+
+static void emit_bitwise(CGen *cg, int d, const char *op) {
+  OUT("  s%d = NUM_VAL((double)(aot_clamp(AS_NUM(s%d)) %s "
+      "aot_clamp(AS_NUM(s%d))));\n",
+      d - 2, d - 2, op, d - 1);
+}
+
+static bool is_reachable(CGen *cg, Function *function) {
+  return function->location < cg->code->code.count &&
+         cg->depths[function->location] != UNREACHABLE;
+}
+
+static void emit_instruction(CGen *cg, size_t offset) {
+  Bytecode *code = cg->code;
+  uint8_t *p = &code->code.data[offset];
+  int d = cg->depths[offset];
+
+  switch (*p) {
+  case OP_PRINT:
+    OUT("  aot_print(s%d);\n", d - 1);
+    break;
+  case OP_ADD:
+    emit_binary(cg, d, "NUM_VAL", "+");
+    break;
+  case OP_SUB:
+    emit_binary(cg, d, "NUM_VAL", "-");
+    break;
+  case OP_MUL:
+    emit_binary(cg, d, "NUM_VAL", "*");
+    break;
+  case OP_DIV:
+    emit_binary(cg, d, "NUM_VAL", "/");
+    break;
+  case OP_MOD:
+    emit_check_numbers(cg, d, "%");
+    OUT("  s%d = NUM_VAL(fmod(AS_NUM(s%d), AS_NUM(s%d)));\n", d - 2, d - 2,
+        d - 1);
+    break;
+  case OP_EQ:
+    OUT("  s%d = aot_eq(s%d, s%d);\n", d - 2, d - 2, d - 1);
+    break;
+  case OP_GT:
+    emit_binary(cg, d, "BOOL_VAL", ">");
+    break;
+  case OP_LT:
+    emit_binary(cg, d, "BOOL_VAL", "<");
+    break;
+  case OP_NOT:
+    OUT("  s%d = BOOL_VAL(!AS_BOOL(s%d));\n", d - 1, d - 1);
+    break;
+  case OP_NEG:
+    OUT("  s%d = NUM_VAL(-AS_NUM(s%d));\n", d - 1, d - 1);
+    break;
+  case OP_TRUE:
+    OUT("  s%d = BOOL_VAL(true);\n", d);
+    break;
+  case OP_NULL:
+    OUT("  s%d = NULL_VAL;\n", d);
+    break;
+  case OP_CONST: {
+    /* Through the bits, so that -0, the infinities and the nans come
+     * out as the very same doubles. */
+    uint64_t bits;
+    memcpy(&bits, &cg->code->cp.data[operand_at(p, 0)], sizeof(bits));
+    OUT("  s%d = NUM_VAL(aot_num_from_bits(0x%016llxULL));\n", d,
+        (unsigned long long)bits);
+    break;
+  }
+  case OP_STR:
+    OUT("  s%d = IMMORTAL_STRING_VAL(strings[%u]);\n", d, operand_at(p, 0));
+    break;
+  case OP_JMP:
+    OUT("  goto L%zu;\n", jump_target(code->code.data, offset));
+    break;
+  case OP_JZ:
+    OUT("  if (!AS_BOOL(s%d))\n    goto L%zu;\n", d - 1,
+        jump_target(code->code.data, offset));
+    break;
+  case OP_BITAND:
+    emit_bitwise(cg, d, "&");
+    break;
+  case OP_BITOR:
+    emit_bitwise(cg, d, "|");
+    break;
+  case OP_BITXOR:
+    emit_bitwise(cg, d, "^");
+    break;
+  case OP_BITNOT:
+    OUT("  s%d = NUM_VAL((double)~aot_clamp(AS_NUM(s%d)));\n", d - 1, d - 1);
+    break;
+  case OP_BITSHL:
+    emit_bitwise(cg, d, "<<");
+    break;
+  case OP_BITSHR:
+    emit_bitwise(cg, d, ">>");
+    break;
+  case OP_SET_GLOBAL: {
+    uint32_t slot = operand_at(p, 0);
+    OUT("  objdecref(&globals[%u]);\n", slot);
+    OUT("  globals[%u] = s%d;\n", slot, d - 1);
+    break;
+  }
+  case OP_GET_GLOBAL:
+    OUT("  s%d = globals[%u];\n", d, operand_at(p, 0));
+    OUT("  objincref(&s%d);\n", d);
+    break;
+  case OP_GET_GLOBAL_PTR:
+    OUT("  s%d = PTR_VAL(&globals[%u]);\n", d, operand_at(p, 0));
+    break;
+  case OP_DEEPSET: {
+    uint32_t idx = operand_at(p, 0);
+    OUT("  aot_drop(s%u);\n", idx);
+    OUT("  s%u = s%d;\n", idx, d - 1);
+    break;
+  }
+  case OP_DEEPGET:
+    OUT("  s%d = s%u;\n", d, operand_at(p, 0));
+    OUT("  objincref(&s%d);\n", d);
+    break;
+  case OP_DEEPGET_PTR:
+    OUT("  s%d = PTR_VAL(&s%u);\n", d, operand_at(p, 0));
+    break;
+  case OP_SETATTR:
+    OUT("  aot_setattr(s%d, s%d, sp[%u], &property_caches[%u]);\n", d - 2,
+        d - 1, operand_at(p, 0), operand_at(p, 1));
+    break;
+  case OP_GETATTR:
+    OUT("  s%d = aot_getattr(s%d, sp[%u], &property_caches[%u]);\n", d - 1,
+        d - 1, operand_at(p, 0), operand_at(p, 1));
+    break;
+  case OP_GETATTR_PTR:
+    OUT("  s%d = aot_getattr_ptr(s%d, sp[%u], &property_caches[%u]);\n", d - 1,
+        d - 1, operand_at(p, 0), operand_at(p, 1));
+    break;
+  case OP_STRUCT:
+    OUT("  s%d = aot_struct(&blueprints, strings[%u]);\n", d,
+        operand_at(p, 0));
+    break;
+  case OP_STRUCT_BLUEPRINT: {
+    uint32_t propcount = operand_at(p, 1);
+    OUT("  aot_blueprint(&blueprints, sp[%u], %u, ", operand_at(p, 0),
+        propcount);
+    if (propcount == 0) {
+      OUT("NULL, NULL);\n");
+      break;
+    }
+    OUT("(char *[]){");
+    for (size_t i = 0; i < propcount; i++) {
+      OUT("%ssp[%u]", i ? ", " : "", operand_at(p, 2 + i * 2));
+    }
+    OUT("}, (uint32_t[]){");
+    for (size_t i = 0; i < propcount; i++) {
+      OUT("%s%u", i ? ", " : "", operand_at(p, 2 + i * 2 + 1));
+    }
+    OUT("});\n");
+    break;
+  }
+  case OP_IMPL: {
+    uint32_t method_count = operand_at(p, 1);
+    OUT("  aot_impl(&blueprints, sp[%u], %u, ", operand_at(p, 0),
+        method_count);
+    if (method_count == 0) {
+      OUT("NULL, NULL, NULL);\n");
+      break;
+    }
+    const char *parts[] = {"(char *[]){", "}, (uint32_t[]){",
+                           "}, (uint32_t[]){"};
+    for (size_t part = 0; part < 3; part++) {
+      OUT("%s", parts[part]);
+      for (size_t i = 0; i < method_count; i++) {
+        uint32_t x = operand_at(p, 2 + i * 3 + part);
+        OUT(part == 0 ? "%ssp[%u]" : "%s%u", i ? ", " : "", x);
+      }
+    }
+    OUT("});\n");
+    break;
+  }
+  case OP_CALL: {
+    uint32_t argcount = operand_at(p, 0);
+    OUT("  s%d = ", d - (int)argcount);
+    emit_function_name(cg, find_function(code, call_target(code, offset)));
+    OUT("(");
+    for (int i = d - argcount; i < d; i++) {
+      OUT("%ss%d", i > d - (int)argcount ? ", " : "", i);
+    }
+    OUT(");\n");
+    break;
+  }
+  case OP_CALL_METHOD: {
+    uint32_t argcount = operand_at(p, 1);
+    int self = d - argcount - 1;
+    OUT("  s%d = call_method(aot_resolve_method(&method_caches[%u], s%d, "
+        "sp[%u], %u), (Object[]){",
+        self, operand_at(p, 2), self, operand_at(p, 0), argcount);
+    for (int i = self; i < d; i++) {
+      OUT("%ss%d", i > self ? ", " : "", i);
+    }
+    OUT("});\n");
+    break;
+  }
+  case OP_TAILCALL: {
+    uint32_t argcount = operand_at(p, 0);
+    for (int i = 0; i < d - (int)argcount; i++) {
+      OUT("  aot_drop(s%d);\n", i);
+    }
+    OUT("  return ");
+    emit_function_name(cg, find_function(code, call_target(code, offset)));
+    OUT("(");
+    for (int i = d - argcount; i < d; i++) {
+      OUT("%ss%d", i > d - (int)argcount ? ", " : "", i);
+    }
+    OUT(");\n");
+    break;
+  }
+  case OP_TAILCALL_METHOD: {
+    /* call_method() would take the address of the arguments, which
+     * rules out a sibling call, so the switch is done right here. */
+    uint32_t argcount = operand_at(p, 1);
+    int self = d - argcount - 1;
+    for (int i = 0; i < self; i++) {
+      OUT("  aot_drop(s%d);\n", i);
+    }
+    OUT("  switch (aot_resolve_method(&method_caches[%u], s%d, sp[%u], %u)) "
+        "{\n",
+        operand_at(p, 2), self, operand_at(p, 0), argcount);
+    for (size_t i = 0; i < code->functions.count; i++) {
+      Function *function = &code->functions.data[i];
+      if (function->paramcount != argcount + 1 ||
+          !is_reachable(cg, function)) {
+        continue;
+      }
+      OUT("  case %zu:\n    return ", function->location);
+      emit_function_name(cg, function);
+      OUT("(");
+      for (int j = self; j < d; j++) {
+        OUT("%ss%d", j > self ? ", " : "", j);
+      }
+      OUT(");\n");
+    }
+    OUT("  default:\n    abort();\n  }\n");
+    break;
+  }
+  case OP_RET:
+    for (int i = 0; i < d - 1; i++) {
+      OUT("  aot_drop(s%d);\n", i);
+    }
+    OUT("  return s%d;\n", d - 1);
+    break;
+  case OP_POP:
+    OUT("  aot_drop(s%d);\n", d - 1);
+    break;
+  case OP_DEREF:
+    OUT("  s%d = aot_deref(s%d);\n", d - 1, d - 1);
+    break;
+  case OP_DEREFSET:
+    OUT("  *AS_PTR(s%d) = s%d;\n", d - 2, d - 1);
+    break;
+  case OP_STRCAT:
+    OUT("  s%d = aot_strcat(s%d, s%d);\n", d - 2, d - 2, d - 1);
+    break;
+  case OP_ARRAY: {
+    uint32_t count = operand_at(p, 0);
+    if (count == 0) {
+      OUT("  s%d = aot_array(0, NULL);\n", d);
+      break;
+    }
+    /* The elements are popped off the stack, so the top comes first. */
+    OUT("  s%d = aot_array(%u, (Object[]){", d - (int)count, count);
+    for (int i = d - 1; i >= d - (int)count; i--) {
+      OUT("%ss%d", i < d - 1 ? ", " : "", i);
+    }
+    OUT("});\n");
+    break;
+  }
+  case OP_ARRAYSET:
+    OUT("  aot_arrayset(s%d, s%d, s%d);\n", d - 3, d - 2, d - 1);
+    break;
+  case OP_SUBSCRIPT:
+    OUT("  s%d = aot_subscript(s%d, s%d);\n", d - 2, d - 2, d - 1);
+    break;
+  case OP_HLT:
+    OUT("  return;\n");
+    break;
+  default:
+    break;
+  }
+}
+
+static void emit_body(CGen *cg) {
+  Bytecode *code = cg->code;
+  for (size_t offset = 0; offset < code->code.count;
+       offset += instruction_length(code, offset)) {
+    if (!cg->owned[offset]) {
+      continue;
+    }
+    if (cg->labels[offset]) {
+      OUT("L%zu:;\n", offset);
+    }
+
+    size_t following = offset + instruction_length(code, offset);
+    while (following < code->code.count && !cg->owned[following]) {
+      following += instruction_length(code, following);
+    }
+
+    /* A jump to the next instruction emitted (over a function that is
+     * defined in between) is left out. */
+    uint8_t *p = &code->code.data[offset];
+    if (*p == OP_JMP && jump_target(code->code.data, offset) == following) {
+      continue;
+    }
+
+    emit_instruction(cg, offset);
+
+    /* Jump to the instruction this one falls through to, unless that
+     * is the next one emitted. */
+    size_t next = fallthrough(code, offset);
+    if (next && next != following) {
+      OUT("  goto L%zu;\n", next);
+    }
+  }
+}
+
+static void emit_slots(CGen *cg, int first, int slots) {
+  if (first >= slots) {
+    return;
+  }
+  OUT("  Object");
+  for (int i = first; i < slots; i++) {
+    OUT("%s s%d", i > first ? "," : "", i);
+  }
+  OUT(";\n");
+}
+
+static void emit_prototype(CGen *cg, Function *function) {
+  OUT("static Object ");
+  emit_function_name(cg, function);
+  OUT("(");
+  for (size_t i = 0; i < function->paramcount; i++) {
+    OUT("%sObject s%zu", i ? ", " : "", i);
+  }
+  OUT("%s)", function->paramcount ? "" : "void");
+}
+
+static void emit_prologue(CGen *cg, bool calls_methods) {
+  Bytecode *code = cg->code;
+
+  OUT("/* Generated by venom --emit-c. */\n\n");
+  OUT("#include \"aot.h\"\n\n");
+
+  if (code->sp.count > 0) {
+    OUT("static char *sp[] = {\n");
+    for (size_t i = 0; i < code->sp.count; i++) {
+      OUT("    ");
+      emit_string(cg, code->sp.data[i]);
+      OUT(",\n");
+    }
+    OUT("};\n\n");
+  }
+
+  /* The immortal Strings of the literals (see load_strings() in vm.c). */
+  if (code->sp.count > 0) {
+    OUT("static String *strings[%zu];\n\n", code->sp.count);
+  }
+
+  OUT("static Object globals[%zu];\n",
+      code->globals.count ? code->globals.count : 1);
+  OUT("static Table_StructBlueprint blueprints;\n");
+  if (code->property_caches.count > 0) {
+    OUT("static PropertyCache property_caches[%zu];\n",
+        code->property_caches.count);
+  }
+  if (code->method_caches.count > 0) {
+    OUT("static MethodCache method_caches[%zu];\n", code->method_caches.count);
+  }
+  OUT("\n");
+
+  for (size_t i = 0; i < code->functions.count; i++) {
+    if (is_reachable(cg, &code->functions.data[i])) {
+      emit_prototype(cg, &code->functions.data[i]);
+      OUT(";\n");
+    }
+  }
+  OUT("\n");
+
+  if (!calls_methods) {
+    return;
+  }
+
+  OUT("static Object call_method(uint32_t location, Object *args) {\n");
+  OUT("  switch (location) {\n");
+  for (size_t i = 0; i < code->functions.count; i++) {
+    Function *function = &code->functions.data[i];
+    if (!is_reachable(cg, function)) {
+      continue;
+    }
+    OUT("  case %zu:\n    return ", function->location);
+    emit_function_name(cg, function);
+    OUT("(");
+    for (size_t j = 0; j < function->paramcount; j++) {
+      OUT("%sargs[%zu]", j ? ", " : "", j);
+    }
+    OUT(");\n");
+  }
+  OUT("  default:\n    abort();\n  }\n}\n\n");
+}
+
+bool emit_c(Bytecode *code, FILE *out) {
+  CGen cgen = {.code = code, .out = out, .depths = compute_depths(code)};
+  CGen *cg = &cgen;
+
+  if (!cg->depths) {
+    return false;
+  }
+  if (!check(cg)) {
+    free(cg->depths);
+    return false;
+  }
+
+  bool calls_methods = false;
+  for (size_t offset = 0; offset < code->code.count;
+       offset += instruction_length(code, offset)) {
+    if (cg->depths[offset] != UNREACHABLE &&
+        code->code.data[offset] == OP_CALL_METHOD) {
+      calls_methods = true;
+    }
+  }
+
+  cg->owned = malloc(code->code.count);
+  cg->labels = malloc(code->code.count);
+
+  emit_prologue(cg, calls_methods);
+
+  for (size_t i = 0; i < code->functions.count; i++) {
+    Function *function = &code->functions.data[i];
+    if (!is_reachable(cg, function)) {
+      continue;
+    }
+    int slots = collect(cg, function->location);
+    emit_prototype(cg, function);
+    OUT(" {\n");
+    emit_slots(cg, function->paramcount, slots);
+    emit_body(cg);
+    OUT("}\n\n");
+  }
+
+  int slots = collect(cg, 0);
+  OUT("static void run_toplevel(void) {\n");
+  emit_slots(cg, 0, slots);
+  emit_body(cg);
+  OUT("}\n\n");
+
+  OUT("int main(void) {\n");
+  if (code->globals.count > 0) {
+    OUT("  for (size_t i = 0; i < %zu; i++) {\n", code->globals.count);
+    OUT("    globals[i] = NULL_VAL;\n");
+    OUT("  }\n");
+  }
+  if (code->sp.count > 0) {
+    OUT("  aot_load_strings(strings, sp, %zu);\n", code->sp.count);
+  }
+  OUT("  run_toplevel();\n");
+  OUT("  aot_free(globals, %zu, &blueprints);\n", code->globals.count);
+  if (code->sp.count > 0) {
+    OUT("  aot_free_strings(strings, %zu);\n", code->sp.count);
+  }
+  OUT("  return 0;\n");
+  OUT("}\n");
+
+  free(cg->owned);
+  free(cg->labels);
+  free(cg->depths);
+  return true;
+}
@@ -0,0 +1,11 @@
+#ifndef venom_cgen_h
+#define venom_cgen_h
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "compiler.h"
+
+bool emit_c(Bytecode *code, FILE *out);
+
+#endif
@@ -6,6 +6,8 @@
 #include <string.h>
 
 #include "compiler.h"
+#include "fold.h"
+#include "optimizer.h"
 
 #ifdef venom_debug_compiler
 static bool is_last(struct module *parent, struct module *child) {
@@ -53,9 +55,14 @@ static void print_module_tree(Compiler *compiler, struct module *parent,
     exit(1);                                                                   \
   } while (0)
 
+/* The loop start of a loop whose 'continue' jumps forward, since the
+ * code it continues at is only emitted after the body. */
+#define CONTINUE_FORWARD -1
+
 void init_compiler(Compiler *compiler) {
   memset(compiler, 0, sizeof(Compiler));
   compiler->functions = calloc(1, sizeof(Table_Function));
+  compiler->inlinable = calloc(1, sizeof(Table_StmtFn));
   compiler->struct_blueprints = calloc(1, sizeof(Table_StructBlueprint));
   compiler->compiled_modules = calloc(1, sizeof(Table_module_ptr));
 }
@@ -93,6 +100,15 @@ void free_table_functions(Table_Function *table) {
   }
 }
 
+void free_table_inlinable(Table_StmtFn *table) {
+  for (size_t i = 0; i < TABLE_MAX; i++) {
+    if (table->indexes[i] != NULL) {
+      Bucket *bucket = table->indexes[i];
+      list_free(bucket);
+    }
+  }
+}
+
 void free_table_compiled_modules(Table_module_ptr *table) {
   for (size_t i = 0; i < TABLE_MAX; i++) {
     if (table->indexes[i] != NULL) {
@@ -108,16 +124,25 @@ void free_table_compiled_modules(Table_module_ptr *table) {
 }
 
 void free_compiler(Compiler *compiler) {
-  dynarray_free(&compiler->globals);
   dynarray_free(&compiler->locals);
   dynarray_free(&compiler->breaks);
+  dynarray_free(&compiler->continues);
   dynarray_free(&compiler->loop_starts);
   dynarray_free(&compiler->loop_depths);
+  dynarray_free(&compiler->far_jumps);
+  dynarray_free(&compiler->inlined);
+  dynarray_free(&compiler->inline_exits);
+  for (size_t i = 0; i < compiler->imported.count; i++) {
+    free_stmt(compiler->imported.data[i]);
+  }
+  dynarray_free(&compiler->imported);
   free_table_struct_blueprints(compiler->struct_blueprints);
   free_table_functions(compiler->functions);
+  free_table_inlinable(compiler->inlinable);
   free_table_compiled_modules(compiler->compiled_modules);
   free(compiler->struct_blueprints);
   free(compiler->functions);
+  free(compiler->inlinable);
   free(compiler->compiled_modules);
 }
 
@@ -125,7 +150,15 @@ void init_chunk(Bytecode *code) { memset(code, 0, sizeof(Bytecode)); }
 
 void free_chunk(Bytecode *code) {
   dynarray_free(&code->code);
+  dynarray_free(&code->cp);
   dynarray_free(&code->sp);
+  dynarray_free(&code->globals);
+  dynarray_free(&code->property_caches);
+  dynarray_free(&code->method_caches);
+  for (size_t i = 0; i < code->functions.count; i++) {
+    free(code->functions.data[i].name);
+  }
+  dynarray_free(&code->functions);
 }
 
 static void begin_scope(Compiler *compiler) { compiler->depth++; }
@@ -138,6 +171,20 @@ static void end_scope(Compiler *compiler) {
   compiler->depth--;
 }
 
+/* Check if the constant is already present in the cp.
+ * If not, add it first, and finally return the idx. The
+ * constants are compared bit by bit, so that 0 and -0
+ * get a slot each. */
+static uint32_t add_constant(Bytecode *code, double x) {
+  for (size_t idx = 0; idx < code->cp.count; idx++) {
+    if (memcmp(&code->cp.data[idx], &x, sizeof(double)) == 0) {
+      return idx;
+    }
+  }
+  dynarray_insert(&code->cp, x);
+  return code->cp.count - 1;
+}
+
 /* Check if the string is already present in the sp.
  * If not, add it first, and finally return the idx. */
 static uint32_t add_string(Bytecode *code, char *string) {
@@ -164,23 +211,64 @@ static void emit_bytes(Bytecode *code, int n, ...) {
   va_end(ap);
 }
 
-static void emit_uint32(Bytecode *code, uint32_t idx) {
-  emit_bytes(code, 4, (idx >> 24) & 0xFF, (idx >> 16) & 0xFF, (idx >> 8) & 0xFF,
-             idx & 0xFF);
+/* Emit the operand in its short form if it fits in a
+ * byte, and in the wide form otherwise (see compiler.h). */
+static void emit_operand(Bytecode *code, uint32_t operand) {
+  if (operand < OPERAND_WIDE) {
+    emit_byte(code, operand);
+    return;
+  }
+  uint8_t bytes[sizeof(operand)];
+  memcpy(bytes, &operand, sizeof(operand));
+  emit_byte(code, OPERAND_WIDE);
+  for (size_t i = 0; i < sizeof(operand); i++) {
+    emit_byte(code, bytes[i]);
+  }
+}
+
+static void emit_offset(Bytecode *code, int16_t offset) {
+  uint8_t bytes[sizeof(offset)];
+  memcpy(bytes, &offset, sizeof(offset));
+  emit_bytes(code, 2, bytes[0], bytes[1]);
+}
+
+static void emit_wide_offset(Bytecode *code, int32_t offset) {
+  uint8_t bytes[sizeof(offset)];
+  memcpy(bytes, &offset, sizeof(offset));
+  emit_offset(code, JUMP_WIDE);
+  emit_bytes(code, 4, bytes[0], bytes[1], bytes[2], bytes[3]);
+}
+
+static bool fits_short_jump(int64_t offset) {
+  return offset > JUMP_WIDE && offset <= INT16_MAX;
+}
+
+/* Emit the offset of the jump whose opcode was just emitted, in the
+ * short form if it fits in it, and in the wide form otherwise. The
+ * 'offset' is relative to the end of the short form, and since the
+ * wide form is 4 bytes longer, it is adjusted for that. */
+static void emit_jump_offset(Bytecode *code, int32_t offset) {
+  if (fits_short_jump(offset)) {
+    emit_offset(code, offset);
+  } else {
+    emit_wide_offset(code, offset - 4);
+  }
+}
+
+/* Allocate an empty inline cache for the property access
+ * instruction that was just emitted, and emit its index. */
+static void emit_property_cache(Bytecode *code) {
+  PropertyCache cache = {.blueprint = NULL, .idx = 0};
+  dynarray_insert(&code->property_caches, cache);
+  emit_operand(code, code->property_caches.count - 1);
 }
 
-static void emit_double(Bytecode *code, double x) {
-  union {
-    double d;
-    uint64_t raw;
-  } num;
-  num.d = x;
-  emit_bytes(
-      code, 8, (uint8_t)((num.raw >> 56) & 0xFF),
-      (uint8_t)((num.raw >> 48) & 0xFF), (uint8_t)((num.raw >> 40) & 0xFF),
-      (uint8_t)((num.raw >> 32) & 0xFF), (uint8_t)((num.raw >> 24) & 0xFF),
-      (uint8_t)((num.raw >> 16) & 0xFF), (uint8_t)((num.raw >> 8) & 0xFF),
-      (uint8_t)(num.raw & 0xFF));
+/* Allocate an empty inline cache for the method call that
+ * was just emitted, and emit its index. */
+static void emit_method_cache(Bytecode *code) {
+  MethodCache cache = {.count = 0};
+  dynarray_insert(&code->method_caches, cache);
+  emit_operand(code, code->method_caches.count - 1);
 }
 
 static int emit_placeholder(Bytecode *code, Opcode op) {
@@ -190,13 +278,13 @@ static int emit_placeholder(Bytecode *code, Opcode op) {
    *
    * e.g. if `code->code.data` is:
    *
-   * [OP_CONST, a0, a1, a2, a3, // 4-byte operands
-   *  OP_CONST, b0, b1, b2, b3, // 4-byte operands
+   * [OP_CONST, a0,   // 1-byte operand
+   *  OP_CONST, b0,   // 1-byte operand
    *  OP_EQ,
    *  OP_JZ, c0, c1]
    *                 ^-- `code->code.count`
    *
-   * `code->code.count` will be 14. Since the indexing is
+   * `code->code.count` will be 8. Since the indexing is
    * 0-based, the count points just beyond the 2-byte off-
    * set. To get the opcode position, we need to go back 3
    * slots (two-byte operand + one more slot to adjust for
@@ -204,7 +292,7 @@ static int emit_placeholder(Bytecode *code, Opcode op) {
   return code->code.count - 3;
 }
 
-static void patch_placeholder(Bytecode *code, int op) {
+static void patch_placeholder(Compiler *compiler, Bytecode *code, int op) {
   /* This function takes a zero-based index of the opcode,
    * 'op', and patches the following offset with the numb-
    * er of emitted instructions that come after the opcode
@@ -212,25 +300,36 @@ static void patch_placeholder(Bytecode *code, int op) {
    *
    * For example, if we have:
    *
-   * [OP_CONST, a0, a1, a2, a3, // 4-byte operands
-   *  OP_CONST, b0, b1, b2, b3, // 4-byte operands
+   * [OP_CONST, a0,   // 1-byte operand
+   *  OP_CONST, b0,   // 1-byte operand
    *  OP_EQ,
-   *  OP_JZ, c0, c1,            // 2-byte operand
-   *  OP_STR, d0, d1, d2, d3    // 4-byte operand
+   *  OP_JZ, c0, c1,  // 2-byte operand
+   *  OP_STR, d0      // 1-byte operand
    *  OP_PRINT]
    *             ^-- `code->code.count`
    *
-   * 'op' will be 11. To get the count of emitted instruc-
+   * 'op' will be 5. To get the count of emitted instruc-
    * tions, the count is adjusted by subtracting 1 (so th-
    * at it points to the last element). Then, two is added
    * to the index to account for the two-byte operand that
    * comes after the opcode. The result of the subtraction
    * of these two is the number of emitted bytes, which is
    * used to build a signed 16-bit offset to patch the pl-
-   * aceholder. */
-  int16_t bytes_emitted = (code->code.count - 1) - (op + 2);
-  code->code.data[op + 1] = (bytes_emitted >> 8) & 0xFF;
-  code->code.data[op + 2] = bytes_emitted & 0xFF;
+   * aceholder.
+   *
+   * If the offset does not fit in 16 bits, the jump can't be
+   * widened in place, because the offsets of everything that
+   * was emitted after it are already known elsewhere. So, it
+   * is only recorded here, and widened by relax_jumps() once
+   * the whole program has been compiled. */
+  int64_t bytes_emitted = (code->code.count - 1) - (op + 2);
+  if (!fits_short_jump(bytes_emitted)) {
+    FarJump far = {.at = op, .target = code->code.count};
+    dynarray_insert(&compiler->far_jumps, far);
+    return;
+  }
+  int16_t offset = bytes_emitted;
+  memcpy(&code->code.data[op + 1], &offset, sizeof(offset));
 }
 
 static void emit_loop(Bytecode *code, int loop_start) {
@@ -239,51 +338,53 @@ static void emit_loop(Bytecode *code, int loop_start) {
    * le program on the side:
    *
    *  0: OP_CONST (value: 0)           |                    |
-   *  5: OP_SET_GLOBAL (name: x)       |                    |
-   *  10: OP_GET_GLOBAL (name: x)      |                    |
-   *  15: OP_CONST (value: 5)          |   let x = 0;       |
-   *  20: OP_LT                        |   while (x < 5) {  |
-   *  21: OP_JZ + 2-byte offset: 25    |     print x;       |
-   *  24: OP_GET_GLOBAL (name: x)      |     x = x + 1;     |
-   *  29: OP_PRINT                     |   }                |
-   *  30: OP_GET_GLOBAL (name: x)      |                    |
-   *  35: OP_CONST (value: 1)          |                    |
-   *  40: OP_ADD                       |                    |
-   *  41: OP_SET_GLOBAL (name: x)      |                    |
-   *  46: OP_JMP + 2-byte offset: -39  |                    |
+   *  2: OP_SET_GLOBAL (name: x)       |                    |
+   *  4: OP_GET_GLOBAL (name: x)       |                    |
+   *  6: OP_CONST (value: 5)           |   let x = 0;       |
+   *  8: OP_LT                         |   while (x < 5) {  |
+   *  9: OP_JZ + 2-byte offset: 13     |     print x;       |
+   *  12: OP_GET_GLOBAL (name: x)      |     x = x + 1;     |
+   *  14: OP_PRINT                     |   }                |
+   *  15: OP_GET_GLOBAL (name: x)      |                    |
+   *  17: OP_CONST (value: 1)          |                    |
+   *  19: OP_ADD                       |                    |
+   *  20: OP_SET_GLOBAL (name: x)      |                    |
+   *  22: OP_JMP + 2-byte offset: -21  |                    |
    *
    *
-   * In this case, the loop starts at `10`, OP_GET_GLOBAL.
+   * In this case, the loop starts at `4`, OP_GET_GLOBAL.
    *
-   * After emitting OP_JMP, `code->code.count` will be 47, and
+   * After emitting OP_JMP, `code->code.count` will be 23, and
    * it'll point to just beyond the end of the bytecode. To get
    * back to the beginning of the loop, we need to go backwards
-   * 37 bytes:
+   * 19 bytes:
    *
-   *  `code->code.count` - `loop_start` = 47 - 10 = 37
+   *  `code->code.count` - `loop_start` = 23 - 4 = 19
    *
    * Or do we?
    *
    * By the time the vm is ready to jump, it will have read the
    * 2-byte offset as well, meaning we do not need to jump from
-   * index `46`, but from `48`. So, we need to go back 39 bytes
-   * and not 37, hence the +2 below:
+   * index `22`, but from `24`. So, we need to go back 21 bytes
+   * and not 19, hence the +2 below:
    *
-   *  `code->code.count` + 2 - `loop_start` = 47 + 2 - 10 = 39
+   *  `code->code.count` + 2 - `loop_start` = 23 + 2 - 4 = 21
    *
-   * When we perform the jump, we will be at index `48`, so:
+   * When we perform the jump, we will be at index `24`, so:
    *
-   *   48 - 39 = 9
+   *   24 - 21 = 3
    *
    * Which is one byte before the beginning of the loop.
    *
    * This is exactly where we want to end up because we're rel-
    * ying on the vm to increment the instruction pointer by one
-   * after having previously set it in the op_jmp handler. */
+   * after having previously set it in the op_jmp handler.
+   *
+   * If the loop is too long for a 16-bit offset, the jump is
+   * emitted in its wide form instead. */
   emit_byte(code, OP_JMP);
-  int16_t offset = -(code->code.count + 2 - loop_start);
-  emit_byte(code, (offset >> 8) & 0xFF);
-  emit_byte(code, offset & 0xFF);
+  int32_t offset = -(code->code.count + 2 - loop_start);
+  emit_jump_offset(code, offset);
 }
 
 static void emit_stack_cleanup(Compiler *compiler, Bytecode *code) {
@@ -331,12 +432,16 @@ static void emit_loop_cleanup(Compiler *compiler, Bytecode *code) {
   }
 }
 
-/* Check if 'name' is present in the globals dynarray.
- * If it is, return its index in the sp, otherwise -1. */
+/* Check if 'name' is present in the chunk's global slots.
+ * If it is, return the slot index, otherwise return -1.
+ *
+ * Globals are resolved to slots at compile time, so that
+ * the vm can access them by indexing into a flat array of
+ * objects instead of hashing the name on every access. */
 static int resolve_global(Compiler *compiler, Bytecode *code, char *name) {
-  for (size_t idx = 0; idx < compiler->globals.count; idx++) {
-    if (strcmp(compiler->globals.data[idx], name) == 0) {
-      return add_string(code, name);
+  for (size_t idx = 0; idx < code->globals.count; idx++) {
+    if (strcmp(code->globals.data[idx], name) == 0) {
+      return idx;
     }
   }
   return -1;
@@ -366,14 +471,15 @@ static void compile_expr_lit(Compiler *compiler, Bytecode *code, Expr exp) {
     break;
   }
   case LIT_NUM: {
+    uint32_t const_idx = add_constant(code, e.as.dval);
     emit_byte(code, OP_CONST);
-    emit_double(code, e.as.dval);
+    emit_operand(code, const_idx);
     break;
   }
   case LIT_STR: {
     uint32_t str_idx = add_string(code, e.as.sval);
     emit_byte(code, OP_STR);
-    emit_uint32(code, str_idx);
+    emit_operand(code, str_idx);
     break;
   }
   case LIT_NULL: {
@@ -393,15 +499,15 @@ static void compile_expr_var(Compiler *compiler, Bytecode *code, Expr exp) {
   if (idx != -1) {
     /* print compiler->locals dynarray in the form [..., ..., ...] */
     emit_byte(code, OP_DEEPGET);
-    emit_uint32(code, idx);
+    emit_operand(code, idx);
     return;
   }
 
   /* Try to resolve the variable as global. */
-  int name_idx = resolve_global(compiler, code, e.name);
-  if (name_idx != -1) {
+  int slot = resolve_global(compiler, code, e.name);
+  if (slot != -1) {
     emit_byte(code, OP_GET_GLOBAL);
-    emit_uint32(code, name_idx);
+    emit_operand(code, slot);
     return;
   }
 
@@ -429,15 +535,15 @@ static void compile_expr_una(Compiler *compiler, Bytecode *code, Expr exp) {
       int idx = resolve_local(compiler, var.name);
       if (idx != -1) {
         emit_byte(code, OP_DEEPGET_PTR);
-        emit_uint32(code, idx);
+        emit_operand(code, idx);
         return;
       }
 
       /* Try to resolve the variable as global. */
-      int name_idx = resolve_global(compiler, code, var.name);
-      if (name_idx != -1) {
+      int slot = resolve_global(compiler, code, var.name);
+      if (slot != -1) {
         emit_byte(code, OP_GET_GLOBAL_PTR);
-        emit_uint32(code, name_idx);
+        emit_operand(code, slot);
         return;
       }
 
@@ -459,7 +565,8 @@ static void compile_expr_una(Compiler *compiler, Bytecode *code, Expr exp) {
        * chunk's sp, and emit OP_GETATTR_PTR. */
       uint32_t property_name_idx = add_string(code, getexp.property_name);
       emit_byte(code, OP_GETATTR_PTR);
-      emit_uint32(code, property_name_idx);
+      emit_operand(code, property_name_idx);
+      emit_property_cache(code);
       break;
     }
     default:
@@ -514,9 +621,11 @@ static void compile_expr_bin(Compiler *compiler, Bytecode *code, Expr exp) {
   }
 }
 
-static void compile_expr_call(Compiler *compiler, Bytecode *code, Expr exp) {
-  ExprCall e = TO_EXPR_CALL(exp);
-
+/* Compile the call 'e'. If it is in 'tail' position, i.e. its result
+ * is returned right away, the call reuses the frame of the caller, so
+ * it does not need to be followed by an OP_RET. */
+static void compile_call(Compiler *compiler, Bytecode *code, ExprCall e,
+                         bool tail) {
   if (e.callee->kind == EXPR_GET) {
     ExprGet getexp = TO_EXPR_GET(*e.callee);
 
@@ -535,10 +644,11 @@ static void compile_expr_call(Compiler *compiler, Bytecode *code, Expr exp) {
       compile_expr(compiler, code, e.arguments.data[i]);
     }
 
-    emit_byte(code, OP_CALL_METHOD);
-    emit_uint32(code, add_string(code, method));
+    emit_byte(code, tail ? OP_TAILCALL_METHOD : OP_CALL_METHOD);
+    emit_operand(code, add_string(code, method));
 
-    emit_uint32(code, e.arguments.count);
+    emit_operand(code, e.arguments.count);
+    emit_method_cache(code);
 
   } else if (e.callee->kind == EXPR_VAR) {
     ExprVar var = TO_EXPR_VAR(*e.callee);
@@ -561,22 +671,20 @@ static void compile_expr_call(Compiler *compiler, Bytecode *code, Expr exp) {
       compile_expr(compiler, code, e.arguments.data[i]);
     }
 
-    /* Emit OP_CALL followed by the argument count. */
-    emit_byte(code, OP_CALL);
-    emit_uint32(code, e.arguments.count);
-
-    /* Emit the direct OP_JMP to the function's location. The
-     * length of the jump sequence (OP_JMP + two-byte offset,
-     * which is 3), needs to be taken into the account, beca-
-     * use by the time the VM executes this jump, it will ha-
-     * ve read both the jump and the offset, which means that
-     * effectively, we'll not be jumping from the current lo-
-     * cation, but three slots after it. */
-    int16_t jump = -(code->code.count + 3 - func->location);
-    emit_bytes(code, 3, OP_JMP, (jump >> 8) & 0xFF, jump & 0xFF);
+    /* Emit OP_CALL followed by the argument count and the
+     * location of the function. The location is absolute, so
+     * it does not depend on where the call is, and the vm can
+     * go there without a separate OP_JMP. */
+    emit_byte(code, tail ? OP_TAILCALL : OP_CALL);
+    emit_operand(code, e.arguments.count);
+    emit_operand(code, func->location);
   }
 }
 
+static void compile_expr_call(Compiler *compiler, Bytecode *code, Expr exp) {
+  compile_call(compiler, code, TO_EXPR_CALL(exp), false);
+}
+
 static void compile_expr_get(Compiler *compiler, Bytecode *code, Expr exp) {
   ExprGet e = TO_EXPR_GET(exp);
 
@@ -589,9 +697,11 @@ static void compile_expr_get(Compiler *compiler, Bytecode *code, Expr exp) {
     emit_byte(code, OP_DEREF);
   }
 
-  /* Emit OP_GETATTR with the index of the property name. */
+  /* Emit OP_GETATTR with the index of the property name,
+   * followed by the index of its inline cache. */
   emit_byte(code, OP_GETATTR);
-  emit_uint32(code, add_string(code, e.property_name));
+  emit_operand(code, add_string(code, e.property_name));
+  emit_property_cache(code);
 }
 
 static void handle_specop(Bytecode *code, const char *op) {
@@ -615,6 +725,8 @@ static void handle_specop(Bytecode *code, const char *op) {
     emit_byte(code, OP_BITSHR);
   else if (strcmp(op, "<<=") == 0)
     emit_byte(code, OP_BITSHL);
+  else if (strcmp(op, "++=") == 0)
+    emit_byte(code, OP_STRCAT);
 }
 
 static void compile_assign_var(Compiler *compiler, Bytecode *code, ExprAssign e,
@@ -642,7 +754,7 @@ static void compile_assign_var(Compiler *compiler, Bytecode *code, ExprAssign e,
   if (is_compound) {
     /* Get the variable onto the top of the stack. */
     emit_byte(code, is_global ? OP_GET_GLOBAL : OP_DEEPGET);
-    emit_uint32(code, idx);
+    emit_operand(code, idx);
 
     /* Compile the right-hand side. */
     compile_expr(compiler, code, *e.rhs);
@@ -657,7 +769,7 @@ static void compile_assign_var(Compiler *compiler, Bytecode *code, ExprAssign e,
 
   /* Emit the appropriate assignment opcode. */
   emit_byte(code, is_global ? OP_SET_GLOBAL : OP_DEEPSET);
-  emit_uint32(code, idx);
+  emit_operand(code, idx);
 }
 
 static void compile_assign_get(Compiler *compiler, Bytecode *code, ExprAssign e,
@@ -675,7 +787,8 @@ static void compile_assign_get(Compiler *compiler, Bytecode *code, ExprAssign e,
   if (is_compound) {
     /* Get the property onto the top of the stack. */
     emit_byte(code, OP_GETATTR);
-    emit_uint32(code, add_string(code, getexp.property_name));
+    emit_operand(code, add_string(code, getexp.property_name));
+    emit_property_cache(code);
 
     /* Compile the right-hand side of the assignment. */
     compile_expr(compiler, code, *e.rhs);
@@ -688,7 +801,8 @@ static void compile_assign_get(Compiler *compiler, Bytecode *code, ExprAssign e,
 
   /* Set the property name to the rhs of the get expr. */
   emit_byte(code, OP_SETATTR);
-  emit_uint32(code, add_string(code, getexp.property_name));
+  emit_operand(code, add_string(code, getexp.property_name));
+  emit_property_cache(code);
 
   /* Pop the struct off the stack. */
   emit_byte(code, OP_POP);
@@ -787,9 +901,9 @@ static void compile_expr_log(Compiler *compiler, Bytecode *code, Expr exp) {
     int end_jump = emit_placeholder(code, OP_JZ);
     compile_expr(compiler, code, *e.rhs);
     int false_jump = emit_placeholder(code, OP_JMP);
-    patch_placeholder(code, end_jump);
+    patch_placeholder(compiler, code, end_jump);
     emit_bytes(code, 2, OP_TRUE, OP_NOT);
-    patch_placeholder(code, false_jump);
+    patch_placeholder(compiler, code, false_jump);
   } else if (strcmp(e.op, "||") == 0) {
     /* For logical OR, we need to short-circuit when the left-hand side
      * is truthy.
@@ -816,9 +930,9 @@ static void compile_expr_log(Compiler *compiler, Bytecode *code, Expr exp) {
     int true_jump = emit_placeholder(code, OP_JZ);
     emit_byte(code, OP_TRUE);
     int end_jump = emit_placeholder(code, OP_JMP);
-    patch_placeholder(code, true_jump);
+    patch_placeholder(compiler, code, true_jump);
     compile_expr(compiler, code, *e.rhs);
-    patch_placeholder(code, end_jump);
+    patch_placeholder(compiler, code, end_jump);
   }
 }
 
@@ -854,7 +968,7 @@ static void compile_expr_struct(Compiler *compiler, Bytecode *code, Expr exp) {
   /* Everything is OK, we emit OP_STRUCT followed by
    * struct's name index in the string pool. */
   emit_byte(code, OP_STRUCT);
-  emit_uint32(code, add_string(code, blueprint->name));
+  emit_operand(code, add_string(code, blueprint->name));
 
   /* Finally, we compile the initializers. */
   for (size_t i = 0; i < e.initializers.count; i++) {
@@ -872,9 +986,10 @@ static void compile_expr_s_init(Compiler *compiler, Bytecode *code, Expr exp) {
   ExprVar property = TO_EXPR_VAR(*e.property);
 
   /* Finally, we emit OP_SETATTR with the property's
-   * name index. */
+   * name index and the index of its inline cache. */
   emit_byte(code, OP_SETATTR);
-  emit_uint32(code, add_string(code, property.name));
+  emit_operand(code, add_string(code, property.name));
+  emit_property_cache(code);
 }
 
 static void compile_expr_array(Compiler *compiler, Bytecode *code, Expr exp) {
@@ -890,7 +1005,7 @@ static void compile_expr_array(Compiler *compiler, Bytecode *code, Expr exp) {
 
   /* Then, we emit OP_ARRAY and the number of elements. */
   emit_byte(code, OP_ARRAY);
-  emit_uint32(code, e.elements.count);
+  emit_operand(code, e.elements.count);
 }
 
 static void compile_expr_subscript(Compiler *compiler, Bytecode *code,
@@ -934,9 +1049,254 @@ static void compile_expr(Compiler *compiler, Bytecode *code, Expr exp) {
   expression_handler[exp.kind].fn(compiler, code, exp);
 }
 
+static bool is_variable(Expr exp, char *name) {
+  return exp.kind == EXPR_VAR && strcmp(TO_EXPR_VAR(exp).name, name) == 0;
+}
+
+/* What scan_stmt() finds out about the body of the function 'name'. */
+typedef struct {
+  char *name;
+  size_t nodes;
+  bool calls_itself;
+  bool declares;      /* anything other than locals */
+  bool takes_address; /* with the '&' operator */
+} BodyScan;
+
+static void scan_stmt(BodyScan *scan, Stmt stmt);
+
+static void scan_expr(BodyScan *scan, Expr exp) {
+  scan->nodes++;
+  switch (exp.kind) {
+  case EXPR_UNA: {
+    ExprUnary e = TO_EXPR_UNA(exp);
+    if (strcmp(e.op, "&") == 0) {
+      scan->takes_address = true;
+    }
+    scan_expr(scan, *e.exp);
+    break;
+  }
+  case EXPR_BIN:
+    scan_expr(scan, *TO_EXPR_BIN(exp).lhs);
+    scan_expr(scan, *TO_EXPR_BIN(exp).rhs);
+    break;
+  case EXPR_CALL: {
+    ExprCall e = TO_EXPR_CALL(exp);
+    if (is_variable(*e.callee, scan->name)) {
+      scan->calls_itself = true;
+    } else if (e.callee->kind == EXPR_GET) {
+      scan_expr(scan, *TO_EXPR_GET(*e.callee).exp);
+    }
+    for (size_t i = 0; i < e.arguments.count; i++) {
+      scan_expr(scan, e.arguments.data[i]);
+    }
+    break;
+  }
+  case EXPR_GET:
+    scan_expr(scan, *TO_EXPR_GET(exp).exp);
+    break;
+  case EXPR_ASS:
+    scan_expr(scan, *TO_EXPR_ASS(exp).lhs);
+    scan_expr(scan, *TO_EXPR_ASS(exp).rhs);
+    break;
+  case EXPR_LOG:
+    scan_expr(scan, *TO_EXPR_LOG(exp).lhs);
+    scan_expr(scan, *TO_EXPR_LOG(exp).rhs);
+    break;
+  case EXPR_STRUCT: {
+    ExprStruct e = TO_EXPR_STRUCT(exp);
+    for (size_t i = 0; i < e.initializers.count; i++) {
+      scan_expr(scan, e.initializers.data[i]);
+    }
+    break;
+  }
+  case EXPR_S_INIT:
+    scan_expr(scan, *TO_EXPR_S_INIT(exp).value);
+    break;
+  case EXPR_ARRAY: {
+    ExprArray e = TO_EXPR_ARRAY(exp);
+    for (size_t i = 0; i < e.elements.count; i++) {
+      scan_expr(scan, e.elements.data[i]);
+    }
+    break;
+  }
+  case EXPR_SUBSCRIPT:
+    scan_expr(scan, *TO_EXPR_SUBSCRIPT(exp).expr);
+    scan_expr(scan, *TO_EXPR_SUBSCRIPT(exp).index);
+    break;
+  default:
+    break;
+  }
+}
+
+static void scan_stmt(BodyScan *scan, Stmt stmt) {
+  scan->nodes++;
+  switch (stmt.kind) {
+  case STMT_PRINT:
+    scan_expr(scan, TO_STMT_PRINT(stmt).exp);
+    break;
+  case STMT_LET:
+    scan_expr(scan, TO_STMT_LET(stmt).initializer);
+    break;
+  case STMT_EXPR:
+    scan_expr(scan, TO_STMT_EXPR(stmt).exp);
+    break;
+  case STMT_RETURN:
+    scan_expr(scan, TO_STMT_RETURN(stmt).returnval);
+    break;
+  case STMT_BLOCK: {
+    StmtBlock s = TO_STMT_BLOCK(&stmt);
+    for (size_t i = 0; i < s.stmts.count; i++) {
+      scan_stmt(scan, s.stmts.data[i]);
+    }
+    break;
+  }
+  case STMT_IF: {
+    StmtIf s = TO_STMT_IF(stmt);
+    scan_expr(scan, s.condition);
+    scan_stmt(scan, *s.then_branch);
+    if (s.else_branch != NULL) {
+      scan_stmt(scan, *s.else_branch);
+    }
+    break;
+  }
+  case STMT_WHILE:
+    scan_expr(scan, TO_STMT_WHILE(stmt).condition);
+    scan_stmt(scan, *TO_STMT_WHILE(stmt).body);
+    break;
+  case STMT_FOR: {
+    StmtFor s = TO_STMT_FOR(stmt);
+    scan_expr(scan, s.initializer);
+    scan_expr(scan, s.condition);
+    scan_expr(scan, s.advancement);
+    scan_stmt(scan, *s.body);
+    break;
+  }
+  case STMT_BREAK:
+  case STMT_CONTINUE:
+    break;
+  default:
+    scan->declares = true;
+    break;
+  }
+}
+
+static BodyScan scan_body(StmtFn s) {
+  BodyScan scan = {.name = s.name};
+  scan_stmt(&scan, *s.body);
+  return scan;
+}
+
+/* Whether the function 's' can be inlined at its call sites: it must
+ * not be recursive, it must not declare anything but its locals, its
+ * body must not be larger than INLINE_BUDGET nodes, and it must end
+ * with a return, so that it can't run off the end of the body. */
+static bool is_inlinable(StmtFn s, BodyScan scan) {
+  StmtBlock body = TO_STMT_BLOCK(s.body);
+  return body.stmts.count > 0 &&
+         dynarray_peek(&body.stmts).kind == STMT_RETURN &&
+         !scan.calls_itself && !scan.declares &&
+         scan.nodes <= INLINE_BUDGET;
+}
+
+/* Whether the function 'name' is currently being inlined. A function
+ * that isn't recursive by itself can still be part of a cycle of ca-
+ * lls, which is only inlined once around. */
+static bool is_being_inlined(Compiler *compiler, char *name) {
+  for (size_t i = 0; i < compiler->inlined.count; i++) {
+    if (strcmp(compiler->inlined.data[i].name, name) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void compile_frame_expr(Compiler *compiler, Bytecode *code, Expr exp);
+
+/* Compile the call 'e' to the function 's' by compiling its body in
+ * place, instead of emitting OP_CALL.
+ *
+ * The arguments are pushed like they are for a call, and they become
+ * the parameters in the caller's frame, along with the locals of the
+ * body. To get there, the call has to start with nothing but the lo-
+ * cals on the stack (see compile_frame_expr()), since the compiler
+ * does not keep track of the temporaries, so the frame slot that the
+ * first argument ends up in is the count of compiler->locals.
+ *
+ * While the body is compiled, the locals of the caller are hidden, so
+ * that the names in the body mean what they did in the function. The
+ * returns move the return value down to the slot of the first param-
+ * eter, pop the rest, and jump past the body, leaving the same thing
+ * on the stack as OP_CALL would have. */
+static void compile_inlined_call(Compiler *compiler, Bytecode *code, StmtFn s,
+                                 ExprCall e) {
+  size_t base = compiler->locals.count;
+
+  /* Compile the arguments. Each one takes up a slot of the frame, so
+   * a nameless local stands in for it while the next one is compiled,
+   * which lets the arguments be inlined calls, too. */
+  for (size_t i = 0; i < e.arguments.count; i++) {
+    compile_frame_expr(compiler, code, e.arguments.data[i]);
+    dynarray_insert(&compiler->locals, "");
+  }
+
+  DynArray_char_ptr caller_locals = compiler->locals;
+  compiler->locals = (DynArray_char_ptr){0};
+  for (size_t i = 0; i < base; i++) {
+    dynarray_insert(&compiler->locals, "");
+  }
+  COPY_DYNARRAY(&compiler->locals, &s.parameters);
+
+  InlinedCall call = {
+      .name = s.name, .base = base, .exits = compiler->inline_exits.count};
+  dynarray_insert(&compiler->inlined, call);
+
+  compile(compiler, code, *s.body);
+
+  dynarray_pop(&compiler->inlined);
+
+  int to_patch = compiler->inline_exits.count - call.exits;
+  for (int i = 0; i < to_patch; i++) {
+    int exit_jump = dynarray_pop(&compiler->inline_exits);
+    patch_placeholder(compiler, code, exit_jump);
+  }
+
+  dynarray_free(&compiler->locals);
+  compiler->locals = caller_locals;
+  compiler->locals.count = base;
+}
+
+/* If 'exp' is a direct call to a function that can be inlined there,
+ * return the function, otherwise return NULL. */
+static StmtFn *inlinable_callee(Compiler *compiler, Expr exp) {
+  if (exp.kind != EXPR_CALL || TO_EXPR_CALL(exp).callee->kind != EXPR_VAR) {
+    return NULL;
+  }
+  ExprCall e = TO_EXPR_CALL(exp);
+  char *name = TO_EXPR_VAR(*e.callee).name;
+  StmtFn *s = table_get(compiler->inlinable, name);
+  if (s == NULL || s->body == NULL ||
+      s->parameters.count != e.arguments.count ||
+      is_being_inlined(compiler, name)) {
+    return NULL;
+  }
+  return s;
+}
+
+/* Compile 'exp', which starts out with nothing but the locals on the
+ * stack. If it is a direct call to a function that can be inlined,
+ * it is (see compile_inlined_call()). */
+static void compile_frame_expr(Compiler *compiler, Bytecode *code, Expr exp) {
+  StmtFn *s = inlinable_callee(compiler, exp);
+  if (s != NULL) {
+    compile_inlined_call(compiler, code, *s, TO_EXPR_CALL(exp));
+  } else {
+    compile_expr(compiler, code, exp);
+  }
+}
+
 static void compile_stmt_print(Compiler *compiler, Bytecode *code, Stmt stmt) {
   StmtPrint s = TO_STMT_PRINT(stmt);
-  compile_expr(compiler, code, s.exp);
+  compile_frame_expr(compiler, code, s.exp);
   emit_byte(code, OP_PRINT);
 }
 
@@ -944,7 +1304,7 @@ static void compile_stmt_let(Compiler *compiler, Bytecode *code, Stmt stmt) {
   StmtLet s = TO_STMT_LET(stmt);
 
   /* Compile the initializer. */
-  compile_expr(compiler, code, s.initializer);
+  compile_frame_expr(compiler, code, s.initializer);
 
   /* Add the variable name to the string pool. */
   uint32_t name_idx = add_string(code, s.name);
@@ -954,11 +1314,21 @@ static void compile_stmt_let(Compiler *compiler, Bytecode *code, Stmt stmt) {
    * stack, so we will just make the compiler know
    * it is a local variable, and do some bookkeep-
    * ing regarding the number of variables we need
-   * to pop off the stack when we do stack cleanup. */
+   * to pop off the stack when we do stack cleanup.
+   *
+   * A global gets its slot the first time it's de-
+   * clared. Redeclaring it reuses the same slot. */
   if (compiler->depth == 0) {
-    dynarray_insert(&compiler->globals, s.name);
+    int slot = resolve_global(compiler, code, s.name);
+    if (slot == -1) {
+      if (code->globals.count == GLOBALS_MAX) {
+        COMPILER_ERROR("Too many globals (max: %d).", GLOBALS_MAX);
+      }
+      dynarray_insert(&code->globals, code->sp.data[name_idx]);
+      slot = code->globals.count - 1;
+    }
     emit_byte(code, OP_SET_GLOBAL);
-    emit_uint32(code, name_idx);
+    emit_operand(code, slot);
   } else {
     dynarray_insert(&compiler->locals, code->sp.data[name_idx]);
     compiler->pops[compiler->depth]++;
@@ -968,7 +1338,7 @@ static void compile_stmt_let(Compiler *compiler, Bytecode *code, Stmt stmt) {
 static void compile_stmt_expr(Compiler *compiler, Bytecode *code, Stmt stmt) {
   StmtExpr e = TO_STMT_EXPR(stmt);
 
-  compile_expr(compiler, code, e.exp);
+  compile_frame_expr(compiler, code, e.exp);
 
   /* If the expression statement was just a call, like:
    *
@@ -1002,7 +1372,7 @@ static void compile_stmt_if(Compiler *compiler, Bytecode *code, Stmt stmt) {
   /* We first compile the conditional expression because the VM
   .* expects a bool placed on the stack by the time it encount-
    * ers a conditional jump, that is, OP_JZ. */
-  compile_expr(compiler, code, s.condition);
+  compile_frame_expr(compiler, code, s.condition);
 
   /* Then, we emit OP_JZ, which jumps to the else clause if the
    * condition is falsey. Because we don't know the size of the
@@ -1020,7 +1390,7 @@ static void compile_stmt_if(Compiler *compiler, Bytecode *code, Stmt stmt) {
   int else_jump = emit_placeholder(code, OP_JMP);
 
   /* Then, we patch the then jump because now we know its size. */
-  patch_placeholder(code, then_jump);
+  patch_placeholder(compiler, code, then_jump);
 
   /* Then, we compile the else branch if it exists. */
   if (s.else_branch != NULL) {
@@ -1029,7 +1399,7 @@ static void compile_stmt_if(Compiler *compiler, Bytecode *code, Stmt stmt) {
 
   /* Finally, we patch the else jump. If the else branch wasn't
    * compiled, the offset should be zeroed out. */
-  patch_placeholder(code, else_jump);
+  patch_placeholder(compiler, code, else_jump);
 }
 
 static void compile_stmt_while(Compiler *compiler, Bytecode *code, Stmt stmt) {
@@ -1045,7 +1415,7 @@ static void compile_stmt_while(Compiler *compiler, Bytecode *code, Stmt stmt) {
   /* We then compile the condition because the VM expects a bool
    * placed on the stack by the time it encounters a conditional
    * jump, that is, OP_JZ. */
-  compile_expr(compiler, code, s.condition);
+  compile_frame_expr(compiler, code, s.condition);
 
   /* We then emit OP_JZ which breaks out of the loop if the con-
    * dition is falsey. Because we don't know the size of the by-
@@ -1074,14 +1444,14 @@ static void compile_stmt_while(Compiler *compiler, Bytecode *code, Stmt stmt) {
   int to_pop = compiler->breaks.count - breakcount;
   for (int i = 0; i < to_pop; i++) {
     int break_jump = dynarray_pop(&compiler->breaks);
-    patch_placeholder(code, break_jump);
+    patch_placeholder(compiler, code, break_jump);
   }
 
   /* Pop the loop start. */
   dynarray_pop(&compiler->loop_starts);
 
   /* Finally, we patch the exit jump. */
-  patch_placeholder(code, exit_jump);
+  patch_placeholder(compiler, code, exit_jump);
 
   if (compiler->depth == 0) {
     assert(compiler->breaks.count == 0);
@@ -1089,6 +1459,85 @@ static void compile_stmt_while(Compiler *compiler, Bytecode *code, Stmt stmt) {
   }
 }
 
+static bool is_number(Expr exp) {
+  return exp.kind == EXPR_LIT && TO_EXPR_LIT(exp).kind == LIT_NUM;
+}
+
+/* Whether the 'for' loop over the variable 'name' is a counted loop,
+ * i.e. one that steps the variable by a constant, and compares it ag-
+ * ainst a number or another variable:
+ *
+ *   for (let i = a; i < n; i += 1) { ... } */
+static bool is_counted_loop(StmtFor s, char *name) {
+  if (s.condition.kind != EXPR_BIN || s.advancement.kind != EXPR_ASS) {
+    return false;
+  }
+
+  ExprBin condition = TO_EXPR_BIN(s.condition);
+  ExprAssign advancement = TO_EXPR_ASS(s.advancement);
+
+  return strcmp(condition.op, "<") == 0 && is_variable(*condition.lhs, name) &&
+         (is_number(*condition.rhs) || condition.rhs->kind == EXPR_VAR) &&
+         strcmp(advancement.op, "+=") == 0 &&
+         is_variable(*advancement.lhs, name) && is_number(*advancement.rhs);
+}
+
+/* Compile a counted loop, whose variable has already been initialized.
+ * Unlike the other 'for' loops, it is laid out with the advancement
+ * and the condition after the body:
+ *
+ *         <condition>
+ *         OP_JZ exit
+ *   body: <body>
+ *         <advancement>
+ *         <condition>
+ *         OP_JZ exit
+ *         OP_JMP body
+ *   exit:
+ *
+ * The condition is checked once before the first iteration, and from
+ * then on, the end of the body runs straight into the advancement and
+ * the condition, which jumps back to the body. The optimizer fuses all
+ * of that into a single OP_FORLOOP instruction (see optimizer.c). */
+static void compile_counted_loop(Compiler *compiler, Bytecode *code,
+                                 StmtFor s) {
+  compile_expr(compiler, code, s.condition);
+  int exit_jump = emit_placeholder(code, OP_JZ);
+
+  int body_start = code->code.count;
+  dynarray_insert(&compiler->loop_starts, CONTINUE_FORWARD);
+  size_t breakcount = compiler->breaks.count;
+  size_t continuecount = compiler->continues.count;
+
+  dynarray_insert(&compiler->loop_depths, compiler->depth);
+  compile(compiler, code, *s.body);
+  dynarray_pop(&compiler->loop_depths);
+
+  /* The 'continue' statements jump to the advancement, which is what
+   * comes next. */
+  int to_patch = compiler->continues.count - continuecount;
+  for (int i = 0; i < to_patch; i++) {
+    int continue_jump = dynarray_pop(&compiler->continues);
+    patch_placeholder(compiler, code, continue_jump);
+  }
+
+  compile_expr(compiler, code, s.advancement);
+  compile_expr(compiler, code, s.condition);
+  int loop_exit_jump = emit_placeholder(code, OP_JZ);
+  emit_loop(code, body_start);
+
+  int to_pop = compiler->breaks.count - breakcount;
+  for (int i = 0; i < to_pop; i++) {
+    int break_jump = dynarray_pop(&compiler->breaks);
+    patch_placeholder(compiler, code, break_jump);
+  }
+
+  dynarray_pop(&compiler->loop_starts);
+
+  patch_placeholder(compiler, code, exit_jump);
+  patch_placeholder(compiler, code, loop_exit_jump);
+}
+
 static void compile_stmt_for(Compiler *compiler, Bytecode *code, Stmt stmt) {
   StmtFor s = TO_STMT_FOR(stmt);
 
@@ -1103,6 +1552,13 @@ static void compile_stmt_for(Compiler *compiler, Bytecode *code, Stmt stmt) {
   /* Compile the right-hand side of the initializer first. */
   compile_expr(compiler, code, *assignment.rhs);
 
+  if (is_counted_loop(s, variable.name)) {
+    compile_counted_loop(compiler, code, s);
+    dynarray_pop(&compiler->locals);
+    emit_byte(code, OP_POP);
+    return;
+  }
+
   /* Mark the beginning of the loop before compiling the condition,
    * so that we know where to jump after the loop body is executed. */
   int loop_start = code->code.count;
@@ -1137,7 +1593,7 @@ static void compile_stmt_for(Compiler *compiler, Bytecode *code, Stmt stmt) {
   emit_loop(code, loop_start);
 
   /* Patch the jump now that we know the size of the advancement. */
-  patch_placeholder(code, jump_over_advancement);
+  patch_placeholder(compiler, code, jump_over_advancement);
 
   /* Patch the loop_start we inserted to point to loop_continuation.
    * This is the place just before the advancement. */
@@ -1162,7 +1618,7 @@ static void compile_stmt_for(Compiler *compiler, Bytecode *code, Stmt stmt) {
   int to_pop = compiler->breaks.count - breakcount;
   for (int i = 0; i < to_pop; i++) {
     int break_jump = dynarray_pop(&compiler->breaks);
-    patch_placeholder(code, break_jump);
+    patch_placeholder(compiler, code, break_jump);
   }
 
   /* Pop the initializer from compiler->locals. */
@@ -1172,7 +1628,7 @@ static void compile_stmt_for(Compiler *compiler, Bytecode *code, Stmt stmt) {
   dynarray_pop(&compiler->loop_starts);
 
   /* Finally, we patch the exit jump. */
-  patch_placeholder(code, exit_jump);
+  patch_placeholder(compiler, code, exit_jump);
 
   /* Pop the initializer from the stack. */
   emit_byte(code, OP_POP);
@@ -1192,8 +1648,24 @@ static void compile_stmt_fn(Compiler *compiler, Bytecode *code, Stmt stmt) {
       .location = code->code.count + 3,
   };
 
+  BodyScan scan = scan_body(s);
+
   if (compiler->depth == 0) {
     table_insert(compiler->functions, func.name, func);
+
+    /* The chunk outlives the ASTs of the imported modules, so it needs
+     * its own copy of the name. */
+    Function chunk_func = func;
+    chunk_func.name = own_string(func.name);
+    dynarray_insert(&code->functions, chunk_func);
+
+    /* Remember the body of a small function, so that the calls to it
+     * can be inlined, or forget an older one by the same name. */
+    StmtFn inlinable = s;
+    if (!is_inlinable(s, scan)) {
+      inlinable.body = NULL;
+    }
+    table_insert(compiler->inlinable, s.name, inlinable);
   }
 
   compiler->pops[1] += s.parameters.count;
@@ -1205,11 +1677,19 @@ static void compile_stmt_fn(Compiler *compiler, Bytecode *code, Stmt stmt) {
    * the first time we encounter it. */
   int jump = emit_placeholder(code, OP_JMP);
 
+  /* A call in tail position reuses the frame of the function, unless
+   * the function takes the address of something, which might be one
+   * of its locals that is still pointed to (see compile_stmt_return()). */
+  bool tail_calls = compiler->tail_calls;
+  compiler->tail_calls = !scan.takes_address;
+
   /* Compile the function body. */
   compile(compiler, code, *s.body);
 
+  compiler->tail_calls = tail_calls;
+
   /* Finally, patch the jump. */
-  patch_placeholder(code, jump);
+  patch_placeholder(compiler, code, jump);
 
   assert(compiler->breaks.count == 0);
   assert(compiler->loop_starts.count == 0);
@@ -1223,23 +1703,23 @@ static void compile_stmt_struct(Compiler *compiler, Bytecode *code, Stmt stmt) {
   /* Emit some bytecode in the following format:
    *
    * OP_STRUCT_BLUEPRINT
-   * 4-byte index of the struct name in the sp
-   * 4-byte struct property count
+   * index of the struct name in the sp
+   * struct property count
    * for each property:
-   *    4-byte index of the property name in the sp
-   *    4-byte index of the property in the 'items' */
+   *    index of the property name in the sp
+   *    index of the property in the 'items' */
   emit_byte(code, OP_STRUCT_BLUEPRINT);
-  emit_uint32(code, add_string(code, s.name));
-  emit_uint32(code, s.properties.count);
+  emit_operand(code, add_string(code, s.name));
+  emit_operand(code, s.properties.count);
 
   StructBlueprint blueprint = {.name = s.name,
                                .property_indexes = calloc(1, sizeof(Table_int)),
                                .methods = calloc(1, sizeof(Table_Function))};
 
   for (size_t i = 0; i < s.properties.count; i++) {
-    emit_uint32(code, add_string(code, s.properties.data[i]));
+    emit_operand(code, add_string(code, s.properties.data[i]));
     table_insert(blueprint.property_indexes, s.properties.data[i], i);
-    emit_uint32(code, i);
+    emit_operand(code, i);
   }
 
   /* Let the compiler know about the blueprint. */
@@ -1269,44 +1749,56 @@ static void compile_stmt_impl(Compiler *compiler, Bytecode *code, Stmt stmt) {
   }
 
   emit_byte(code, OP_IMPL);
-  emit_uint32(code, add_string(code, blueprint->name));
-  emit_uint32(code, s.methods.count);
+  emit_operand(code, add_string(code, blueprint->name));
+  emit_operand(code, s.methods.count);
 
   for (size_t i = 0; i < s.methods.count; i++) {
     StmtFn func = TO_STMT_FN(s.methods.data[i]);
     Function *f = table_get(blueprint->methods, func.name);
-    emit_uint32(code, add_string(code, f->name));
-    emit_uint32(code, f->paramcount);
-    emit_uint32(code, f->location);
+    emit_operand(code, add_string(code, f->name));
+    emit_operand(code, f->paramcount);
+    emit_operand(code, f->location);
   }
 }
 
 static void compile_stmt_return(Compiler *compiler, Bytecode *code, Stmt stmt) {
   StmtRet s = TO_STMT_RETURN(stmt);
 
-  /* Compile the return value. */
-  compile_expr(compiler, code, s.returnval);
+  /* A call that is returned right away is a tail call, and since the
+   * function it calls returns to where this one would have, it takes
+   * the place of the OP_RET. The calls in an inlined body, and the
+   * ones that are going to be inlined, are left alone. */
+  if (compiler->tail_calls && compiler->inlined.count == 0 &&
+      s.returnval.kind == EXPR_CALL &&
+      inlinable_callee(compiler, s.returnval) == NULL) {
+    compile_call(compiler, code, TO_EXPR_CALL(s.returnval), true);
+    return;
+  }
 
-  /* We need to perform the stack cleanup, but the return value
-   * mustn't be lost, so we'll (ab)use OP_DEEPSET for this job.
-   *
-   * For example, if the stack is:
-   *
-   * [..., 1, 2, 3, <return value>]
-   *
-   * The cleanup will look like this:
-   *
-   * [..., 1, 2, 3, <return value>]
-   * [..., 1, 2, <return value>]
-   * [..., 1, <return value>]
-   * [..., <return value>] */
-  int deepset_no = compiler->locals.count - 1;
-  for (size_t i = 0; i < compiler->locals.count; i++) {
-    emit_byte(code, OP_DEEPSET);
-    emit_uint32(code, deepset_no--);
+  /* Compile the return value. */
+  compile_frame_expr(compiler, code, s.returnval);
+
+  /* In the body of an inlined call, the return value takes the place
+   * of the first parameter, and everything above it is popped (see
+   * compile_inlined_call()). */
+  if (compiler->inlined.count > 0) {
+    size_t base = dynarray_peek(&compiler->inlined).base;
+    size_t slots = compiler->locals.count - base;
+    if (slots > 0) {
+      emit_byte(code, OP_DEEPSET);
+      emit_operand(code, base);
+      for (size_t i = 1; i < slots; i++) {
+        emit_byte(code, OP_POP);
+      }
+    }
+    int exit_jump = emit_placeholder(code, OP_JMP);
+    dynarray_insert(&compiler->inline_exits, exit_jump);
+    return;
   }
 
-  /* Finally, emit OP_RET. */
+  /* OP_RET takes care of the stack cleanup: it moves the return
+   * value to the start of the frame, and drops everything else in
+   * the frame (the parameters, the locals and any temporaries). */
   emit_byte(code, OP_RET);
 }
 
@@ -1341,6 +1833,15 @@ static void compile_stmt_continue(Compiler *compiler, Bytecode *code,
     /* Clean up the stack before the next iteration. */
     emit_loop_cleanup(compiler, code);
 
+    /* In a counted loop, the advancement comes after the body, so
+     * the jump is a forward one, patched just like the breaks are
+     * (see compile_counted_loop()). */
+    if (loop_start == CONTINUE_FORWARD) {
+      int continue_jump = emit_placeholder(code, OP_JMP);
+      dynarray_insert(&compiler->continues, continue_jump);
+      return;
+    }
+
     /* Jump back to the beginning of the loop and evalute the co-
      * ndition one more time. */
     emit_loop(code, loop_start);
@@ -1392,14 +1893,15 @@ static void compile_stmt_use(Compiler *compiler, Bytecode *code, Stmt stmt) {
       COMPILER_ERROR("Cycle.");
 
     for (size_t i = 0; i < stmts.count; i++) {
+      fold_constants(&stmts.data[i]);
       compile(compiler, code, stmts.data[i]);
     }
 
     compiler->current_mod = old_module;
 
-    for (size_t i = 0; i < stmts.count; i++) {
-      free_stmt(stmts.data[i]);
-    }
+    /* The functions of the module may be inlined into the code that
+     * comes after the import, so its AST is freed with the compiler. */
+    COPY_DYNARRAY(&compiler->imported, &stmts);
     dynarray_free(&stmts);
 
     free(source);
@@ -1451,3 +1953,186 @@ static CompileHandler handler[] = {
 void compile(Compiler *compiler, Bytecode *code, Stmt stmt) {
   handler[stmt.kind].fn(compiler, code, stmt);
 }
+
+static size_t operand_length(uint32_t operand) {
+  return operand < OPERAND_WIDE ? 1 : 1 + sizeof(operand);
+}
+
+/* The length of the instruction at 'offset' once the jumps in 'wide'
+ * are widened, and the code has been moved as in 'moved'. Only the
+ * jumps, the direct calls and OP_IMPL, whose function and method lo-
+ * cations move along with the code, can change their length. */
+static size_t relaxed_length(uint8_t *data, size_t offset, size_t length,
+                             bool *wide, size_t *moved) {
+  uint8_t *p = &data[offset];
+  switch (*p) {
+  case OP_JMP:
+  case OP_JZ:
+  case OP_JNZ:
+    return wide[offset] ? 1 + 2 + 4 : 1 + 2;
+  case OP_CALL:
+  case OP_TAILCALL:
+    return 1 + operand_length(operand_at(p, 0)) +
+           operand_length(moved[operand_at(p, 1)]);
+  case OP_IMPL: {
+    uint32_t method_count = operand_at(p, 1);
+    size_t relaxed = 1 + operand_length(operand_at(p, 0)) +
+                     operand_length(method_count);
+    for (size_t i = 0; i < method_count; i++) {
+      relaxed += operand_length(operand_at(p, 2 + i * 3)) +
+                 operand_length(operand_at(p, 2 + i * 3 + 1)) +
+                 operand_length(moved[operand_at(p, 2 + i * 3 + 2)]);
+    }
+    return relaxed;
+  }
+  default:
+    return length;
+  }
+}
+
+static bool is_jump(uint8_t opcode) {
+  return opcode == OP_JMP || opcode == OP_JZ || opcode == OP_JNZ;
+}
+
+/* Widen the jumps that patch_placeholder() could not patch. */
+void relax_jumps(Compiler *compiler, Bytecode *code) {
+  if (compiler->far_jumps.count == 0) {
+    return;
+  }
+
+  size_t *targets = calloc(code->code.count + 1, sizeof(size_t));
+  bool *wide = calloc(code->code.count + 1, sizeof(bool));
+  bool *dropped = calloc(code->code.count + 1, sizeof(bool));
+
+  for (size_t offset = 0; offset < code->code.count;
+       offset += instruction_length(code, offset)) {
+    if (is_jump(code->code.data[offset])) {
+      targets[offset] = jump_target(code->code.data, offset);
+      wide[offset] = instruction_length(code, offset) > 1 + 2;
+    }
+  }
+
+  for (size_t i = 0; i < compiler->far_jumps.count; i++) {
+    FarJump far = compiler->far_jumps.data[i];
+    targets[far.at] = far.target;
+    wide[far.at] = true;
+  }
+
+  relocate(code, targets, wide, dropped);
+
+  free(targets);
+  free(wide);
+  free(dropped);
+}
+
+/* Lay the chunk out anew, with the jumps going to 'targets' (indexed
+ * by the offset of the jump), and without the instructions that are
+ * 'dropped'. A jump to a dropped instruction goes to the instruction
+ * that comes after it instead. The jumps start out in the form given
+ * in 'wide'.
+ *
+ * Widening a jump moves all of the code that comes after it, so first,
+ * the new offset of every instruction is worked out, widening the jumps
+ * that no longer reach their targets in the short form along the way,
+ * until nothing changes anymore. Then, the code is copied over with the
+ * jump offsets and the function and method locations in the direct
+ * calls and OP_IMPL fixed up, and the functions are moved, too. */
+void relocate(Bytecode *code, size_t *targets, bool *wide, bool *dropped) {
+  DynArray_uint8_t old = code->code;
+  size_t *lengths = calloc(old.count + 1, sizeof(size_t));
+  size_t *moved = calloc(old.count + 1, sizeof(size_t));
+
+  for (size_t offset = 0; offset < old.count; offset += lengths[offset]) {
+    lengths[offset] = instruction_length(code, offset);
+    moved[offset] = offset;
+  }
+  moved[old.count] = old.count;
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+
+    size_t position = 0;
+    for (size_t offset = 0; offset < old.count; offset += lengths[offset]) {
+      if (moved[offset] != position) {
+        moved[offset] = position;
+        changed = true;
+      }
+      if (!dropped[offset]) {
+        position +=
+            relaxed_length(old.data, offset, lengths[offset], wide, moved);
+      }
+    }
+    moved[old.count] = position;
+
+    for (size_t offset = 0; offset < old.count; offset += lengths[offset]) {
+      if (is_jump(old.data[offset]) && !wide[offset] && !dropped[offset]) {
+        int64_t jump =
+            (int64_t)moved[targets[offset]] - (int64_t)(moved[offset] + 3);
+        if (!fits_short_jump(jump)) {
+          wide[offset] = true;
+          changed = true;
+        }
+      }
+    }
+  }
+
+  code->code = (DynArray_uint8_t){0};
+
+  for (size_t offset = 0; offset < old.count; offset += lengths[offset]) {
+    if (dropped[offset]) {
+      continue;
+    }
+
+    uint8_t *p = &old.data[offset];
+    emit_byte(code, *p);
+
+    switch (*p) {
+    case OP_JMP:
+    case OP_JZ:
+    case OP_JNZ: {
+      size_t end =
+          moved[offset] + relaxed_length(old.data, offset, 0, wide, moved);
+      int32_t jump = (int64_t)moved[targets[offset]] - (int64_t)end;
+      if (wide[offset]) {
+        emit_wide_offset(code, jump);
+      } else {
+        emit_offset(code, jump);
+      }
+      break;
+    }
+    case OP_CALL:
+    case OP_TAILCALL:
+      emit_operand(code, operand_at(p, 0));
+      emit_operand(code, moved[operand_at(p, 1)]);
+      break;
+    case OP_IMPL: {
+      uint32_t method_count = operand_at(p, 1);
+      emit_operand(code, operand_at(p, 0));
+      emit_operand(code, method_count);
+      for (size_t i = 0; i < method_count; i++) {
+        emit_operand(code, operand_at(p, 2 + i * 3));
+        emit_operand(code, operand_at(p, 2 + i * 3 + 1));
+        emit_operand(code, moved[operand_at(p, 2 + i * 3 + 2)]);
+      }
+      break;
+    }
+    default:
+      for (size_t i = 1; i < lengths[offset]; i++) {
+        emit_byte(code, p[i]);
+      }
+      break;
+    }
+  }
+
+  assert(code->code.count == moved[old.count]);
+
+  for (size_t i = 0; i < code->functions.count; i++) {
+    Function *function = &code->functions.data[i];
+    function->location = moved[function->location];
+  }
+
+  dynarray_free(&old);
+  free(lengths);
+  free(moved);
+}
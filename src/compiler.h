@@ -2,9 +2,16 @@
 #define venom_compiler_h
 
 #define POPS_MAX 256
+#define GLOBALS_MAX 1024
 
+/* The largest function body, counted in AST nodes, that is inlined at
+ * the call sites (see compile_inlined_call() in compiler.c). */
+#define INLINE_BUDGET 24
+
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 
 #include "dynarray.h"
 #include "parser.h"
@@ -48,6 +55,8 @@ typedef enum {
   OP_IMPL,
   OP_CALL,
   OP_CALL_METHOD,
+  OP_TAILCALL,
+  OP_TAILCALL_METHOD,
   OP_RET,
   OP_POP,
   OP_DEREF,
@@ -57,26 +66,184 @@ typedef enum {
   OP_ARRAYSET,
   OP_SUBSCRIPT,
   OP_HLT,
+
+  /* Superinstructions, fused from the sequences of the opcodes above
+   * by the optimizer (see optimizer.c). The compiler never emits them. */
+  OP_DEEPADD_CONST,
+  OP_DEEPGET_CONST,
+  OP_DEEPGET_DEEPGET,
+  OP_ADD_DEEPSET,
+  OP_LT_JZ,
+  OP_GT_JZ,
+  OP_TRUE_NOT,
+  OP_FORLOOP_CONST,
+  OP_FORLOOP_DEEPGET,
+  OP_STRCAT_DEEPSET,
+
+  /* Quickened opcodes, which the vm rewrites the generic opcodes into
+   * once it sees that their operands are numbers, and back if they ever
+   * turn out not to be (see vm.c). Like the superinstructions, each one
+   * only replaces the opcode, so the code can still be walked the same
+   * way. The compiler never emits them. */
+  OP_ADD_NUM,
+  OP_SUB_NUM,
+  OP_MUL_NUM,
+  OP_DIV_NUM,
+  OP_MOD_NUM,
+  OP_EQ_NUM,
+  OP_GT_NUM,
+  OP_LT_NUM,
+
+  /* Only emitted by the peephole optimizer (see optimizer.c), which
+   * inverts 'OP_NOT, OP_JZ' and 'OP_JZ over an OP_JMP' into it. Like
+   * OP_JZ, it pops the condition, but it jumps if it is 'true'. */
+  OP_JNZ,
 } Opcode;
 
+/* The bytecode format.
+ *
+ * Since version 2, the operands are stored in the native byte order,
+ * and read with memcpy instead of being put back together byte by
+ * byte. The operands that are indexes or counts (into the pools, the
+ * globals, the frame, and so on) are stored in a single byte if they
+ * are less than OPERAND_WIDE, which is the case most of the time. A
+ * larger operand is stored as the OPERAND_WIDE byte, followed by the
+ * whole 4-byte operand.
+ *
+ * The jump offsets are 2 bytes long, so that they can be patched in
+ * place once the target is known. An offset that does not fit in them
+ * is stored as JUMP_WIDE, followed by the whole 4-byte offset. Either
+ * way, the offset is relative to the end of the jump instruction.
+ *
+ * Since version 3, OP_CALL carries the location of the function it
+ * calls as its second operand, instead of being followed by an OP_JMP
+ * to it, and OP_RET drops the frame of the function by itself, inst-
+ * ead of the OP_DEEPSETs that used to move the return value down.
+ *
+ * Since version 4, a call that is returned right away is emitted as
+ * OP_TAILCALL or OP_TAILCALL_METHOD, which take the same operands as
+ * OP_CALL and OP_CALL_METHOD, but reuse the frame of the caller. */
+#define BYTECODE_VERSION 4
+#define OPERAND_WIDE 0xFF
+#define JUMP_WIDE INT16_MIN
+
+/* The tail of a counted loop is only fused into one of the OP_FORLOOP
+ * instructions if all of its operands fit in a single byte and both of
+ * its jumps are 2 bytes long, so that the vm can find them at fixed
+ * offsets from the opcode. This is the length of such a tail. */
+#define FORLOOP_LENGTH 18
+
+/* Read the index operand that comes after the byte at '*p', and lea-
+ * ve '*p' on the last byte of the operand, the same way the vm reads
+ * the operands of an instruction with the ip on its opcode. */
+static inline uint32_t read_operand(uint8_t **p) {
+  uint32_t operand = *++(*p);
+  if (__builtin_expect(operand == OPERAND_WIDE, 0)) {
+    memcpy(&operand, *p + 1, sizeof(operand));
+    *p += sizeof(operand);
+  }
+  return operand;
+}
+
+/* Return the 'n'th (0-based) index operand of the instruction at 'p'.
+ * Since the operands differ in length, the ones before it are read
+ * too. */
+static inline uint32_t operand_at(uint8_t *p, size_t n) {
+  uint32_t operand = read_operand(&p);
+  while (n-- > 0) {
+    operand = read_operand(&p);
+  }
+  return operand;
+}
+
+/* Read the offset of the jump whose opcode is at '*p', and leave '*p'
+ * on the last byte of the jump. */
+static inline int32_t read_jump(uint8_t **p) {
+  int16_t offset;
+  memcpy(&offset, *p + 1, sizeof(offset));
+  *p += sizeof(offset);
+  if (__builtin_expect(offset == JUMP_WIDE, 0)) {
+    int32_t wide;
+    memcpy(&wide, *p + 1, sizeof(wide));
+    *p += sizeof(wide);
+    return wide;
+  }
+  return offset;
+}
+
+/* Return the offset of the instruction that the jump at 'offset' in
+ * 'data' goes to. */
+static inline size_t jump_target(uint8_t *data, size_t offset) {
+  uint8_t *p = &data[offset];
+  int32_t jump = read_jump(&p);
+  return (p + 1 - data) + jump;
+}
+
 typedef DynArray(uint8_t) DynArray_uint8_t;
 typedef DynArray(double) DynArray_double;
 
-typedef struct Bytecode {
-  DynArray_uint8_t code;
-  DynArray_char_ptr sp; /* string pool */
-} Bytecode;
+struct StructBlueprint;
+
+/* An inline cache for one OP_GETATTR, OP_SETATTR or OP_GETATTR_PTR
+ * site. It remembers the blueprint of the struct that was accessed
+ * there last, and the index of the property within that blueprint.
+ * The compiler emits an index into the chunk's property caches af-
+ * ter the property name, and the vm fills the caches in as it goes. */
+typedef struct {
+  struct StructBlueprint *blueprint;
+  uint32_t idx;
+} PropertyCache;
+
+typedef DynArray(PropertyCache) DynArray_PropertyCache;
+
+#define METHOD_CACHE_SIZE 4
+
+typedef struct {
+  struct StructBlueprint *blueprint;
+  uint32_t location;
+  uint32_t paramcount;
+} MethodCacheEntry;
 
+/* An inline cache for one OP_CALL_METHOD site. The first entry is
+ * the monomorphic case, and it is the one that is checked first.
+ * If the site sees more than one blueprint, the rest of the ent-
+ * ries act as a small polymorphic cache. Once all of the entries
+ * are taken, the site is considered megamorphic, and the methods
+ * are looked up the slow way from then on. */
+typedef struct {
+  MethodCacheEntry entries[METHOD_CACHE_SIZE];
+  uint32_t count;
+} MethodCache;
+
+typedef DynArray(MethodCache) DynArray_MethodCache;
+
+/* 'calls' and 'native' are only used by the jit (see jit.c): the vm
+ * counts the calls made to a function, and once it gets hot, the fun-
+ * ction is compiled and 'native' is set to its machine code. */
 typedef struct {
   char *name;
   size_t location;
   size_t paramcount;
+  size_t calls;
+  void *native;
 } Function;
 
+typedef DynArray(Function) DynArray_Function;
+
+typedef struct Bytecode {
+  DynArray_uint8_t code;
+  DynArray_double cp;        /* constant pool */
+  DynArray_char_ptr sp;      /* string pool */
+  DynArray_char_ptr globals; /* names of the global slots */
+  DynArray_PropertyCache property_caches;
+  DynArray_MethodCache method_caches;
+  DynArray_Function functions; /* the top-level functions */
+} Bytecode;
+
 typedef Table(int) Table_int;
 typedef Table(Function) Table_Function;
 
-typedef struct {
+typedef struct StructBlueprint {
   char *name;
   Table_int *property_indexes;
   Table_Function *methods;
@@ -97,15 +264,44 @@ struct module {
 
 typedef Table(struct module *) Table_module_ptr;
 
+/* A forward jump whose offset turned out not to fit in the short form.
+ * It is left as it is until the whole program has been compiled, and
+ * then widened by relax_jumps(). */
+typedef struct {
+  size_t at;     /* the offset of the jump */
+  size_t target; /* the offset it jumps to */
+} FarJump;
+
+typedef DynArray(FarJump) DynArray_FarJump;
+
+typedef Table(StmtFn) Table_StmtFn;
+
+/* A call that is being inlined. The returns in the body of the fun-
+ * ction move the return value down to 'base', the frame slot of its
+ * first parameter, and jump to the end of the inlined body. */
+typedef struct {
+  char *name;
+  size_t base;
+  size_t exits; /* the count of 'inline_exits' when the call started */
+} InlinedCall;
+
+typedef DynArray(InlinedCall) DynArray_InlinedCall;
+
 typedef struct Compiler {
   Table_Function *functions;
+  Table_StmtFn *inlinable; /* 'body' is NULL if it can't be inlined */
   Table_StructBlueprint *struct_blueprints;
   Table_module_ptr *compiled_modules;
-  DynArray_char_ptr globals;
   DynArray_char_ptr locals;
   DynArray_int breaks;
+  DynArray_int continues;
   DynArray_int loop_starts;
   DynArray_int loop_depths;
+  DynArray_FarJump far_jumps;
+  DynArray_InlinedCall inlined;
+  DynArray_int inline_exits;
+  DynArray_Stmt imported; /* kept around for the inlinable functions */
+  bool tail_calls;        /* in the function being compiled */
   int depth;
   int pops[POPS_MAX];
   struct module *current_mod;
@@ -117,5 +313,7 @@ void free_chunk(Bytecode *code);
 void init_compiler(Compiler *compiler);
 void free_compiler(Compiler *compiler);
 void compile(Compiler *compiler, Bytecode *code, Stmt stmt);
+void relax_jumps(Compiler *compiler, Bytecode *code);
+void relocate(Bytecode *code, size_t *targets, bool *wide, bool *dropped);
 
 #endif
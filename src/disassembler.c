@@ -50,22 +50,45 @@ static DisassembleHandler disassemble_handler[] = {
     [OP_DEREFSET] = {.opcode = "OP_DEREFSET", .operands = 0},
     [OP_CALL] = {.opcode = "OP_CALL", .operands = 4},
     [OP_CALL_METHOD] = {.opcode = "OP_CALL_METHOD", .operands = 4},
+    [OP_TAILCALL] = {.opcode = "OP_TAILCALL", .operands = 4},
+    [OP_TAILCALL_METHOD] = {.opcode = "OP_TAILCALL_METHOD", .operands = 4},
     [OP_IMPL] = {.opcode = "OP_IMPL", .operands = 1337},
     [OP_STRUCT_BLUEPRINT] = {.opcode = "OP_STRUCT_BLUEPRINT", .operands = 1337},
+    [OP_ARRAY] = {.opcode = "OP_ARRAY", .operands = 4},
+    [OP_ARRAYSET] = {.opcode = "OP_ARRAYSET", .operands = 0},
+    [OP_SUBSCRIPT] = {.opcode = "OP_SUBSCRIPT", .operands = 0},
+    [OP_HLT] = {.opcode = "OP_HLT", .operands = 0},
+    [OP_DEEPADD_CONST] = {.opcode = "OP_DEEPADD_CONST", .operands = 4},
+    [OP_DEEPGET_CONST] = {.opcode = "OP_DEEPGET_CONST", .operands = 4},
+    [OP_DEEPGET_DEEPGET] = {.opcode = "OP_DEEPGET_DEEPGET", .operands = 4},
+    [OP_ADD_DEEPSET] = {.opcode = "OP_ADD_DEEPSET", .operands = 0},
+    [OP_LT_JZ] = {.opcode = "OP_LT_JZ", .operands = 0},
+    [OP_GT_JZ] = {.opcode = "OP_GT_JZ", .operands = 0},
+    [OP_TRUE_NOT] = {.opcode = "OP_TRUE_NOT", .operands = 0},
+    [OP_FORLOOP_CONST] = {.opcode = "OP_FORLOOP_CONST", .operands = 4},
+    [OP_FORLOOP_DEEPGET] = {.opcode = "OP_FORLOOP_DEEPGET", .operands = 4},
+    [OP_STRCAT_DEEPSET] = {.opcode = "OP_STRCAT_DEEPSET", .operands = 0},
+    [OP_ADD_NUM] = {.opcode = "OP_ADD_NUM", .operands = 0},
+    [OP_SUB_NUM] = {.opcode = "OP_SUB_NUM", .operands = 0},
+    [OP_MUL_NUM] = {.opcode = "OP_MUL_NUM", .operands = 0},
+    [OP_DIV_NUM] = {.opcode = "OP_DIV_NUM", .operands = 0},
+    [OP_MOD_NUM] = {.opcode = "OP_MOD_NUM", .operands = 0},
+    [OP_EQ_NUM] = {.opcode = "OP_EQ_NUM", .operands = 0},
+    [OP_GT_NUM] = {.opcode = "OP_GT_NUM", .operands = 0},
+    [OP_LT_NUM] = {.opcode = "OP_LT_NUM", .operands = 0},
+    [OP_JNZ] = {.opcode = "OP_JNZ", .operands = 2},
 };
 
+const char *opcode_name(uint8_t opcode) {
+  return disassemble_handler[opcode].opcode;
+}
+
 void disassemble(Bytecode *code) {
 #define READ_UINT8() (*++ip)
-#define READ_INT16() (ip += 2, (int16_t)((ip[-1] << 8) | ip[0]))
+#define READ_JUMP() (read_jump(&ip))
+#define READ_OPERAND() (read_operand(&ip))
 
-#define READ_UINT32()                                                          \
-  (ip += 4, (uint32_t)((ip[-3] << 24) | (ip[-2] << 16) | (ip[-1] << 8) | ip[0]))
-
-#define READ_DOUBLE()                                                          \
-  (ip += 8, (double)(((uint64_t)ip[-7] << 56) | ((uint64_t)ip[-6] << 48) |     \
-                     ((uint64_t)ip[-5] << 40) | ((uint64_t)ip[-4] << 32) |     \
-                     ((uint64_t)ip[-3] << 24) | ((uint64_t)ip[-2] << 16) |     \
-                     ((uint64_t)ip[-1] << 8) | (uint64_t)ip[0]))
+  printf("bytecode version: %d\n", BYTECODE_VERSION);
 
   for (uint8_t *ip = code->code.data;
        ip < &code->code.data[code->code.count]; /* ip < addr of just beyond
@@ -77,54 +100,78 @@ void disassemble(Bytecode *code) {
     case 0:
       break;
     case 2: {
-      printf(" + 2-byte offset: %d", READ_INT16());
+      uint8_t *jump = ip;
+      int32_t offset = READ_JUMP();
+      printf(" + %d-byte offset: %d", ip - jump > 2 ? 4 : 2, offset);
       break;
     }
     case 4: {
       switch (*ip) {
       case OP_CONST: {
-        double d = READ_DOUBLE();
-        printf(" (value: %.16g)", d);
+        uint32_t const_idx = READ_OPERAND();
+        printf(" (index: %d, value: %.16g)", const_idx,
+               code->cp.data[const_idx]);
         break;
       }
       case OP_STR: {
-        uint32_t str_idx = READ_UINT32();
+        uint32_t str_idx = READ_OPERAND();
         printf(" (value: %s)", code->sp.data[str_idx]);
         break;
       }
       case OP_DEEPGET:
       case OP_DEEPGET_PTR:
-      case OP_DEEPSET: {
-        uint32_t idx = READ_UINT32();
+      case OP_DEEPSET:
+      /* A superinstruction is followed by the rest of the sequence
+       * it was fused from, which is disassembled as usual. */
+      case OP_DEEPADD_CONST:
+      case OP_DEEPGET_CONST:
+      case OP_DEEPGET_DEEPGET:
+      case OP_FORLOOP_CONST:
+      case OP_FORLOOP_DEEPGET: {
+        uint32_t idx = READ_OPERAND();
         printf(" (index: %d)", idx);
         break;
       }
       case OP_GET_GLOBAL:
       case OP_GET_GLOBAL_PTR:
       case OP_SET_GLOBAL: {
-        uint32_t name_idx = READ_UINT32();
-        printf(" (name: %s)", code->sp.data[name_idx]);
+        uint32_t slot = READ_OPERAND();
+        printf(" (slot: %d, name: %s)", slot, code->globals.data[slot]);
         break;
       }
       case OP_GETATTR:
+      case OP_GETATTR_PTR:
       case OP_SETATTR: {
-        uint32_t property_name_idx = READ_UINT32();
-        printf(" (property: %s)", code->sp.data[property_name_idx]);
+        uint32_t property_name_idx = READ_OPERAND();
+        uint32_t cache_idx = READ_OPERAND();
+        printf(" (property: %s, cache: %d)", code->sp.data[property_name_idx],
+               cache_idx);
         break;
       }
       case OP_STRUCT: {
-        uint32_t name_idx = READ_UINT32();
+        uint32_t name_idx = READ_OPERAND();
         printf(" (name: %s)", code->sp.data[name_idx]);
         break;
       }
-      case OP_CALL: {
-        uint32_t argcount = READ_UINT32();
-        printf(" (argcount: %d)", argcount);
+      case OP_CALL:
+      case OP_TAILCALL: {
+        uint32_t argcount = READ_OPERAND();
+        uint32_t location = READ_OPERAND();
+        printf(" (argcount: %d, location: %d)", argcount, location);
         break;
       }
-      case OP_CALL_METHOD: {
-        uint32_t method_name_idx = READ_UINT32();
-        printf(" (method: %s)", code->sp.data[method_name_idx]);
+      case OP_ARRAY: {
+        uint32_t count = READ_OPERAND();
+        printf(" (count: %d)", count);
+        break;
+      }
+      case OP_CALL_METHOD:
+      case OP_TAILCALL_METHOD: {
+        uint32_t method_name_idx = READ_OPERAND();
+        uint32_t argcount = READ_OPERAND();
+        uint32_t cache_idx = READ_OPERAND();
+        printf(" (method: %s, argcount: %d, cache: %d)",
+               code->sp.data[method_name_idx], argcount, cache_idx);
         break;
       }
       default:
@@ -135,16 +182,16 @@ void disassemble(Bytecode *code) {
     default:
       switch (*ip) {
       case OP_IMPL: {
-        uint32_t blueprint_name_idx = READ_UINT32();
-        uint32_t method_count = READ_UINT32();
+        uint32_t blueprint_name_idx = READ_OPERAND();
+        uint32_t method_count = READ_OPERAND();
 
         printf(" (blueprint: %s, method count: %d)",
                code->sp.data[blueprint_name_idx], method_count);
 
         for (size_t i = 0; i < method_count; i++) {
-          uint32_t method_name_idx = READ_UINT32();
-          uint32_t paramcount = READ_UINT32();
-          uint32_t location = READ_UINT32();
+          uint32_t method_name_idx = READ_OPERAND();
+          uint32_t paramcount = READ_OPERAND();
+          uint32_t location = READ_OPERAND();
 
           printf("\n%ld: method: %s, paramcount: %d, location: %d",
                  ip - code->code.data, code->sp.data[method_name_idx],
@@ -153,17 +200,17 @@ void disassemble(Bytecode *code) {
         break;
       }
       case OP_STRUCT_BLUEPRINT: {
-        uint32_t name_idx = READ_UINT32();
-        uint32_t propcount = READ_UINT32();
+        uint32_t name_idx = READ_OPERAND();
+        uint32_t propcount = READ_OPERAND();
 
         printf(" (name: %s, propcount: %d)", code->sp.data[name_idx],
                propcount);
 
         for (size_t i = 0; i < propcount; i++) {
-          uint32_t property_name_idx = READ_UINT32();
+          uint32_t property_name_idx = READ_OPERAND();
           printf("\n%ld: property: %s, ", ip - code->code.data,
                  code->sp.data[property_name_idx]);
-          uint32_t property_index = READ_UINT32();
+          uint32_t property_index = READ_OPERAND();
           printf("%ld: index: %d", ip - code->code.data, property_index);
         }
         break;
@@ -176,6 +223,79 @@ void disassemble(Bytecode *code) {
     printf("\n");
   }
 #undef READ_UINT8
-#undef READ_INT16
-#undef READ_UINT32
+#undef READ_JUMP
+#undef READ_OPERAND
+}
+
+void disassemble_register(RegisterCode *rcode) {
+  for (size_t i = 0; i < rcode->code.count; i++) {
+    RegisterInstruction *ins = &rcode->code.data[i];
+    printf("%ld: %s", i, register_opcode_name(ins->opcode));
+    switch (ins->opcode) {
+    case R_CONST:
+      printf(" r%d, %.16g", ins->a, ins->k);
+      break;
+    case R_LOAD:
+    case R_STORE:
+    case R_NEG:
+      printf(" r%d, r%d", ins->a, ins->b);
+      break;
+    case R_RET:
+      printf(" r%d", ins->a);
+      break;
+    case R_GET_GLOBAL:
+      printf(" r%d, (slot: %d)", ins->a, ins->b);
+      break;
+    case R_SET_GLOBAL:
+      printf(" (slot: %d), r%d", ins->a, ins->b);
+      break;
+    case R_ADD:
+    case R_SUB:
+    case R_MUL:
+    case R_DIV:
+    case R_LT:
+    case R_GT:
+      printf(" r%d, r%d, r%d", ins->a, ins->b, ins->c);
+      break;
+    case R_ADDK:
+    case R_SUBK:
+    case R_MULK:
+    case R_DIVK:
+    case R_LTK:
+    case R_GTK:
+      printf(" r%d, r%d, %.16g", ins->a, ins->b, ins->k);
+      break;
+    case R_JMP:
+      printf(" %d", ins->d);
+      break;
+    case R_JZ:
+      printf(" r%d, %d", ins->a, ins->d);
+      break;
+    case R_JNLT:
+    case R_JNGT:
+      printf(" r%d, r%d, %d", ins->b, ins->c, ins->d);
+      break;
+    case R_JNLTK:
+    case R_JNGTK:
+      printf(" r%d, %.16g, %d", ins->b, ins->k, ins->d);
+      break;
+    case R_CALL:
+      printf(" r%d, %d", ins->a, ins->d);
+      break;
+    case R_TAILCALL:
+      printf(" r%d, (argcount: %d), %d", ins->a, ins->c, ins->d);
+      break;
+    case R_CALL_METHOD:
+    case R_TAILCALL_METHOD:
+      printf(" r%d, (method: %d, argcount: %d, cache: %d)", ins->a, ins->b,
+             ins->c, ins->d);
+      break;
+    case R_STACK:
+      printf(" (offset: %d, depth: %d)", ins->offset, ins->depth);
+      break;
+    default:
+      break;
+    }
+    printf("\n");
+  }
 }
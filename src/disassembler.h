@@ -2,7 +2,10 @@
 #define venom_disassembler_h
 
 #include "compiler.h"
+#include "register.h"
 
 void disassemble(Bytecode *code);
+void disassemble_register(RegisterCode *rcode);
+const char *opcode_name(uint8_t opcode);
 
 #endif
@@ -0,0 +1,404 @@
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fold.h"
+#include "parser.h"
+
+/* Constant folding runs on the AST of every top-level statement, right
+ * before it is compiled. Operators whose operands are all literals are
+ * evaluated, and the expression is replaced with the resulting literal.
+ * The result must be exactly what the vm would compute at runtime, so
+ * an operator is only folded if it would not be a runtime error (e.g.
+ * '1 + "a"' is left alone), and the numbers are computed the same way
+ * as in vm.c (the bitwise operators clamp their operands, '>=' is 'not
+ * <', and so on).
+ *
+ * Besides that, a few identities are simplified, but only where IEEE
+ * 754 allows it (e.g. 'x * 1' and 'x - 0', but not 'x + 0', since -0
+ * + 0 is 0, or 'x * 0', since x could be NaN or infinity), and only if
+ * the operand is known to be a number, so that no type error goes
+ * missing. */
+
+/* Same as in vm.c. */
+static uint64_t clamp(double d) {
+  if (d < 0.0) {
+    return 0;
+  } else if (d > UINT64_MAX) {
+    return UINT64_MAX;
+  } else {
+    return (uint64_t)d;
+  }
+}
+
+static bool is_literal(Expr *exp, LiteralKind kind) {
+  return exp->kind == EXPR_LIT && TO_EXPR_LIT(*exp).kind == kind;
+}
+
+/* Whether 'exp' is the number literal 'x'. Zeroes are told apart by
+ * their sign. */
+static bool is_number_literal(Expr *exp, double x) {
+  if (!is_literal(exp, LIT_NUM)) {
+    return false;
+  }
+  double d = TO_EXPR_LIT(*exp).as.dval;
+  return d == x && signbit(d) == signbit(x);
+}
+
+static bool is_operator(Expr *exp, ExprKind kind, const char *op) {
+  if (exp->kind != kind) {
+    return false;
+  }
+  char *exp_op =
+      kind == EXPR_BIN ? TO_EXPR_BIN(*exp).op : TO_EXPR_UNA(*exp).op;
+  return strcmp(exp_op, op) == 0;
+}
+
+/* Whether 'exp' evaluates to a number whenever it evaluates at all. */
+static bool is_numeric(Expr *exp) {
+  static const char *numeric[] = {"+", "-", "*", "/", "%%",
+                                  "&", "|", "^", "<<", ">>"};
+  if (is_literal(exp, LIT_NUM) || is_operator(exp, EXPR_UNA, "-") ||
+      is_operator(exp, EXPR_UNA, "~")) {
+    return true;
+  }
+  for (size_t i = 0; i < sizeof(numeric) / sizeof(numeric[0]); i++) {
+    if (is_operator(exp, EXPR_BIN, numeric[i])) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Whether 'exp' evaluates to a bool whenever it evaluates at all. */
+static bool is_boolean(Expr *exp) {
+  static const char *comparisons[] = {"<", ">", "<=", ">=", "==", "!="};
+  if (is_literal(exp, LIT_BOOL) || is_operator(exp, EXPR_UNA, "!")) {
+    return true;
+  }
+  for (size_t i = 0; i < sizeof(comparisons) / sizeof(comparisons[0]); i++) {
+    if (is_operator(exp, EXPR_BIN, comparisons[i])) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Whether 'exp' evaluates to a string whenever it evaluates at all. */
+static bool is_string(Expr *exp) {
+  return is_literal(exp, LIT_STR) || is_operator(exp, EXPR_BIN, "++");
+}
+
+/* Replace 'exp' with the literal 'lit', freeing what was there. */
+static void replace_with_literal(Expr *exp, ExprLit lit) {
+  free_expression(*exp);
+  *exp = AS_EXPR_LIT(lit);
+}
+
+static void replace_with_number(Expr *exp, double x) {
+  replace_with_literal(exp, (ExprLit){.kind = LIT_NUM, .as.dval = x});
+}
+
+static void replace_with_bool(Expr *exp, bool b) {
+  replace_with_literal(exp, (ExprLit){.kind = LIT_BOOL, .as.bval = b});
+}
+
+/* Replace 'exp' with its operand 'operand', freeing the rest of it. The
+ * operand is swapped out for a null literal first, so that it survives
+ * the freeing of 'exp'. */
+static void replace_with_operand(Expr *exp, Expr *operand) {
+  Expr kept = *operand;
+  *operand = AS_EXPR_LIT((ExprLit){.kind = LIT_NULL});
+  free_expression(*exp);
+  *exp = kept;
+}
+
+/* The same comparison as check_equality() in vm.c, on literals. */
+static bool literals_equal(ExprLit a, ExprLit b) {
+  if (a.kind != b.kind) {
+    return false;
+  }
+  switch (a.kind) {
+  case LIT_BOOL:
+    return a.as.bval == b.as.bval;
+  case LIT_NUM:
+    return a.as.dval == b.as.dval;
+  case LIT_STR:
+    return strcmp(a.as.sval, b.as.sval) == 0;
+  case LIT_NULL:
+    return true;
+  default:
+    return false;
+  }
+}
+
+static void fold_expr(Expr *exp);
+
+static void fold_expr_una(Expr *exp) {
+  ExprUnary e = TO_EXPR_UNA(*exp);
+  fold_expr(e.exp);
+
+  if (strcmp(e.op, "-") == 0) {
+    if (is_literal(e.exp, LIT_NUM)) {
+      replace_with_number(exp, -TO_EXPR_LIT(*e.exp).as.dval);
+    } else if (is_operator(e.exp, EXPR_UNA, "-") &&
+               is_numeric(TO_EXPR_UNA(*e.exp).exp)) {
+      /* -(-x) */
+      replace_with_operand(exp, TO_EXPR_UNA(*e.exp).exp);
+    }
+  } else if (strcmp(e.op, "!") == 0) {
+    if (is_literal(e.exp, LIT_BOOL)) {
+      replace_with_bool(exp, !TO_EXPR_LIT(*e.exp).as.bval);
+    } else if (is_operator(e.exp, EXPR_UNA, "!") &&
+               is_boolean(TO_EXPR_UNA(*e.exp).exp)) {
+      /* !!x */
+      replace_with_operand(exp, TO_EXPR_UNA(*e.exp).exp);
+    }
+  } else if (strcmp(e.op, "~") == 0) {
+    if (is_literal(e.exp, LIT_NUM)) {
+      replace_with_number(exp, ~clamp(TO_EXPR_LIT(*e.exp).as.dval));
+    }
+  }
+}
+
+/* Evaluate the operator 'op' on two number literals. Returns false if
+ * it can't be evaluated at compile time. */
+static bool fold_numbers(Expr *exp, const char *op, double a, double b) {
+  if (strcmp(op, "+") == 0) {
+    replace_with_number(exp, a + b);
+  } else if (strcmp(op, "-") == 0) {
+    replace_with_number(exp, a - b);
+  } else if (strcmp(op, "*") == 0) {
+    replace_with_number(exp, a * b);
+  } else if (strcmp(op, "/") == 0) {
+    replace_with_number(exp, a / b);
+  } else if (strcmp(op, "%%") == 0) {
+    replace_with_number(exp, fmod(a, b));
+  } else if (strcmp(op, "&") == 0) {
+    replace_with_number(exp, clamp(a) & clamp(b));
+  } else if (strcmp(op, "|") == 0) {
+    replace_with_number(exp, clamp(a) | clamp(b));
+  } else if (strcmp(op, "^") == 0) {
+    replace_with_number(exp, clamp(a) ^ clamp(b));
+  } else if (strcmp(op, "<<") == 0 && clamp(b) < 64) {
+    replace_with_number(exp, clamp(a) << clamp(b));
+  } else if (strcmp(op, ">>") == 0 && clamp(b) < 64) {
+    replace_with_number(exp, clamp(a) >> clamp(b));
+  } else if (strcmp(op, "<") == 0) {
+    replace_with_bool(exp, a < b);
+  } else if (strcmp(op, ">") == 0) {
+    replace_with_bool(exp, a > b);
+  } else if (strcmp(op, "<=") == 0) {
+    replace_with_bool(exp, !(a > b));
+  } else if (strcmp(op, ">=") == 0) {
+    replace_with_bool(exp, !(a < b));
+  } else {
+    return false;
+  }
+  return true;
+}
+
+/* Simplify the identities that hold for any number 'x', when one side
+ * is a literal. */
+static void simplify_identity(Expr *exp) {
+  ExprBin e = TO_EXPR_BIN(*exp);
+  if (strcmp(e.op, "*") == 0) {
+    /* x * 1, 1 * x */
+    if (is_number_literal(e.rhs, 1) && is_numeric(e.lhs)) {
+      replace_with_operand(exp, e.lhs);
+    } else if (is_number_literal(e.lhs, 1) && is_numeric(e.rhs)) {
+      replace_with_operand(exp, e.rhs);
+    }
+  } else if (strcmp(e.op, "/") == 0) {
+    /* x / 1 */
+    if (is_number_literal(e.rhs, 1) && is_numeric(e.lhs)) {
+      replace_with_operand(exp, e.lhs);
+    }
+  } else if (strcmp(e.op, "-") == 0) {
+    /* x - 0 */
+    if (is_number_literal(e.rhs, 0.0) && is_numeric(e.lhs)) {
+      replace_with_operand(exp, e.lhs);
+    }
+  } else if (strcmp(e.op, "+") == 0) {
+    /* x + -0, -0 + x */
+    if (is_number_literal(e.rhs, -0.0) && is_numeric(e.lhs)) {
+      replace_with_operand(exp, e.lhs);
+    } else if (is_number_literal(e.lhs, -0.0) && is_numeric(e.rhs)) {
+      replace_with_operand(exp, e.rhs);
+    }
+  } else if (strcmp(e.op, "++") == 0) {
+    /* x ++ "", "" ++ x */
+    if (is_literal(e.rhs, LIT_STR) && TO_EXPR_LIT(*e.rhs).as.sval[0] == '\0' &&
+        is_string(e.lhs)) {
+      replace_with_operand(exp, e.lhs);
+    } else if (is_literal(e.lhs, LIT_STR) &&
+               TO_EXPR_LIT(*e.lhs).as.sval[0] == '\0' && is_string(e.rhs)) {
+      replace_with_operand(exp, e.rhs);
+    }
+  }
+}
+
+static void fold_expr_bin(Expr *exp) {
+  ExprBin e = TO_EXPR_BIN(*exp);
+  fold_expr(e.lhs);
+  fold_expr(e.rhs);
+
+  if (e.lhs->kind != EXPR_LIT || e.rhs->kind != EXPR_LIT) {
+    simplify_identity(exp);
+    return;
+  }
+
+  ExprLit a = TO_EXPR_LIT(*e.lhs);
+  ExprLit b = TO_EXPR_LIT(*e.rhs);
+
+  if (strcmp(e.op, "==") == 0) {
+    replace_with_bool(exp, literals_equal(a, b));
+  } else if (strcmp(e.op, "!=") == 0) {
+    replace_with_bool(exp, !literals_equal(a, b));
+  } else if (a.kind == LIT_NUM && b.kind == LIT_NUM) {
+    fold_numbers(exp, e.op, a.as.dval, b.as.dval);
+  } else if (a.kind == LIT_STR && b.kind == LIT_STR &&
+             strcmp(e.op, "++") == 0) {
+    size_t len_a = strlen(a.as.sval);
+    size_t len_b = strlen(b.as.sval);
+    char *s = malloc(len_a + len_b + 1);
+    memcpy(s, a.as.sval, len_a);
+    memcpy(s + len_a, b.as.sval, len_b + 1);
+    replace_with_literal(exp, (ExprLit){.kind = LIT_STR, .as.sval = s});
+  }
+}
+
+/* 'true && x' and 'false || x' are x, and the other two are the literal
+ * on the left (see compile_expr_log()). */
+static void fold_expr_log(Expr *exp) {
+  ExprLogic e = TO_EXPR_LOG(*exp);
+  fold_expr(e.lhs);
+  fold_expr(e.rhs);
+
+  if (!is_literal(e.lhs, LIT_BOOL)) {
+    return;
+  }
+
+  bool lhs = TO_EXPR_LIT(*e.lhs).as.bval;
+  bool is_and = strcmp(e.op, "&&") == 0;
+  if (lhs == is_and) {
+    replace_with_operand(exp, e.rhs);
+  } else {
+    replace_with_bool(exp, lhs);
+  }
+}
+
+static void fold_expr(Expr *exp) {
+  switch (exp->kind) {
+  case EXPR_UNA:
+    fold_expr_una(exp);
+    break;
+  case EXPR_BIN:
+    fold_expr_bin(exp);
+    break;
+  case EXPR_LOG:
+    fold_expr_log(exp);
+    break;
+  case EXPR_CALL: {
+    ExprCall e = TO_EXPR_CALL(*exp);
+    fold_expr(e.callee);
+    for (size_t i = 0; i < e.arguments.count; i++) {
+      fold_expr(&e.arguments.data[i]);
+    }
+    break;
+  }
+  case EXPR_GET:
+    fold_expr(TO_EXPR_GET(*exp).exp);
+    break;
+  case EXPR_ASS: {
+    /* The left-hand side is not folded as a whole, since it is checked
+     * by the compiler to be something that can be assigned to. */
+    ExprAssign e = TO_EXPR_ASS(*exp);
+    switch (e.lhs->kind) {
+    case EXPR_GET:
+    case EXPR_UNA:
+    case EXPR_SUBSCRIPT:
+      fold_expr(e.lhs);
+      break;
+    default:
+      break;
+    }
+    fold_expr(e.rhs);
+    break;
+  }
+  case EXPR_STRUCT: {
+    ExprStruct e = TO_EXPR_STRUCT(*exp);
+    for (size_t i = 0; i < e.initializers.count; i++) {
+      fold_expr(&e.initializers.data[i]);
+    }
+    break;
+  }
+  case EXPR_S_INIT:
+    fold_expr(TO_EXPR_S_INIT(*exp).value);
+    break;
+  case EXPR_ARRAY: {
+    ExprArray e = TO_EXPR_ARRAY(*exp);
+    for (size_t i = 0; i < e.elements.count; i++) {
+      fold_expr(&e.elements.data[i]);
+    }
+    break;
+  }
+  case EXPR_SUBSCRIPT:
+    fold_expr(TO_EXPR_SUBSCRIPT(*exp).expr);
+    fold_expr(TO_EXPR_SUBSCRIPT(*exp).index);
+    break;
+  default:
+    break;
+  }
+}
+
+void fold_constants(Stmt *stmt) {
+  switch (stmt->kind) {
+  case STMT_LET:
+    fold_expr(&TO_STMT_LET(*stmt).initializer);
+    break;
+  case STMT_EXPR:
+    fold_expr(&TO_STMT_EXPR(*stmt).exp);
+    break;
+  case STMT_PRINT:
+    fold_expr(&TO_STMT_PRINT(*stmt).exp);
+    break;
+  case STMT_BLOCK:
+    for (size_t i = 0; i < TO_STMT_BLOCK(stmt).stmts.count; i++) {
+      fold_constants(&TO_STMT_BLOCK(stmt).stmts.data[i]);
+    }
+    break;
+  case STMT_IF:
+    fold_expr(&TO_STMT_IF(*stmt).condition);
+    fold_constants(TO_STMT_IF(*stmt).then_branch);
+    if (TO_STMT_IF(*stmt).else_branch != NULL) {
+      fold_constants(TO_STMT_IF(*stmt).else_branch);
+    }
+    break;
+  case STMT_WHILE:
+    fold_expr(&TO_STMT_WHILE(*stmt).condition);
+    fold_constants(TO_STMT_WHILE(*stmt).body);
+    break;
+  case STMT_FOR:
+    fold_expr(&TO_STMT_FOR(*stmt).initializer);
+    fold_expr(&TO_STMT_FOR(*stmt).condition);
+    fold_expr(&TO_STMT_FOR(*stmt).advancement);
+    fold_constants(TO_STMT_FOR(*stmt).body);
+    break;
+  case STMT_FN:
+    fold_constants(TO_STMT_FN(*stmt).body);
+    break;
+  case STMT_RETURN:
+    fold_expr(&TO_STMT_RETURN(*stmt).returnval);
+    break;
+  case STMT_IMPL:
+    for (size_t i = 0; i < TO_STMT_IMPL(*stmt).methods.count; i++) {
+      fold_constants(&TO_STMT_IMPL(*stmt).methods.data[i]);
+    }
+    break;
+  default:
+    break;
+  }
+}
@@ -0,0 +1,8 @@
+#ifndef venom_fold_h
+#define venom_fold_h
+
+#include "parser.h"
+
+void fold_constants(Stmt *stmt);
+
+#endif
@@ -0,0 +1,1429 @@
+#ifdef JIT
+
+#if !defined(__x86_64__) || defined(NAN_BOXING)
+#error "the jit only supports x86-64, without nan boxing"
+#endif
+
+#include <assert.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "jit.h"
+#include "optimizer.h"
+#include "vm.h"
+
+/* A baseline template jit. Once a function has been called JIT_THRES-
+ * HOLD times, the vm hands it to jit_compile(), which translates its
+ * bytecode into x86-64 machine code, one template per instruction.
+ *
+ * Just like the register engine, the jit works out the depth of the
+ * stack before each instruction of the function. Since the depth is
+ * known, every push and pop turns into a load or a store at a fixed
+ * offset from the frame base, which is kept in rbx, and the vm's tos
+ * is never touched. Each template does exactly what the handler of
+ * its opcode does (including the refcounting), so the objects in the
+ * frame look the same as if the function had been interpreted.
+ *
+ * The functions that a function calls are compiled along with it, so
+ * that the calls can be made natively. If any of them uses an opcode
+ * that has no template, none of them are compiled, and they all keep
+ * running on the interpreter.
+ *
+ * To let perf attribute the samples in the compiled code, each comp-
+ * iled function is listed in /tmp/perf-<pid>.map. */
+
+/* Where the parts of an object are, relative to its slot. */
+#define TYPE offsetof(Object, type)
+#define VALUE offsetof(Object, as)
+
+typedef DynArray(Function *) DynArray_Function_ptr;
+
+/* A rel32 in the machine code at 'at' that is to be pointed at the
+ * code of the instruction at bytecode offset 'target' (for jumps), or
+ * at the function with index 'target' in the batch (for calls). */
+typedef struct {
+  size_t at;
+  size_t target;
+} Patch;
+
+typedef DynArray(Patch) DynArray_Patch;
+
+typedef struct {
+  Jit *jit;
+  Bytecode *code;
+  DynArray_Function_ptr batch; /* the functions compiled together */
+  DynArray_uint32_t ends;      /* of each function in the batch */
+  int *depths;                 /* indexed by bytecode offset */
+  size_t *native;              /* indexed by bytecode offset */
+  DynArray_uint8_t buf;
+  DynArray_Patch jumps;
+  DynArray_Patch calls;
+} JitCompiler;
+
+/* Find the function called by the OP_CALL (or the OP_TAILCALL) at
+ * 'offset'. */
+static Function *find_callee(JitCompiler *jc, size_t offset) {
+  size_t location = operand_at(&jc->code->code.data[offset], 1);
+  if (location >= jc->code->code.count) {
+    return NULL;
+  }
+  return jc->jit->functions[location];
+}
+
+static int batch_index(JitCompiler *jc, Function *function) {
+  for (size_t i = 0; i < jc->batch.count; i++) {
+    if (jc->batch.data[i] == function) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/* Record that the instruction at 'offset' of 'function' is reached
+ * with 'depth' objects in the frame, and queue it up if it has not
+ * been seen before. Returns false if it had been reached before with
+ * a different depth, or if it is outside of the function's code. */
+static bool reach(JitCompiler *jc, Function *function,
+                  DynArray_uint32_t *worklist, size_t offset, int depth) {
+  if (offset < function->location || offset >= jc->code->code.count ||
+      depth < 0) {
+    return false;
+  }
+  if (jc->depths[offset] != UNREACHABLE) {
+    return jc->depths[offset] == depth;
+  }
+  jc->depths[offset] = depth;
+  dynarray_insert(worklist, offset);
+  return true;
+}
+
+/* Work out the depth of the stack before each instruction of 'func-
+ * tion', and add the functions it calls to the batch. On success,
+ * the offset of the last instruction reached is stored in 'end'. */
+static bool analyze(JitCompiler *jc, Function *function, uint32_t *end) {
+  Bytecode *code = jc->code;
+  DynArray_uint32_t worklist = {0};
+  bool ok = reach(jc, function, &worklist, function->location,
+                  function->paramcount);
+
+  *end = function->location;
+
+  while (ok && worklist.count > 0) {
+    uint32_t offset = dynarray_pop(&worklist);
+    uint8_t *p = &code->code.data[offset];
+    int depth = jc->depths[offset];
+    size_t next = offset + instruction_length(code, offset);
+
+    if (offset > *end) {
+      *end = offset;
+    }
+
+    switch (unfused_opcode(*p)) {
+    case OP_CONST:
+    case OP_TRUE:
+    case OP_NULL:
+      ok = reach(jc, function, &worklist, next, depth + 1);
+      break;
+    case OP_DEEPGET:
+      ok = operand_at(p, 0) < (uint32_t)depth &&
+           reach(jc, function, &worklist, next, depth + 1);
+      break;
+    case OP_DEEPSET:
+      ok = depth >= 1 && operand_at(p, 0) < (uint32_t)depth - 1 &&
+           reach(jc, function, &worklist, next, depth - 1);
+      break;
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_MOD:
+    case OP_LT:
+    case OP_GT:
+      ok = depth >= 2 && reach(jc, function, &worklist, next, depth - 1);
+      break;
+    case OP_NOT:
+    case OP_NEG:
+      ok = depth >= 1 && reach(jc, function, &worklist, next, depth);
+      break;
+    case OP_POP:
+      ok = reach(jc, function, &worklist, next, depth - 1);
+      break;
+    case OP_JMP:
+      ok = reach(jc, function, &worklist, jump_target(code->code.data, offset),
+                 depth);
+      break;
+    case OP_JZ:
+    case OP_JNZ:
+      ok = reach(jc, function, &worklist, jump_target(code->code.data, offset),
+                 depth - 1) &&
+           reach(jc, function, &worklist, next, depth - 1);
+      break;
+    case OP_CALL:
+    case OP_TAILCALL: {
+      uint32_t argcount = operand_at(p, 0);
+      Function *callee = find_callee(jc, offset);
+      ok = callee && argcount <= (uint32_t)depth &&
+           (*p == OP_TAILCALL ||
+            reach(jc, function, &worklist, next, depth - (int)argcount + 1));
+      if (ok && !callee->native && batch_index(jc, callee) < 0) {
+        dynarray_insert(&jc->batch, callee);
+      }
+      break;
+    }
+    case OP_RET:
+      ok = depth >= 1;
+      break;
+    default:
+      ok = false;
+      break;
+    }
+  }
+
+  dynarray_free(&worklist);
+  return ok;
+}
+
+static void emit_bytes(JitCompiler *jc, uint8_t *bytes, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    dynarray_insert(&jc->buf, bytes[i]);
+  }
+}
+
+#define EMIT(...)                                                              \
+  emit_bytes(jc, (uint8_t[]){__VA_ARGS__}, sizeof((uint8_t[]){__VA_ARGS__}))
+
+static void emit_uint32(JitCompiler *jc, uint32_t x) {
+  for (size_t i = 0; i < 4; i++) {
+    dynarray_insert(&jc->buf, (uint8_t)(x >> (i * 8)));
+  }
+}
+
+static void emit_uint64(JitCompiler *jc, uint64_t x) {
+  for (size_t i = 0; i < 8; i++) {
+    dynarray_insert(&jc->buf, (uint8_t)(x >> (i * 8)));
+  }
+}
+
+/* Emit the ModRM byte and the displacement that address 'field' of
+ * the object in 'slot' of the frame, i.e. [rbx + slot * 16 + field],
+ * with 'reg' (a register or an opcode extension) in the reg field. */
+static void emit_slot(JitCompiler *jc, uint8_t reg, uint32_t slot,
+                      size_t field) {
+  EMIT(0x80 | (reg << 3) | 3);
+  emit_uint32(jc, slot * sizeof(Object) + field);
+}
+
+/* mov qword [slot].type, type
+ *
+ * The type is stored as a qword (clearing the padding after it), so
+ * that emit_copy() can load it back with a store-to-load forward. */
+static void emit_set_type(JitCompiler *jc, uint32_t slot, ObjectType type) {
+  EMIT(0x48, 0xc7);
+  emit_slot(jc, 0, slot, TYPE);
+  emit_uint32(jc, type);
+}
+
+/* mov rax, fn; call rax */
+static void emit_call_c(JitCompiler *jc, uintptr_t fn) {
+  EMIT(0x48, 0xb8);
+  emit_uint64(jc, fn);
+  EMIT(0xff, 0xd0);
+}
+
+/* Call 'fn' (objincref or objdecref) on the object in 'slot' if it is
+ * refcounted. The refcounted types come first in ObjectType, so it is
+ * only a matter of comparing the type against the last one of them. */
+static void emit_refcount(JitCompiler *jc, uint32_t slot, uintptr_t fn) {
+  EMIT(0x83); /* cmp dword [slot].type, OBJ_ARRAY */
+  emit_slot(jc, 7, slot, TYPE);
+  EMIT(OBJ_ARRAY);
+  EMIT(0x77, 0x00); /* ja skip */
+  size_t skip = jc->buf.count;
+  EMIT(0x48, 0x8d); /* lea rdi, [slot] */
+  emit_slot(jc, 7, slot, 0);
+  emit_call_c(jc, fn);
+  jc->buf.data[skip - 1] = jc->buf.count - skip;
+}
+
+/* Copy the object in 'from' to 'to', as two qwords. A single 16-byte
+ * load would not be forwarded from the smaller stores that wrote the
+ * object, and it would stall until they reach the cache. */
+static void emit_copy(JitCompiler *jc, uint32_t from, uint32_t to) {
+  EMIT(0x48, 0x8b); /* mov rax, [from] */
+  emit_slot(jc, 0, from, 0);
+  EMIT(0x48, 0x8b); /* mov rdx, [from + 8] */
+  emit_slot(jc, 2, from, 8);
+  EMIT(0x48, 0x89); /* mov [to], rax */
+  emit_slot(jc, 0, to, 0);
+  EMIT(0x48, 0x89); /* mov [to + 8], rdx */
+  emit_slot(jc, 2, to, 8);
+}
+
+/* Check that the objects in 'a' and 'b' are numbers, the same way the
+ * handlers of the arithmetic and the comparisons do, and raise the
+ * error for the operator 'op' if they are not. */
+static void emit_number_guard(JitCompiler *jc, uint32_t a, uint32_t b,
+                              const char *op) {
+  EMIT(0x83); /* cmp dword [a].type, OBJ_NUMBER */
+  emit_slot(jc, 7, a, TYPE);
+  EMIT(OBJ_NUMBER);
+  EMIT(0x75, 0x00); /* jne fail */
+  size_t fail = jc->buf.count;
+  EMIT(0x83); /* cmp dword [b].type, OBJ_NUMBER */
+  emit_slot(jc, 7, b, TYPE);
+  EMIT(OBJ_NUMBER);
+  EMIT(0x74, 0x00); /* je skip */
+  size_t skip = jc->buf.count;
+  jc->buf.data[fail - 1] = jc->buf.count - fail;
+  /* unsupported_types(op, a, b) in vm.c. An Object is passed as two
+   * qwords, so 'a' goes in rsi:rdx and 'b' in rcx:r8. */
+  EMIT(0x48, 0xbf); /* mov rdi, op */
+  emit_uint64(jc, (uintptr_t)op);
+  EMIT(0x48, 0x8b); /* mov rsi, [a] */
+  emit_slot(jc, 6, a, 0);
+  EMIT(0x48, 0x8b); /* mov rdx, [a + 8] */
+  emit_slot(jc, 2, a, 8);
+  EMIT(0x48, 0x8b); /* mov rcx, [b] */
+  emit_slot(jc, 1, b, 0);
+  EMIT(0x4c, 0x8b); /* mov r8, [b + 8] */
+  emit_slot(jc, 0, b, 8);
+  emit_call_c(jc, (uintptr_t)unsupported_types);
+  jc->buf.data[skip - 1] = jc->buf.count - skip;
+}
+
+/* movsd xmm0, [a].value; <op>sd xmm0, [b].value; movsd [a].value, xmm0 */
+static void emit_arithmetic(JitCompiler *jc, uint8_t op, uint32_t a,
+                            uint32_t b) {
+  EMIT(0xf2, 0x0f, 0x10);
+  emit_slot(jc, 0, a, VALUE);
+  EMIT(0xf2, 0x0f, op);
+  emit_slot(jc, 0, b, VALUE);
+  EMIT(0xf2, 0x0f, 0x11);
+  emit_slot(jc, 0, a, VALUE);
+  emit_set_type(jc, a, OBJ_NUMBER);
+}
+
+/* Store [left].value > [right].value into 'dst'. Unlike the other
+ * conditions, 'above' is false when the comparison is unordered, so
+ * the comparisons with NaN come out false, as they do in C. */
+static void emit_comparison(JitCompiler *jc, uint32_t dst, uint32_t left,
+                            uint32_t right) {
+  EMIT(0xf2, 0x0f, 0x10); /* movsd xmm0, [left].value */
+  emit_slot(jc, 0, left, VALUE);
+  EMIT(0x66, 0x0f, 0x2f); /* comisd xmm0, [right].value */
+  emit_slot(jc, 0, right, VALUE);
+  EMIT(0x0f, 0x97, 0xc0); /* seta al */
+  EMIT(0x0f, 0xb6, 0xc0); /* movzx eax, al */
+  EMIT(0x48, 0x89);       /* mov [dst].value, rax */
+  emit_slot(jc, 0, dst, VALUE);
+  emit_set_type(jc, dst, OBJ_BOOLEAN);
+}
+
+/* Emit the template of the instruction at 'offset'. */
+static void emit_instruction(JitCompiler *jc, size_t offset) {
+  uint8_t *p = &jc->code->code.data[offset];
+  uint32_t depth = jc->depths[offset];
+
+  switch (unfused_opcode(*p)) {
+  case OP_CONST: {
+    uint64_t bits;
+    memcpy(&bits, &jc->code->cp.data[operand_at(p, 0)], sizeof(bits));
+    emit_set_type(jc, depth, OBJ_NUMBER);
+    EMIT(0x48, 0xb8); /* mov rax, imm64 */
+    emit_uint64(jc, bits);
+    EMIT(0x48, 0x89); /* mov [depth].value, rax */
+    emit_slot(jc, 0, depth, VALUE);
+    break;
+  }
+  case OP_TRUE:
+    emit_set_type(jc, depth, OBJ_BOOLEAN);
+    EMIT(0x48, 0xc7); /* mov qword [depth].value, 1 */
+    emit_slot(jc, 0, depth, VALUE);
+    emit_uint32(jc, 1);
+    break;
+  case OP_NULL:
+    emit_set_type(jc, depth, OBJ_NULL);
+    break;
+  case OP_DEEPGET:
+    emit_copy(jc, operand_at(p, 0), depth);
+    emit_refcount(jc, depth, (uintptr_t)objincref);
+    break;
+  case OP_DEEPSET: {
+    uint32_t idx = operand_at(p, 0);
+    emit_refcount(jc, idx, (uintptr_t)objdecref);
+    emit_copy(jc, depth - 1, idx);
+    break;
+  }
+  case OP_ADD:
+    emit_number_guard(jc, depth - 2, depth - 1, "+");
+    emit_arithmetic(jc, 0x58, depth - 2, depth - 1);
+    break;
+  case OP_SUB:
+    emit_number_guard(jc, depth - 2, depth - 1, "-");
+    emit_arithmetic(jc, 0x5c, depth - 2, depth - 1);
+    break;
+  case OP_MUL:
+    emit_number_guard(jc, depth - 2, depth - 1, "*");
+    emit_arithmetic(jc, 0x59, depth - 2, depth - 1);
+    break;
+  case OP_DIV:
+    emit_number_guard(jc, depth - 2, depth - 1, "/");
+    emit_arithmetic(jc, 0x5e, depth - 2, depth - 1);
+    break;
+  case OP_MOD:
+    emit_number_guard(jc, depth - 2, depth - 1, "%");
+    EMIT(0xf2, 0x0f, 0x10); /* movsd xmm0, [depth - 2].value */
+    emit_slot(jc, 0, depth - 2, VALUE);
+    EMIT(0xf2, 0x0f, 0x10); /* movsd xmm1, [depth - 1].value */
+    emit_slot(jc, 1, depth - 1, VALUE);
+    emit_call_c(jc, (uintptr_t)fmod);
+    EMIT(0xf2, 0x0f, 0x11); /* movsd [depth - 2].value, xmm0 */
+    emit_slot(jc, 0, depth - 2, VALUE);
+    emit_set_type(jc, depth - 2, OBJ_NUMBER);
+    break;
+  case OP_LT:
+    emit_number_guard(jc, depth - 2, depth - 1, "<");
+    emit_comparison(jc, depth - 2, depth - 1, depth - 2);
+    break;
+  case OP_GT:
+    emit_number_guard(jc, depth - 2, depth - 1, ">");
+    emit_comparison(jc, depth - 2, depth - 2, depth - 1);
+    break;
+  case OP_NOT:
+    EMIT(0x80); /* xor byte [depth - 1].value, 1 */
+    emit_slot(jc, 6, depth - 1, VALUE);
+    EMIT(0x01);
+    emit_set_type(jc, depth - 1, OBJ_BOOLEAN);
+    break;
+  case OP_NEG:
+    EMIT(0x48, 0x8b); /* mov rax, [depth - 1].value */
+    emit_slot(jc, 0, depth - 1, VALUE);
+    EMIT(0x48, 0x0f, 0xba, 0xf8, 0x3f); /* btc rax, 63 */
+    EMIT(0x48, 0x89);                   /* mov [depth - 1].value, rax */
+    emit_slot(jc, 0, depth - 1, VALUE);
+    emit_set_type(jc, depth - 1, OBJ_NUMBER);
+    break;
+  case OP_POP:
+    emit_refcount(jc, depth - 1, (uintptr_t)objdecref);
+    break;
+  case OP_JMP: {
+    EMIT(0xe9); /* jmp rel32 */
+    Patch patch = {.at = jc->buf.count,
+                   .target = jump_target(jc->code->code.data, offset)};
+    dynarray_insert(&jc->jumps, patch);
+    emit_uint32(jc, 0);
+    break;
+  }
+  case OP_JZ:
+  case OP_JNZ: {
+    EMIT(0x80); /* cmp byte [depth - 1].value, 0 */
+    emit_slot(jc, 7, depth - 1, VALUE);
+    EMIT(0x00);
+    /* je rel32 or jne rel32 */
+    EMIT(0x0f, unfused_opcode(*p) == OP_JZ ? 0x84 : 0x85);
+    Patch patch = {.at = jc->buf.count,
+                   .target = jump_target(jc->code->code.data, offset)};
+    dynarray_insert(&jc->jumps, patch);
+    emit_uint32(jc, 0);
+    break;
+  }
+  case OP_CALL: {
+    uint32_t argcount = operand_at(p, 0);
+    Function *callee = find_callee(jc, offset);
+    EMIT(0x48, 0x8d); /* lea rdi, [depth - argcount] */
+    emit_slot(jc, 7, depth - argcount, 0);
+    if (callee->native) {
+      emit_call_c(jc, (uintptr_t)callee->native);
+    } else {
+      EMIT(0xe8); /* call rel32 */
+      Patch patch = {.at = jc->buf.count,
+                     .target = batch_index(jc, callee)};
+      dynarray_insert(&jc->calls, patch);
+      emit_uint32(jc, 0);
+    }
+    break;
+  }
+  case OP_TAILCALL: {
+    /* Drop the frame, move the arguments to its base, and jump to the
+     * callee, which returns to our caller. */
+    uint32_t argcount = operand_at(p, 0);
+    Function *callee = find_callee(jc, offset);
+    for (uint32_t slot = 0; slot < depth - argcount; slot++) {
+      emit_refcount(jc, slot, (uintptr_t)objdecref);
+    }
+    for (uint32_t i = 0; i < argcount && depth > argcount; i++) {
+      emit_copy(jc, depth - argcount + i, i);
+    }
+    EMIT(0x48, 0x89, 0xdf); /* mov rdi, rbx */
+    EMIT(0x5b);             /* pop rbx */
+    if (callee->native) {
+      EMIT(0x48, 0xb8); /* mov rax, native; jmp rax */
+      emit_uint64(jc, (uintptr_t)callee->native);
+      EMIT(0xff, 0xe0);
+    } else {
+      EMIT(0xe9); /* jmp rel32 */
+      Patch patch = {.at = jc->buf.count,
+                     .target = batch_index(jc, callee)};
+      dynarray_insert(&jc->calls, patch);
+      emit_uint32(jc, 0);
+    }
+    break;
+  }
+  case OP_RET:
+    /* Drop the frame, and move the return value to its base. */
+    for (uint32_t slot = 0; slot < depth - 1; slot++) {
+      emit_refcount(jc, slot, (uintptr_t)objdecref);
+    }
+    if (depth > 1) {
+      emit_copy(jc, depth - 1, 0);
+    }
+    EMIT(0x5b, 0xc3); /* pop rbx; ret */
+    break;
+  default:
+    assert(0);
+  }
+}
+
+/* Emit the code of 'function', whose instructions (the ones that were
+ * reached during the analysis) are all between its location and the
+ * offset 'end'. On entry, the frame base is in rdi. Pushing rbx also
+ * keeps the stack aligned for the calls made by the templates. */
+static void emit_function(JitCompiler *jc, Function *function, uint32_t end) {
+  EMIT(0x53);             /* push rbx */
+  EMIT(0x48, 0x89, 0xfb); /* mov rbx, rdi */
+
+  for (size_t offset = function->location; offset <= end;
+       offset += instruction_length(jc->code, offset)) {
+    if (jc->depths[offset] != UNREACHABLE) {
+      jc->native[offset] = jc->buf.count;
+      emit_instruction(jc, offset);
+    }
+  }
+}
+
+static void patch_rel32(JitCompiler *jc, size_t at, size_t target) {
+  uint32_t rel = (uint32_t)(target - (at + 4));
+  memcpy(&jc->buf.data[at], &rel, sizeof(rel));
+}
+
+static void write_perf_map(Jit *jit, uint8_t *addr, size_t size, char *name) {
+  if (!jit->perf_map) {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+    jit->perf_map = fopen(path, "w");
+    if (!jit->perf_map) {
+      return;
+    }
+  }
+  fprintf(jit->perf_map, "%lx %zx venom:%s\n", (unsigned long)(uintptr_t)addr,
+          size, name);
+  fflush(jit->perf_map);
+}
+
+/* Copy the machine code in 'buf' into executable memory. Returns
+ * NULL if the memory can't be mapped. */
+static uint8_t *install_code(Jit *jit, DynArray_uint8_t *buf) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t size = (buf->count + page - 1) / page * page;
+
+  uint8_t *addr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (addr == MAP_FAILED) {
+    return NULL;
+  }
+
+  memcpy(addr, buf->data, buf->count);
+
+  if (mprotect(addr, size, PROT_READ | PROT_EXEC) != 0) {
+    munmap(addr, size);
+    return NULL;
+  }
+
+  JitRegion region = {.addr = addr, .size = size};
+  dynarray_insert(&jit->regions, region);
+
+  return addr;
+}
+
+/* Install the code of the batch, and point each of the functions in
+ * it at its code. */
+static bool install(JitCompiler *jc, size_t *starts) {
+  uint8_t *addr = install_code(jc->jit, &jc->buf);
+  if (!addr) {
+    return false;
+  }
+
+  for (size_t i = 0; i < jc->batch.count; i++) {
+    size_t end = i + 1 < jc->batch.count ? starts[i + 1] : jc->buf.count;
+    jc->batch.data[i]->native = addr + starts[i];
+    write_perf_map(jc->jit, addr + starts[i], end - starts[i],
+                   jc->batch.data[i]->name);
+  }
+
+  return true;
+}
+
+/* The tracing jit. The vm counts how many times each loop header is
+ * jumped back to (see jit_loop()), and once a loop is hot, it records
+ * a trace of the next iteration: starting from the header, it runs
+ * the instructions one by one, on the vm's own stack, and emits the
+ * machine code for each of them, until the iteration gets back to the
+ * header. Only the straight line through the loop is compiled, in the
+ * direction the conditional jumps took while recording. The code of
+ * the other directions is replaced by exits back to the interpreter.
+ *
+ * A trace only deals with numbers, which are kept unboxed in the xmm
+ * registers, so there is no refcounting or type checking in the loop.
+ * The locals and the globals that the trace uses are checked to be
+ * numbers when the trace is entered (before the first iteration), and
+ * are then loaded into registers. The temporaries that are pushed in
+ * the loop get a register of their own, for as long as they are on
+ * the stack.
+ *
+ * The trace is entered from the interpreter whenever it jumps back to
+ * the loop header, in the middle of whatever function the loop is in
+ * (on-stack replacement). When a jump goes the other way than it did
+ * while recording, the trace is left by writing the registers back to
+ * the variables, and the temporaries to the stack, which leaves the vm
+ * in the state it would have been in if the loop had been interpreted
+ * (deoptimization). The interpreter then picks up from there.
+ *
+ * If the iteration runs into anything else (an opcode that is not
+ * supported, an object that is not a number, a nested loop, ...), the
+ * recording is abandoned, and the interpreter continues right where it
+ * stopped, since the instructions that were recorded were also run. */
+
+#define TRACE_MAX_LENGTH 500
+#define TRACE_STACK_MAX 64
+
+/* xmm0 and xmm1 are scratch registers, the rest can be allocated. */
+#define FIRST_TRACE_REGISTER 2
+#define TRACE_REGISTERS 16
+
+/* In a trace, rbx holds the frame, r14 the globals, and r15 the addr-
+ * ess that the depth of the stack is written to on exit. */
+#define RBX 3
+#define R14 14
+#define R15 15
+
+typedef enum {
+  VALUE_REG,
+  VALUE_VAR,
+  VALUE_CONST,
+  VALUE_BOOL,
+} TraceValueKind;
+
+/* A value pushed on the stack by the trace. */
+typedef struct {
+  TraceValueKind kind;
+  int reg;    /* VALUE_REG: the xmm register that holds the number */
+  int var;    /* VALUE_VAR: the variable whose current value it is */
+  double num; /* VALUE_CONST */
+  bool truth; /* VALUE_BOOL */
+} TraceValue;
+
+/* A local below the depth at the loop header, or a global, that the
+ * trace uses. It lives in the xmm register 'reg' for the whole trace. */
+typedef struct {
+  bool global;
+  uint32_t idx;
+  int reg;
+} TraceVar;
+
+/* An exit from the trace, taken by the jumps whose rel32s are at
+ * 'jumps'. The exits are emitted after the loop is closed, once all of
+ * the variables are known: a variable that is only used further down
+ * the loop still has to be written back, since it may have been set
+ * in an earlier iteration. */
+typedef struct {
+  size_t jumps[2];
+  size_t jump_count;
+  uint32_t resume;
+  TraceValue *stack; /* a copy of the trace's stack at the exit */
+  size_t count;
+} TraceExit;
+
+typedef DynArray(TraceExit) DynArray_TraceExit;
+
+typedef struct {
+  JitCompiler jc; /* emits the body of the loop */
+  VM *vm;
+  size_t frame;
+  uint32_t depth; /* of the stack (relative to the frame) at the header */
+  TraceVar vars[TRACE_REGISTERS];
+  size_t var_count;
+  TraceValue stack[TRACE_STACK_MAX]; /* above 'depth' */
+  size_t count;
+  bool used[TRACE_REGISTERS];
+  bool touched[TRACE_REGISTERS]; /* has held a temporary */
+  bool *visited; /* indexed by offset */
+  DynArray_TraceExit exits;
+} TraceRecorder;
+
+/* An SSE instruction ([prefix] 0F op) between the xmm registers 'reg'
+ * and 'rm'. */
+static void emit_sse(JitCompiler *jc, uint8_t prefix, uint8_t op, int reg,
+                     int rm) {
+  if (prefix) {
+    EMIT(prefix);
+  }
+  if (reg >= 8 || rm >= 8) {
+    EMIT(0x40 | (reg >> 3) << 2 | rm >> 3);
+  }
+  EMIT(0x0f, op, 0xc0 | (reg & 7) << 3 | (rm & 7));
+}
+
+/* The same, between the xmm register 'reg' and [base + disp]. */
+static void emit_sse_mem(JitCompiler *jc, uint8_t prefix, uint8_t op, int reg,
+                         int base, uint32_t disp) {
+  if (prefix) {
+    EMIT(prefix);
+  }
+  if (reg >= 8 || base >= 8) {
+    EMIT(0x40 | (reg >> 3) << 2 | base >> 3);
+  }
+  EMIT(0x0f, op, 0x80 | (reg & 7) << 3 | (base & 7));
+  emit_uint32(jc, disp);
+}
+
+/* An instruction (op) between the general purpose register 'reg' (or
+ * an opcode extension) and [base + disp], 64-bit wide if 'wide'. */
+static void emit_gpr_mem(JitCompiler *jc, bool wide, uint8_t op, int reg,
+                         int base, uint32_t disp) {
+  uint8_t rex = 0x40 | wide << 3 | (reg >> 3) << 2 | base >> 3;
+  if (rex != 0x40) {
+    EMIT(rex);
+  }
+  EMIT(op, 0x80 | (reg & 7) << 3 | (base & 7));
+  emit_uint32(jc, disp);
+}
+
+/* mov rax, num; movq xmm<reg>, rax */
+static void emit_load_num(JitCompiler *jc, int reg, double num) {
+  uint64_t bits;
+  memcpy(&bits, &num, sizeof(bits));
+  EMIT(0x48, 0xb8);
+  emit_uint64(jc, bits);
+  EMIT(0x66, 0x48 | (reg >> 3) << 2, 0x0f, 0x6e, 0xc0 | (reg & 7) << 3);
+}
+
+/* Emit a jcc rel32, and return the offset of the rel32 to patch. */
+static size_t emit_jcc(JitCompiler *jc, uint8_t cc) {
+  EMIT(0x0f, 0x80 | cc);
+  size_t at = jc->buf.count;
+  emit_uint32(jc, 0);
+  return at;
+}
+
+#define CC_E 0x4
+#define CC_NE 0x5
+#define CC_BE 0x6
+#define CC_A 0x7
+#define CC_P 0xa
+
+/* Write the depth of the stack through r15, and return 'resume' (the
+ * offset that the interpreter continues from) to the vm. */
+static void emit_leave(JitCompiler *jc, uint32_t depth, uint32_t resume) {
+  EMIT(0x41, 0xc7, 0x07); /* mov dword [r15], depth */
+  emit_uint32(jc, depth);
+  EMIT(0xb8); /* mov eax, resume */
+  emit_uint32(jc, resume);
+  EMIT(0x41, 0x5f, 0x41, 0x5e, 0x5b, 0xc3); /* pop r15; pop r14; pop rbx */
+}
+
+static int var_base(TraceVar *var) { return var->global ? R14 : RBX; }
+
+/* Temporaries are allocated from the bottom of the xmm registers, and
+ * variables from the top. */
+static int alloc_register(TraceRecorder *tr) {
+  for (int reg = FIRST_TRACE_REGISTER; reg < TRACE_REGISTERS; reg++) {
+    if (!tr->used[reg]) {
+      tr->used[reg] = tr->touched[reg] = true;
+      return reg;
+    }
+  }
+  return -1;
+}
+
+static void free_value(TraceRecorder *tr, TraceValue *value) {
+  if (value->kind == VALUE_REG) {
+    tr->used[value->reg] = false;
+  }
+}
+
+/* Find the variable for the local (or global) 'idx', giving it a reg-
+ * ister the first time it is used. Returns -1 if there are no regis-
+ * ters left. */
+static int find_var(TraceRecorder *tr, bool global, uint32_t idx) {
+  for (size_t i = 0; i < tr->var_count; i++) {
+    if (tr->vars[i].global == global && tr->vars[i].idx == idx) {
+      return i;
+    }
+  }
+  /* A variable holds its value from the previous iteration above the
+   * point where it is first used, so it can't take a register that has
+   * held a temporary. */
+  int reg = TRACE_REGISTERS - 1;
+  while (reg >= FIRST_TRACE_REGISTER && (tr->used[reg] || tr->touched[reg])) {
+    reg--;
+  }
+  if (reg < FIRST_TRACE_REGISTER) {
+    return -1;
+  }
+  tr->used[reg] = true;
+  tr->vars[tr->var_count] =
+      (TraceVar){.global = global, .idx = idx, .reg = reg};
+  return tr->var_count++;
+}
+
+/* Put the number 'value' into the xmm register 'reg'. */
+static void emit_load_value(TraceRecorder *tr, int reg, TraceValue *value) {
+  JitCompiler *jc = &tr->jc;
+  switch (value->kind) {
+  case VALUE_REG:
+    if (value->reg != reg) {
+      emit_sse(jc, 0x66, 0x28, reg, value->reg); /* movapd */
+    }
+    break;
+  case VALUE_VAR:
+    if (tr->vars[value->var].reg != reg) {
+      emit_sse(jc, 0x66, 0x28, reg, tr->vars[value->var].reg); /* movapd */
+    }
+    break;
+  case VALUE_CONST:
+    emit_load_num(jc, reg, value->num);
+    break;
+  default:
+    assert(0);
+  }
+}
+
+/* Return the xmm register that holds the number 'value', loading it
+ * into 'scratch' if it is a constant. */
+static int value_register(TraceRecorder *tr, TraceValue *value, int scratch) {
+  switch (value->kind) {
+  case VALUE_REG:
+    return value->reg;
+  case VALUE_VAR:
+    return tr->vars[value->var].reg;
+  default:
+    emit_load_value(tr, scratch, value);
+    return scratch;
+  }
+}
+
+/* Add an exit to the interpreter at 'resume', for the jumps that have
+ * just been emitted. */
+static void add_exit(TraceRecorder *tr, size_t *jumps, size_t jump_count,
+                     uint32_t resume) {
+  TraceExit exit = {.jump_count = jump_count,
+                    .resume = resume,
+                    .stack = malloc(sizeof(TraceValue) * (tr->count + 1)),
+                    .count = tr->count};
+  memcpy(exit.jumps, jumps, sizeof(size_t) * jump_count);
+  memcpy(exit.stack, tr->stack, sizeof(TraceValue) * tr->count);
+  dynarray_insert(&tr->exits, exit);
+}
+
+/* Emit 'exit': the variables are written back, and the values on the
+ * trace's stack are boxed and stored in their slots of the frame. The
+ * temporaries are still in the registers they were in at the jump. */
+static void emit_exit(TraceRecorder *tr, TraceExit *exit) {
+  JitCompiler *jc = &tr->jc;
+
+  for (size_t i = 0; i < exit->jump_count; i++) {
+    patch_rel32(jc, exit->jumps[i], jc->buf.count);
+  }
+
+  for (size_t i = 0; i < tr->var_count; i++) {
+    TraceVar *var = &tr->vars[i];
+    emit_sse_mem(jc, 0xf2, 0x11, var->reg, var_base(var),
+                 var->idx * sizeof(Object) + VALUE); /* movsd */
+  }
+
+  for (size_t i = 0; i < exit->count; i++) {
+    TraceValue *value = &exit->stack[i];
+    uint32_t slot = (tr->depth + i) * sizeof(Object);
+
+    if (value->kind == VALUE_BOOL) {
+      emit_gpr_mem(jc, true, 0xc7, 0, RBX, slot + TYPE);
+      emit_uint32(jc, OBJ_BOOLEAN);
+      emit_gpr_mem(jc, true, 0xc7, 0, RBX, slot + VALUE);
+      emit_uint32(jc, value->truth);
+      continue;
+    }
+
+    emit_gpr_mem(jc, true, 0xc7, 0, RBX, slot + TYPE);
+    emit_uint32(jc, OBJ_NUMBER);
+    int reg = value_register(tr, value, 0);
+    emit_sse_mem(jc, 0xf2, 0x11, reg, RBX, slot + VALUE); /* movsd */
+  }
+
+  emit_leave(jc, tr->depth + exit->count, exit->resume);
+}
+
+static bool push_value(TraceRecorder *tr, TraceValue value) {
+  if (tr->count == TRACE_STACK_MAX) {
+    return false;
+  }
+  tr->stack[tr->count++] = value;
+  return true;
+}
+
+/* OP_DEEPGET and OP_GET_GLOBAL. */
+static bool record_get(TraceRecorder *tr, bool global, uint32_t idx) {
+  VM *vm = tr->vm;
+  Object obj = global ? vm->globals[idx] : vm->stack[tr->frame + idx];
+
+  if (!IS_NUM(obj)) {
+    return false;
+  }
+
+  TraceValue value;
+  if (global || idx < tr->depth) {
+    int var = find_var(tr, global, idx);
+    if (var < 0) {
+      return false;
+    }
+    value = (TraceValue){.kind = VALUE_VAR, .var = var};
+  } else {
+    value = tr->stack[idx - tr->depth];
+    if (value.kind == VALUE_REG) {
+      int reg = alloc_register(tr);
+      if (reg < 0) {
+        return false;
+      }
+      emit_load_value(tr, reg, &tr->stack[idx - tr->depth]);
+      value.reg = reg;
+    }
+  }
+
+  if (!push_value(tr, value)) {
+    free_value(tr, &value);
+    return false;
+  }
+
+  vm->stack[vm->tos++] = obj;
+  return true;
+}
+
+/* OP_DEEPSET and OP_SET_GLOBAL. */
+static bool record_set(TraceRecorder *tr, bool global, uint32_t idx) {
+  VM *vm = tr->vm;
+  Object obj = vm->stack[vm->tos - 1];
+  Object *slot = global ? &vm->globals[idx] : &vm->stack[tr->frame + idx];
+
+  if (!IS_NUM(obj) || !IS_NUM(*slot) || tr->count < 1) {
+    return false;
+  }
+
+  TraceValue value = tr->stack[tr->count - 1];
+
+  if (global || idx < tr->depth) {
+    int var = find_var(tr, global, idx);
+    if (var < 0) {
+      return false;
+    }
+    int reg = tr->vars[var].reg;
+
+    /* The reads of the variable that are still on the stack must keep
+     * seeing the old value. */
+    for (size_t i = 0; i < tr->count - 1; i++) {
+      if (tr->stack[i].kind == VALUE_VAR && tr->stack[i].var == var) {
+        int copy = alloc_register(tr);
+        if (copy < 0) {
+          return false;
+        }
+        emit_load_value(tr, copy, &tr->stack[i]);
+        tr->stack[i] = (TraceValue){.kind = VALUE_REG, .reg = copy};
+      }
+    }
+
+    emit_load_value(tr, reg, &value);
+    free_value(tr, &value);
+  } else {
+    size_t position = idx - tr->depth;
+    if (position >= tr->count - 1) {
+      return false;
+    }
+    free_value(tr, &tr->stack[position]);
+    tr->stack[position] = value;
+  }
+  tr->count--;
+
+  *slot = obj;
+  vm->tos--;
+  return true;
+}
+
+/* OP_ADD, OP_SUB, OP_MUL and OP_DIV. */
+static bool record_arithmetic(TraceRecorder *tr, uint8_t opcode) {
+  VM *vm = tr->vm;
+  Object a = vm->stack[vm->tos - 2];
+  Object b = vm->stack[vm->tos - 1];
+
+  if (!IS_NUM(a) || !IS_NUM(b) || tr->count < 2) {
+    return false;
+  }
+
+  TraceValue *left = &tr->stack[tr->count - 2];
+  TraceValue *right = &tr->stack[tr->count - 1];
+
+  double result;
+  uint8_t op;
+  switch (opcode) {
+  case OP_ADD:
+    result = AS_NUM(a) + AS_NUM(b);
+    op = 0x58;
+    break;
+  case OP_SUB:
+    result = AS_NUM(a) - AS_NUM(b);
+    op = 0x5c;
+    break;
+  case OP_MUL:
+    result = AS_NUM(a) * AS_NUM(b);
+    op = 0x59;
+    break;
+  default:
+    result = AS_NUM(a) / AS_NUM(b);
+    op = 0x5e;
+    break;
+  }
+
+  if (left->kind == VALUE_CONST && right->kind == VALUE_CONST) {
+    /* The operands were the same while recording, so is the result. */
+    left->num = result;
+  } else {
+    int dst = left->kind == VALUE_REG ? left->reg : alloc_register(tr);
+    if (dst < 0) {
+      return false;
+    }
+    emit_load_value(tr, dst, left);
+    int src = value_register(tr, right, 1);
+    emit_sse(&tr->jc, 0xf2, op, dst, src);
+    free_value(tr, right);
+    *left = (TraceValue){.kind = VALUE_REG, .reg = dst};
+  }
+  tr->count--;
+
+  vm->stack[vm->tos - 2] = NUM_VAL(result);
+  vm->tos--;
+  return true;
+}
+
+/* OP_NEG. */
+static bool record_neg(TraceRecorder *tr) {
+  VM *vm = tr->vm;
+  Object a = vm->stack[vm->tos - 1];
+
+  if (!IS_NUM(a) || tr->count < 1) {
+    return false;
+  }
+
+  TraceValue *value = &tr->stack[tr->count - 1];
+
+  if (value->kind == VALUE_CONST) {
+    value->num = -value->num;
+  } else {
+    int dst = value->kind == VALUE_REG ? value->reg : alloc_register(tr);
+    if (dst < 0) {
+      return false;
+    }
+    emit_load_value(tr, dst, value);
+    emit_load_num(&tr->jc, 1, -0.0);
+    emit_sse(&tr->jc, 0x66, 0x57, dst, 1); /* xorpd */
+    *value = (TraceValue){.kind = VALUE_REG, .reg = dst};
+  }
+
+  vm->stack[vm->tos - 1] = NUM_VAL(-AS_NUM(a));
+  return true;
+}
+
+/* OP_LT, OP_GT and OP_EQ, which must be followed by an OP_JZ or an
+ * OP_JNZ (with any number of OP_NOTs in between). The comparison and
+ * the jump are recorded together, as a guard that the comparison co-
+ * mes out the same as it did while recording. */
+static bool record_comparison(TraceRecorder *tr, size_t *offset) {
+  VM *vm = tr->vm;
+  uint8_t *data = tr->jc.code->code.data;
+  size_t count = tr->jc.code->code.count;
+  uint8_t opcode = unfused_opcode(data[*offset]);
+  Object a = vm->stack[vm->tos - 2];
+  Object b = vm->stack[vm->tos - 1];
+
+  if (!IS_NUM(a) || !IS_NUM(b) || tr->count < 2) {
+    return false;
+  }
+
+  size_t jz = *offset + 1;
+  bool negated = false;
+  while (jz < count && unfused_opcode(data[jz]) == OP_NOT) {
+    negated = !negated;
+    jz++;
+  }
+  if (jz >= count ||
+      (unfused_opcode(data[jz]) != OP_JZ && data[jz] != OP_JNZ)) {
+    return false;
+  }
+  if (data[jz] == OP_JNZ) {
+    negated = !negated;
+  }
+
+  bool result;
+  switch (opcode) {
+  case OP_LT:
+    result = AS_NUM(a) < AS_NUM(b);
+    break;
+  case OP_GT:
+    result = AS_NUM(a) > AS_NUM(b);
+    break;
+  default:
+    result = AS_NUM(a) == AS_NUM(b);
+    break;
+  }
+
+  /* OP_JZ jumps if the (maybe negated) result is false, and OP_JNZ is
+   * counted as one more negation. */
+  size_t target = jump_target(data, jz);
+  size_t after = jz + instruction_length(tr->jc.code, jz);
+  size_t next = result != negated ? after : target;
+  size_t other = result != negated ? target : after;
+
+  TraceValue left = tr->stack[tr->count - 2];
+  TraceValue right = tr->stack[tr->count - 1];
+  tr->count -= 2;
+
+  if (left.kind != VALUE_CONST || right.kind != VALUE_CONST) {
+    JitCompiler *jc = &tr->jc;
+
+    /* LT is done as 'b > a', because 'above' is false for NaN. */
+    TraceValue *first = opcode == OP_LT ? &right : &left;
+    TraceValue *second = opcode == OP_LT ? &left : &right;
+    emit_load_value(tr, 0, first);
+    int reg = value_register(tr, second, 1);
+    emit_sse(jc, 0x66, opcode == OP_EQ ? 0x2e : 0x2f, 0, reg);
+    free_value(tr, &left);
+    free_value(tr, &right);
+
+    /* Exit if the comparison does not come out as recorded. An unor-
+     * dered comparison (NaN) sets ZF and PF. */
+    size_t jumps[2];
+    size_t jump_count = 0;
+    if (opcode != OP_EQ) {
+      jumps[jump_count++] = emit_jcc(jc, result ? CC_BE : CC_A);
+    } else if (result) {
+      jumps[jump_count++] = emit_jcc(jc, CC_NE);
+      jumps[jump_count++] = emit_jcc(jc, CC_P);
+    } else {
+      EMIT(0x7a, 0x06); /* jp over the je */
+      jumps[jump_count++] = emit_jcc(jc, CC_E);
+    }
+    add_exit(tr, jumps, jump_count, other);
+  }
+
+  vm->tos -= 2;
+  *offset = next;
+  return true;
+}
+
+/* Run the instruction at 'offset' and record it. Returns false (with-
+ * out running it) if it can't be recorded. */
+static bool record_instruction(TraceRecorder *tr, size_t *offset) {
+  VM *vm = tr->vm;
+  Bytecode *code = tr->jc.code;
+  uint8_t *p = &code->code.data[*offset];
+  size_t next = *offset + instruction_length(code, *offset);
+
+  /* If the iteration gets to the same instruction twice, it must be
+   * in a nested loop, which gets a trace of its own. */
+  if (tr->visited[*offset]) {
+    return false;
+  }
+  tr->visited[*offset] = true;
+
+  switch (unfused_opcode(*p)) {
+  case OP_CONST: {
+    double num = code->cp.data[operand_at(p, 0)];
+    if (!push_value(tr, (TraceValue){.kind = VALUE_CONST, .num = num})) {
+      return false;
+    }
+    vm->stack[vm->tos++] = NUM_VAL(num);
+    break;
+  }
+  case OP_TRUE:
+    if (!push_value(tr, (TraceValue){.kind = VALUE_BOOL, .truth = true})) {
+      return false;
+    }
+    vm->stack[vm->tos++] = BOOL_VAL(true);
+    break;
+  case OP_NOT:
+    if (tr->count < 1 || tr->stack[tr->count - 1].kind != VALUE_BOOL) {
+      return false;
+    }
+    tr->stack[tr->count - 1].truth = !tr->stack[tr->count - 1].truth;
+    vm->stack[vm->tos - 1] = BOOL_VAL(AS_BOOL(vm->stack[vm->tos - 1]) ^ 1);
+    break;
+  case OP_DEEPGET:
+    if (!record_get(tr, false, operand_at(p, 0))) {
+      return false;
+    }
+    break;
+  case OP_GET_GLOBAL:
+    if (!record_get(tr, true, operand_at(p, 0))) {
+      return false;
+    }
+    break;
+  case OP_DEEPSET:
+    if (!record_set(tr, false, operand_at(p, 0))) {
+      return false;
+    }
+    break;
+  case OP_SET_GLOBAL:
+    if (!record_set(tr, true, operand_at(p, 0))) {
+      return false;
+    }
+    break;
+  case OP_ADD:
+  case OP_SUB:
+  case OP_MUL:
+  case OP_DIV:
+    if (!record_arithmetic(tr, unfused_opcode(*p))) {
+      return false;
+    }
+    break;
+  case OP_NEG:
+    if (!record_neg(tr)) {
+      return false;
+    }
+    break;
+  case OP_LT:
+  case OP_GT:
+  case OP_EQ:
+    return record_comparison(tr, offset);
+  case OP_JZ:
+  case OP_JNZ: {
+    /* Comparisons are recorded along with their jumps, so the cond-
+     * ition here is a constant, and there is nothing to guard. */
+    if (tr->count < 1 || tr->stack[tr->count - 1].kind != VALUE_BOOL) {
+      return false;
+    }
+    bool truth = tr->stack[--tr->count].truth;
+    vm->tos--;
+    if (truth == (*p == OP_JNZ)) {
+      next = jump_target(code->code.data, *offset);
+    }
+    break;
+  }
+  case OP_JMP:
+    next = jump_target(code->code.data, *offset);
+    break;
+  case OP_POP: {
+    Object obj = vm->stack[vm->tos - 1];
+    if ((!IS_NUM(obj) && !IS_BOOL(obj)) || tr->count < 1) {
+      return false;
+    }
+    free_value(tr, &tr->stack[--tr->count]);
+    vm->tos--;
+    break;
+  }
+  default:
+    return false;
+  }
+
+  *offset = next;
+  return true;
+}
+
+/* Put the entry code in front of the recorded loop, and install the
+ * trace. On entry, every variable is checked to be a number, and is
+ * loaded into its register. If any of them is not, the trace is left
+ * at once, with nothing changed. */
+static JitTrace install_trace(TraceRecorder *tr, size_t header) {
+  JitCompiler entry = {.jit = tr->jc.jit, .code = tr->jc.code};
+  JitCompiler *jc = &entry;
+
+  EMIT(0x53, 0x41, 0x56, 0x41, 0x57); /* push rbx; push r14; push r15 */
+  EMIT(0x48, 0x89, 0xfb);             /* mov rbx, rdi */
+  EMIT(0x49, 0x89, 0xf6);             /* mov r14, rsi */
+  EMIT(0x49, 0x89, 0xd7);             /* mov r15, rdx */
+
+  DynArray_uint32_t guards = {0};
+  for (size_t i = 0; i < tr->var_count; i++) {
+    TraceVar *var = &tr->vars[i];
+    uint32_t slot = var->idx * sizeof(Object);
+    emit_gpr_mem(jc, false, 0x83, 7, var_base(var), slot + TYPE); /* cmp */
+    EMIT(OBJ_NUMBER);
+    dynarray_insert(&guards, emit_jcc(jc, CC_NE));
+    emit_sse_mem(jc, 0xf2, 0x10, var->reg, var_base(var),
+                 slot + VALUE); /* movsd */
+  }
+
+  EMIT(0xeb, 0x00); /* jmp over the exit */
+  size_t skip = jc->buf.count;
+  for (size_t i = 0; i < guards.count; i++) {
+    patch_rel32(jc, guards.data[i], jc->buf.count);
+  }
+  emit_leave(jc, tr->depth, header);
+  jc->buf.data[skip - 1] = jc->buf.count - skip;
+
+  emit_bytes(jc, tr->jc.buf.data, tr->jc.buf.count);
+
+  uint8_t *addr = install_code(jc->jit, &jc->buf);
+  if (addr) {
+    char name[64];
+    snprintf(name, sizeof(name), "trace@%zu", header);
+    write_perf_map(jc->jit, addr, jc->buf.count, name);
+  }
+
+  dynarray_free(&guards);
+  dynarray_free(&entry.buf);
+  return (JitTrace)addr;
+}
+
+/* Record (and compile) a trace of the loop at 'header', which the vm
+ * has just jumped back to. Returns the offset the interpreter should
+ * continue from. */
+static size_t record_trace(Jit *jit, VM *vm, Bytecode *code, size_t header,
+                           size_t frame) {
+  TraceRecorder *tr = calloc(1, sizeof(TraceRecorder));
+  tr->jc = (JitCompiler){.jit = jit, .code = code};
+  tr->vm = vm;
+  tr->frame = frame;
+  tr->depth = vm->tos - frame;
+  tr->visited = calloc(code->code.count, sizeof(bool));
+
+  size_t offset = header;
+  bool closed = false;
+  for (size_t i = 0; i < TRACE_MAX_LENGTH; i++) {
+    if (!record_instruction(tr, &offset)) {
+      break;
+    }
+    if (offset == header) {
+      closed = true;
+      break;
+    }
+  }
+
+  if (closed && tr->count == 0) {
+    JitCompiler *jc = &tr->jc;
+    EMIT(0xe9); /* jmp to the top of the loop */
+    size_t at = jc->buf.count;
+    emit_uint32(jc, 0);
+    patch_rel32(jc, at, 0);
+    for (size_t i = 0; i < tr->exits.count; i++) {
+      emit_exit(tr, &tr->exits.data[i]);
+    }
+    jit->traces[header] = install_trace(tr, header);
+  }
+
+  for (size_t i = 0; i < tr->exits.count; i++) {
+    free(tr->exits.data[i].stack);
+  }
+  dynarray_free(&tr->exits);
+  dynarray_free(&tr->jc.buf);
+  free(tr->visited);
+  free(tr);
+  return offset;
+}
+
+size_t jit_loop(Jit *jit, VM *vm, Bytecode *code, size_t header,
+                size_t frame) {
+  JitTrace trace = jit->traces[header];
+
+  if (!trace) {
+    if (++jit->loop_counts[header] != TRACE_THRESHOLD) {
+      return header;
+    }
+    return record_trace(jit, vm, code, header, frame);
+  }
+
+  uint32_t depth;
+  size_t resume = trace(&vm->stack[frame], vm->globals, &depth);
+  vm->tos = frame + depth;
+  return resume;
+}
+
+void init_jit(Jit *jit, Bytecode *code) {
+  jit->functions = calloc(code->code.count + 1, sizeof(Function *));
+  for (size_t i = 0; i < code->functions.count; i++) {
+    Function *function = &code->functions.data[i];
+    jit->functions[function->location] = function;
+  }
+  jit->loop_counts = calloc(code->code.count + 1, sizeof(size_t));
+  jit->traces = calloc(code->code.count + 1, sizeof(JitTrace));
+  jit->regions = (DynArray_JitRegion){0};
+  jit->perf_map = NULL;
+}
+
+void free_jit(Jit *jit) {
+  for (size_t i = 0; i < jit->regions.count; i++) {
+    munmap(jit->regions.data[i].addr, jit->regions.data[i].size);
+  }
+  dynarray_free(&jit->regions);
+  free(jit->functions);
+  free(jit->loop_counts);
+  free(jit->traces);
+  if (jit->perf_map) {
+    fclose(jit->perf_map);
+  }
+}
+
+/* Compile 'function' and the functions it calls. Returns false if any
+ * of them can't be compiled, in which case they are all left to the
+ * interpreter. */
+bool jit_compile(Jit *jit, Bytecode *code, Function *function) {
+  JitCompiler jc = {.jit = jit, .code = code};
+
+  jc.depths = malloc(sizeof(int) * code->code.count);
+  for (size_t i = 0; i < code->code.count; i++) {
+    jc.depths[i] = UNREACHABLE;
+  }
+  jc.native = malloc(sizeof(size_t) * code->code.count);
+
+  /* The batch grows as the callees are found. */
+  dynarray_insert(&jc.batch, function);
+
+  bool ok = true;
+  for (size_t i = 0; ok && i < jc.batch.count; i++) {
+    uint32_t end;
+    ok = analyze(&jc, jc.batch.data[i], &end);
+    dynarray_insert(&jc.ends, end);
+  }
+
+  if (ok) {
+    size_t *starts = malloc(sizeof(size_t) * jc.batch.count);
+
+    for (size_t i = 0; i < jc.batch.count; i++) {
+      starts[i] = jc.buf.count;
+      emit_function(&jc, jc.batch.data[i], jc.ends.data[i]);
+    }
+    for (size_t i = 0; i < jc.jumps.count; i++) {
+      patch_rel32(&jc, jc.jumps.data[i].at,
+                  jc.native[jc.jumps.data[i].target]);
+    }
+    for (size_t i = 0; i < jc.calls.count; i++) {
+      patch_rel32(&jc, jc.calls.data[i].at, starts[jc.calls.data[i].target]);
+    }
+
+    ok = install(&jc, starts);
+    free(starts);
+  }
+
+  free(jc.depths);
+  free(jc.native);
+  dynarray_free(&jc.batch);
+  dynarray_free(&jc.ends);
+  dynarray_free(&jc.buf);
+  dynarray_free(&jc.jumps);
+  dynarray_free(&jc.calls);
+
+  return ok;
+}
+
+#endif
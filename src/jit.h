@@ -0,0 +1,56 @@
+#ifndef venom_jit_h
+#define venom_jit_h
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "compiler.h"
+#include "dynarray.h"
+#include "object.h"
+
+/* The number of calls after which a function is compiled. */
+#ifndef JIT_THRESHOLD
+#define JIT_THRESHOLD 1000
+#endif
+
+/* A compiled function takes a pointer to the base of its frame in the
+ * vm's stack (where the caller has pushed the arguments), and leaves
+ * the return value at the base when it returns, just like OP_RET. */
+typedef void (*JitFunction)(Object *frame);
+
+/* The number of times a loop header is jumped back to before the loop
+ * is traced. */
+#ifndef TRACE_THRESHOLD
+#define TRACE_THRESHOLD 100
+#endif
+
+/* A trace takes the frame of the function the loop is in, and the vm's
+ * globals. It returns the offset that the interpreter continues from,
+ * and stores the depth of the stack (relative to the frame) in 'depth'. */
+typedef uint32_t (*JitTrace)(Object *frame, Object *globals, uint32_t *depth);
+
+typedef struct {
+  void *addr;
+  size_t size;
+} JitRegion;
+
+typedef DynArray(JitRegion) DynArray_JitRegion;
+
+typedef struct {
+  Function **functions; /* indexed by location */
+  size_t *loop_counts;  /* indexed by the offset of the loop header */
+  JitTrace *traces;     /* indexed by the offset of the loop header */
+  DynArray_JitRegion regions;
+  FILE *perf_map;
+} Jit;
+
+void init_jit(Jit *jit, Bytecode *code);
+void free_jit(Jit *jit);
+bool jit_compile(Jit *jit, Bytecode *code, Function *function);
+
+struct VM;
+size_t jit_loop(Jit *jit, struct VM *vm, Bytecode *code, size_t header,
+                size_t frame);
+
+#endif
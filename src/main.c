@@ -1,14 +1,26 @@
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include "cgen.h"
 #include "compiler.h"
 #include "dynarray.h"
+#include "fold.h"
+#include "optimizer.h"
 #include "parser.h"
+#include "register.h"
 #include "tokenizer.h"
 #include "util.h"
 #include "vm.h"
 
-void run_file(char *file) {
+typedef enum {
+  MODE_STACK,
+  MODE_REGISTER,
+  MODE_EMIT_C,
+} Mode;
+
+void run_file(char *file, Mode mode) {
   char *source = read_file(file);
 
   Tokenizer tokenizer;
@@ -34,16 +46,39 @@ void run_file(char *file) {
   table_insert(compiler.compiled_modules, file, compiler.current_mod);
 
   for (size_t i = 0; i < stmts.count; i++) {
+    fold_constants(&stmts.data[i]);
     compile(&compiler, &chunk, stmts.data[i]);
   }
   dynarray_insert(&chunk.code, OP_HLT);
+  relax_jumps(&compiler, &chunk);
 
   free_compiler(&compiler);
 
-  VM vm;
-  init_vm(&vm);
-  run(&vm, &chunk);
-  free_vm(&vm);
+  if (mode == MODE_EMIT_C) {
+    /* Like the register code, the C is emitted from the bytecode as
+     * emitted by the compiler, before any superinstructions are fused. */
+    if (!emit_c(&chunk, stdout)) {
+      fprintf(stderr, "venom: '%s' cannot be compiled to C\n", file);
+      exit(1);
+    }
+  } else {
+    VM vm;
+    init_vm(&vm);
+
+    /* The register code is translated from the bytecode as emitted by
+     * the compiler, before any superinstructions are fused. If it can't
+     * be translated, the program runs on the stack engine instead. */
+    RegisterCode rcode;
+    if (mode == MODE_REGISTER && translate_to_registers(&chunk, &rcode)) {
+      run_register(&vm, &chunk, &rcode);
+      free_register_code(&rcode);
+    } else {
+      optimize(&chunk);
+      run(&vm, &chunk);
+    }
+
+    free_vm(&vm);
+  }
 
   for (size_t i = 0; i < stmts.count; i++) {
     free_stmt(stmts.data[i]);
@@ -55,7 +90,11 @@ void run_file(char *file) {
 
 int main(int argc, char *argv[]) {
   if (argc == 2)
-    run_file(argv[1]);
+    run_file(argv[1], MODE_STACK);
+  else if (argc == 3 && strcmp(argv[1], "--register") == 0)
+    run_file(argv[2], MODE_REGISTER);
+  else if (argc == 3 && strcmp(argv[1], "--emit-c") == 0)
+    run_file(argv[2], MODE_EMIT_C);
   else
-    printf("Usage: venom [file]\n");
+    printf("Usage: venom [--register | --emit-c] [file]\n");
 }
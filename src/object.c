@@ -12,7 +12,7 @@ void print_object(Object *object) {
     printf("null");
   } else if (IS_STRING(*object)) {
     String *string = AS_STRING(*object);
-    printf("%s", string->value);
+    fwrite(string_chars(string), 1, string->length, stdout);
   } else if (IS_STRUCT(*object)) {
     Struct *structobj = AS_STRUCT(*object);
     printf("%s", structobj->name);
@@ -39,20 +39,227 @@ void print_object(Object *object) {
   }
 }
 
-void free_table_object(const Table_Object *table) {
-  for (size_t i = 0; i < TABLE_MAX; i++) {
-    if (table->indexes[i] != NULL) {
-      Bucket *bucket = table->indexes[i];
-      Object obj = table->items[bucket->value];
-      if (IS_STRUCT(obj) || IS_STRING(obj) || IS_ARRAY(obj)) {
-        objdecref(&obj);
+/* The intern table is an open-addressing hash set of Strings. It is
+ * weak: it does not hold a reference to the strings in it. Instead, a
+ * string that is freed takes itself out of the table (see dealloc()),
+ * leaving a tombstone behind until the table is rebuilt. There is one
+ * table for the whole process, because dealloc() has no vm at hand. */
+#define TOMBSTONE ((String *)1)
+
+static struct {
+  String **entries;
+  size_t capacity; /* always a power of two */
+  size_t count;    /* of the strings in the table */
+  size_t used;     /* of the entries that are not NULL */
+} interned;
+
+static void rebuild_intern_table(void) {
+  size_t capacity = 64;
+  while (capacity < (interned.count + 1) * 2) {
+    capacity *= 2;
+  }
+
+  String **entries = calloc(capacity, sizeof(String *));
+  for (size_t i = 0; i < interned.capacity; i++) {
+    String *s = interned.entries[i];
+    if (s && s != TOMBSTONE) {
+      size_t j = s->hash & (capacity - 1);
+      while (entries[j]) {
+        j = (j + 1) & (capacity - 1);
       }
-      list_free(bucket);
+      entries[j] = s;
+    }
+  }
+
+  free(interned.entries);
+  interned.entries = entries;
+  interned.capacity = capacity;
+  interned.used = interned.count;
+}
+
+/* Return the interned String with the same characters as 's'. If there
+ * is one already, 's' is freed, and the one from the table is returned
+ * with its refcount incremented, so the reference the caller held to
+ * 's' is handed over to it. Otherwise, 's' itself goes into the table.
+ * The caller must be the only one with a reference to 's'. */
+String *intern(String *s) {
+  if ((interned.used + 1) * 4 > interned.capacity * 3) {
+    rebuild_intern_table();
+  }
+
+  uint32_t h = string_hash(s);
+  size_t mask = interned.capacity - 1;
+  String **slot = NULL;
+  size_t i = h & mask;
+  for (; interned.entries[i]; i = (i + 1) & mask) {
+    String *entry = interned.entries[i];
+    if (entry == TOMBSTONE) {
+      if (!slot) {
+        slot = &interned.entries[i];
+      }
+    } else if (entry->hash == h && entry->length == s->length &&
+               memcmp(entry->value, string_chars(s), s->length) == 0) {
+      entry->refcount++;
+      free(s);
+      return entry;
+    }
+  }
+
+  if (!slot) {
+    slot = &interned.entries[i];
+    interned.used++;
+  }
+  *slot = s;
+  s->interned = true;
+  interned.count++;
+  return s;
+}
+
+static void unintern(String *s) {
+  size_t mask = interned.capacity - 1;
+  size_t i = s->hash & mask;
+  while (interned.entries[i] != s) {
+    i = (i + 1) & mask;
+  }
+  interned.entries[i] = TOMBSTONE;
+  interned.count--;
+}
+
+/* Empty the intern table. The strings that are still alive are taken
+ * out of it, so they can be freed later on as any other string. */
+void free_intern_table(void) {
+  for (size_t i = 0; i < interned.capacity; i++) {
+    String *s = interned.entries[i];
+    if (s && s != TOMBSTONE) {
+      s->interned = false;
+    }
+  }
+  free(interned.entries);
+  interned.entries = NULL;
+  interned.capacity = interned.count = interned.used = 0;
+}
+
+/* Free a refcounted object whose refcount dropped to zero, after dropping
+ * the references it holds to other objects. */
+void dealloc(Object *obj) {
+  if (IS_STRUCT(*obj)) {
+    Struct *structobj = AS_STRUCT(*obj);
+    for (size_t i = 0; i < structobj->propcount; i++) {
+      objdecref(&structobj->properties[i]);
+    }
+    free(structobj->properties);
+    free(structobj);
+  } else if (IS_STRING(*obj)) {
+    String *string = AS_STRING(*obj);
+    if (string->interned) {
+      unintern(string);
     }
+    if (string->buffer && --string->buffer->refcount == 0) {
+      free(string->buffer->chars);
+      free(string->buffer);
+    }
+    free(string);
+  } else if (IS_ARRAY(*obj)) {
+    Array *array = AS_ARRAY(*obj);
+    for (size_t i = 0; i < array->elements.count; i++) {
+      objdecref(&array->elements.data[i]);
+    }
+    dynarray_free(&array->elements);
+    free(array);
+  }
+}
+
+/* Allocate a String of 'length' characters, with a refcount of 1. The
+ * characters are left for the caller to fill in. */
+String *alloc_string(size_t length) {
+  String *s = malloc(sizeof(String) + length + 1);
+  s->refcount = 1;
+  s->hash = 0;
+  s->length = length;
+  s->interned = false;
+  s->buffer = NULL;
+  s->value[length] = '\0';
+  return s;
+}
+
+String *new_string(const char *chars, size_t length) {
+  String *s = alloc_string(length);
+  memcpy(s->value, chars, length);
+  return s;
+}
+
+/* Write the characters of 'b' at the end of 'buffer', growing it to
+ * twice the new length if they do not fit. */
+static void append_to_buffer(StringBuffer *buffer, String *b) {
+  size_t length = buffer->length + b->length;
+
+  if (length > buffer->capacity) {
+    buffer->capacity = length * 2;
+    buffer->chars = realloc(buffer->chars, buffer->capacity);
+  }
+
+  /* 'b' may be in the same buffer, so its characters are only looked
+   * up once the buffer has been grown. */
+  memcpy(buffer->chars + buffer->length, string_chars(b), b->length);
+  buffer->length = length;
+}
+
+/* Concatenate the strings 'a' and 'b' into a new String. A short res-
+ * ult is interned. A longer one goes into a StringBuffer: the buffer
+ * 'a' is in, if 'a' sees all of it, and a new one otherwise, with room
+ * for as much again, so that a string that keeps having pieces appen-
+ * ded to it is only copied a logarithmic number of times. */
+String *concatenate_strings(String *a, String *b) {
+  size_t length = a->length + b->length;
+
+  if (length <= INTERN_MAX_LENGTH) {
+    String *result = alloc_string(length);
+    memcpy(result->value, string_chars(a), a->length);
+    memcpy(result->value + a->length, string_chars(b), b->length);
+    return intern(result);
+  }
+
+  StringBuffer *buffer = a->buffer;
+  if (buffer && buffer->length == a->length) {
+    buffer->refcount++;
+  } else {
+    buffer = malloc(sizeof(StringBuffer));
+    buffer->refcount = 1;
+    buffer->length = a->length;
+    buffer->capacity = length * 2;
+    buffer->chars = malloc(buffer->capacity);
+    memcpy(buffer->chars, string_chars(a), a->length);
+  }
+
+  append_to_buffer(buffer, b);
+
+  String *result = malloc(sizeof(String));
+  result->refcount = 1;
+  result->hash = 0;
+  result->length = length;
+  result->interned = false;
+  result->buffer = buffer;
+  return result;
+}
+
+/* Append 'b' to 'a' itself, instead of building a new String, if 'a'
+ * sees the whole of its buffer. The caller must make sure that nothing
+ * else can see 'a', i.e. that it holds the only reference to it. Ret-
+ * urns whether 'b' was appended. */
+bool append_in_place(String *a, String *b) {
+  StringBuffer *buffer = a->buffer;
+  if (!buffer || buffer->length != a->length) {
+    return false;
   }
+  append_to_buffer(buffer, b);
+  a->length = buffer->length;
+  a->hash = 0;
+  return true;
 }
 
-extern inline void dealloc(Object *obj);
+extern inline const char *string_chars(String *s);
+extern inline uint32_t string_hash(String *s);
+extern inline bool string_equal(String *a, String *b);
 extern inline void objdecref(Object *obj);
 extern inline void objincref(Object *obj);
 extern inline const char *get_object_type(Object *object);
@@ -14,6 +14,7 @@ typedef enum {
   OBJ_STRUCT,
   OBJ_STRING,
   OBJ_ARRAY,
+  OBJ_IMMORTAL_STRING, /* a string literal, see IMMORTAL_STRING_VAL */
   OBJ_PTR,
   OBJ_NUMBER,
   OBJ_BOOLEAN,
@@ -85,8 +86,13 @@ typedef enum {
  * Encoding null, false, and true is done by setting QNAN and the approp-
  * riate tag.
  *
- * As for the other objects, we'll set the SIGN_BIT, QNAN, tag them acco-
- * rdingly, and use a pointer to the object. */
+ * As for the other objects, we'll set QNAN, tag them accordingly, and use
+ * a pointer to the object. The SIGN_BIT is set for the refcounted objects
+ * (structs, strings and arrays) only, and not for pointers, which do not
+ * own what they point to. This way, whether an object needs refcounting
+ * is a single mask and compare, and since the refcount is the first mem-
+ * ber of every refcounted object, it can be reached without looking at
+ * the tag at all (see REFCOUNT). */
 
 #define SIGN_BIT ((uint64_t)0x8000000000000000)
 #define QNAN ((uint64_t)0x7ffc000000000000)
@@ -120,24 +126,20 @@ typedef DynArray(Object) DynArray_Object;
  * If the result is not QNAN, it means it's a number. */
 #define IS_NUM(value) (((value) & (QNAN)) != QNAN)
 
-/* To check whether a value is some other object, we bitwise-and it with
- * (SIGN_BIT | QNAN). If the result is (SIGN_BIT | QNAN), it means those
- * bits were set, and remember, the patterns with those bits set mean we
- * have some object other than numbers, booleans, and nulls. */
-#define IS_OBJ(value) (((value) & (SIGN_BIT | QNAN)) == (SIGN_BIT | QNAN))
-
 #define STRUCT_PATTERN (SIGN_BIT | QNAN | TAG_STRUCT)
 #define STRING_PATTERN (SIGN_BIT | QNAN | TAG_STRING)
-#define PTR_PATTERN (SIGN_BIT | QNAN | TAG_PTR)
+#define PTR_PATTERN (QNAN | TAG_PTR)
 #define ARRAY_PATTERN (SIGN_BIT | QNAN | TAG_ARRAY)
 
 /* To check whether a value is a struct, we check if it's an object and
  * whether it is tagged as a Struct. */
 #define IS_STRUCT(value) (((value) & (SIGN_BIT | QNAN | 0x7)) == STRUCT_PATTERN)
 
-/* To check whether a value is a struct, we check if it's an object and
- * whether it is tagged as a String. */
-#define IS_STRING(value) (((value) & (SIGN_BIT | QNAN | 0x7)) == STRING_PATTERN)
+/* To check whether a value is a string, we check if it's an object and
+ * whether it is tagged as a String. The SIGN_BIT is left out of the mask,
+ * so that the immortal strings (see IMMORTAL_STRING_VAL) are strings too. */
+#define IS_STRING(value)                                                       \
+  (((value) & (QNAN | 0x7)) == (STRING_PATTERN & ~SIGN_BIT))
 
 /* To check whether a value is a struct, we check if it's an object and
  * whether it is tagged as a pointer. */
@@ -147,6 +149,13 @@ typedef DynArray(Object) DynArray_Object;
  * whether it is tagged as an array. */
 #define IS_ARRAY(value) (((value) & (SIGN_BIT | QNAN | 0x7)) == ARRAY_PATTERN)
 
+/* Whether the value has a refcount, i.e. it is a struct, a string or
+ * an array. We bitwise-and it with (SIGN_BIT | QNAN), and if the result
+ * is (SIGN_BIT | QNAN), it means those bits were set, and remember, only
+ * the refcounted objects have both of them set. */
+#define IS_REFCOUNTED(value)                                                   \
+  (((value) & (SIGN_BIT | QNAN)) == (SIGN_BIT | QNAN))
+
 /* To convert a value to a boolean, we compare it to TRUE_VAL because
  * if we had a 'false', (false == true) will be false, and we got our
  * value. However, if we had a true, (true == true) will be true, and
@@ -155,38 +164,21 @@ typedef DynArray(Object) DynArray_Object;
 
 #define AS_NUM(value) object2num(value)
 
-/* To convert a value to an Object pointer, we need to clear the SIGN_BIT,
- * QNAN, and the tag. Finally, we cast the result to Object pointer. */
-#define AS_OBJ(value)                                                          \
-  ((Object *)(uintptr_t)(((value) & ~(SIGN_BIT | QNAN | 0x7))))
-
-/* To convert a value to a Struct pointer, we need to clear the SIGN_BIT,
- * QNAN, and the tag. Finaly, we cast the result to Struct pointer. */
-#define AS_STRUCT(object)                                                      \
-  ((IS_STRUCT(object))                                                         \
-       ? (Struct *)((uintptr_t)((object) & ~(SIGN_BIT | QNAN | 0x7)))          \
-       : NULL)
-
-/* To convert a value to a String pointer, we need to clear the SIGN_BIT,
- * QNAN, and the tag. Finally, we cast the result to String pointer. */
-#define AS_STRING(object)                                                      \
-  ((IS_STRING(object))                                                         \
-       ? (String *)((uintptr_t)((object) & ~(SIGN_BIT | QNAN | 0x7)))          \
-       : NULL)
-
-/* To convert a value to a pointer Object, we need to clear the SIGN_BIT,
- * QNAN, and the tag. Finally, we cast the result to Object pointer. */
-#define AS_PTR(object)                                                         \
-  ((IS_PTR(object))                                                            \
-       ? (Object *)((uintptr_t)((object) & ~(SIGN_BIT | QNAN | 0x7)))          \
-       : NULL)
-
-/* To convert a value to an array Object, we need to clear the SIGN_BIT,
- * QNAN, and the tag. Finally, we cast the result to Array pointer. */
-#define AS_ARRAY(object)                                                       \
-  ((IS_ARRAY(object))                                                          \
-       ? (Array *)((uintptr_t)((object) & ~(SIGN_BIT | QNAN | 0x7)))           \
-       : NULL)
+/* To convert a value to a pointer, we need to clear the SIGN_BIT, QNAN,
+ * and the tag. Like with the other object layout, the accessors below do
+ * not check the type of the value (the callers that can't be sure of it
+ * check it with one of the IS_* macros first), so each of them is just
+ * a single bitwise-and. */
+#define AS_POINTER(value)                                                      \
+  ((uintptr_t)((value) & ~(SIGN_BIT | QNAN | 0x7)))
+
+#define AS_STRUCT(object) ((Struct *)AS_POINTER(object))
+#define AS_STRING(object) ((String *)AS_POINTER(object))
+#define AS_PTR(object) ((Object *)AS_POINTER(object))
+#define AS_ARRAY(object) ((Array *)AS_POINTER(object))
+
+/* The refcount of a refcounted object (see IS_REFCOUNTED). */
+#define REFCOUNT(object) ((int *)AS_POINTER(object))
 
 #define BOOL_VAL(b) ((b) ? TRUE_VAL : FALSE_VAL)
 
@@ -209,8 +201,14 @@ typedef DynArray(Object) DynArray_Object;
 #define STRING_VAL(obj)                                                        \
   (Object)(SIGN_BIT | QNAN | ((uint64_t)(uintptr_t)(obj)) | TAG_STRING)
 
-#define PTR_VAL(obj)                                                           \
-  (Object)(SIGN_BIT | QNAN | ((uint64_t)(uintptr_t)(obj)) | TAG_PTR)
+/* The string literals are built once, when the program is loaded, and
+ * live for as long as the vm does (see load_strings() in vm.c). They are
+ * tagged as strings, but without the SIGN_BIT, so the refcounting skips
+ * them altogether, and pushing one is just a copy. */
+#define IMMORTAL_STRING_VAL(obj)                                               \
+  (Object)(QNAN | ((uint64_t)(uintptr_t)(obj)) | TAG_STRING)
+
+#define PTR_VAL(obj) (Object)(QNAN | ((uint64_t)(uintptr_t)(obj)) | TAG_PTR)
 
 #define ARRAY_VAL(obj)                                                         \
   (Object)(SIGN_BIT | QNAN | ((uint64_t)(uintptr_t)(obj)) | TAG_ARRAY)
@@ -284,13 +282,17 @@ typedef struct Object {
 #define IS_NUM(object) ((object).type == OBJ_NUMBER)
 #define IS_PTR(object) ((object).type == OBJ_PTR)
 #define IS_NULL(object) ((object).type == OBJ_NULL)
-#define IS_STRING(object) ((object).type == OBJ_STRING)
+#define IS_STRING(object)                                                      \
+  ((object).type == OBJ_STRING || (object).type == OBJ_IMMORTAL_STRING)
 #define IS_STRUCT(object) ((object).type == OBJ_STRUCT)
 
 #define IS_FUNC(object) ((object).type == OBJ_FUNCTION)
 #define IS_STRUCT_BLUEPRINT(object) ((object).type == OBJ_STRUCT_BLUEPRINT)
 #define IS_ARRAY(object) ((object).type == OBJ_ARRAY)
 
+/* The refcounted types come first in ObjectType. */
+#define IS_REFCOUNTED(object) ((object).type <= OBJ_ARRAY)
+
 #define AS_NUM(object) ((object).as.dval)
 #define AS_BOOL(object) ((object).as.bval)
 #define AS_STRUCT(object) ((object).as.structobj)
@@ -299,11 +301,16 @@ typedef struct Object {
 #define AS_ARRAY(object) ((object).as.array)
 
 #define AS_FUNC(object) ((object).as.func)
+
+/* The refcount of a refcounted object (see IS_REFCOUNTED). */
+#define REFCOUNT(object) ((object).as.refcount)
 #define AS_STRUCT_BLUEPRINT(object) ((object).as.struct_blueprint)
 
 #define NUM_VAL(thing) ((Object){.type = OBJ_NUMBER, .as.dval = (thing)})
 #define BOOL_VAL(thing) ((Object){.type = OBJ_BOOLEAN, .as.bval = (thing)})
 #define STRING_VAL(thing) ((Object){.type = OBJ_STRING, .as.str = (thing)})
+#define IMMORTAL_STRING_VAL(thing)                                             \
+  ((Object){.type = OBJ_IMMORTAL_STRING, .as.str = (thing)})
 #define STRUCT_VAL(thing)                                                      \
   ((Object){.type = OBJ_STRUCT, .as.structobj = (thing)})
 #define PTR_VAL(thing) ((Object){.type = OBJ_PTR, .as.ptr = (thing)})
@@ -314,14 +321,85 @@ typedef struct Object {
 
 void print_object(Object *obj);
 
+/* The characters of the strings that '++' builds up a piece at a time.
+ * A buffer is shared by the strings that were built from one another,
+ * each of which sees a prefix of it. Appending to the string that sees
+ * all of it only writes past the end of what the others see, so it is
+ * done in place, and building a string with 's = s ++ x' takes linear
+ * time (see concatenate_strings()). */
+typedef struct StringBuffer {
+  int refcount;
+  size_t length; /* of the characters written so far */
+  size_t capacity;
+  char *chars;
+} StringBuffer;
+
+/* A String knows its length, so it may contain NUL bytes, and none of
+ * the string operations has to walk it to find its end. The characters
+ * are kept in the same allocation, right after the header, and they
+ * are followed by a NUL (which is not counted in the length), for the
+ * code that needs a C string. A string that '++' built, though, may
+ * instead be a prefix of a StringBuffer, which has no NUL after it. */
 typedef struct String {
   int refcount;
-  char *value;
+  uint32_t hash; /* of the characters, or 0 until string_hash() runs */
+  size_t length;
+  bool interned; /* whether it is in the intern table (see intern()) */
+  StringBuffer *buffer; /* the characters, or NULL if they are in 'value' */
+  char value[];
 } String;
 
+String *alloc_string(size_t length);
+String *new_string(const char *chars, size_t length);
+String *concatenate_strings(String *a, String *b);
+bool append_in_place(String *a, String *b);
+
+inline const char *string_chars(String *s) {
+  return s->buffer ? s->buffer->chars : s->value;
+}
+
+/* The literals are interned when the program is loaded, and the strings
+ * that '++' builds are interned as well, as long as they are no longer
+ * than this. Longer ones would have to be hashed in full every time, and
+ * they are unlikely to be compared against anything that is interned. */
+#define INTERN_MAX_LENGTH 32
+
+String *intern(String *s);
+void free_intern_table(void);
+
+/* The hash of the characters of 's', which is computed the first time
+ * it is asked for. A string whose hash comes out as 0 gets it computed
+ * every time, which is harmless. */
+inline uint32_t string_hash(String *s) {
+  if (s->hash == 0) {
+    s->hash = hash(string_chars(s), s->length);
+  }
+  return s->hash;
+}
+
+/* Whether the strings 'a' and 'b' have the same characters. Two int-
+ * erned strings are compared by address, and for the rest, the bytes
+ * are only compared if the lengths and the hashes are the same. */
+inline bool string_equal(String *a, String *b) {
+  if (a == b) {
+    return true;
+  }
+  /* There is only one interned String with any given characters. */
+  if (a->interned && b->interned) {
+    return false;
+  }
+  if (a->length != b->length || string_hash(a) != string_hash(b)) {
+    return false;
+  }
+  return memcmp(string_chars(a), string_chars(b), a->length) == 0;
+}
+
+struct StructBlueprint;
+
 typedef struct Struct {
   int refcount;
   char *name;
+  struct StructBlueprint *blueprint;
   size_t propcount;
   Object *properties;
 } Struct;
@@ -331,8 +409,6 @@ typedef struct Array {
   DynArray_Object elements;
 } Array;
 
-#define OBJ_TYPE(value) (AS_OBJ(value)->type)
-
 inline const char *get_object_type(Object *object) {
   if (IS_STRING(*object)) {
     return "string";
@@ -352,124 +428,27 @@ inline const char *get_object_type(Object *object) {
   assert(0);
 }
 
-typedef Table(Object) Table_Object;
-void free_table_object(const Table_Object *table);
-
 typedef struct {
   uint8_t *addr;
   int location;
 } BytecodePtr;
 
-inline void dealloc(Object *obj) {
-#ifdef NAN_BOXING
-  if (IS_STRUCT(*obj)) {
-    free(AS_STRUCT(*obj)->properties);
-    free(AS_STRUCT(*obj));
-  } else if (IS_STRING(*obj)) {
-    free(AS_STRING(*obj)->value);
-    free(AS_STRING(*obj));
-  } else if (IS_ARRAY(*obj)) {
-    dynarray_free(&AS_ARRAY(*obj)->elements);
-    free(AS_ARRAY(*obj));
-  }
-#else
-  switch (obj->type) {
-  case OBJ_STRUCT: {
-    free(AS_STRUCT(*obj)->properties);
-    free(AS_STRUCT(*obj));
-    break;
-  }
-  case OBJ_STRING: {
-    free(AS_STRING(*obj)->value);
-    free(AS_STRING(*obj));
-    break;
-  }
-  case OBJ_ARRAY: {
-    dynarray_free(&AS_ARRAY(*obj)->elements);
-    free(AS_ARRAY(*obj));
-    break;
-  }
-  default:
-    break;
-  }
-#endif
-}
+void dealloc(Object *obj);
 
+/* The refcounting functions are called for every object that is moved
+ * around, and most of those are not refcounted, so they only check the
+ * type of the object once, and anything beyond adjusting the refcount is
+ * left to dealloc(), which is kept out of line. */
 inline void objincref(Object *obj) {
-#ifdef NAN_BOXING
-  if (IS_STRING(*obj)) {
-    ++AS_STRING(*obj)->refcount;
-  } else if (IS_STRUCT(*obj)) {
-    ++AS_STRUCT(*obj)->refcount;
-  } else if (IS_ARRAY(*obj)) {
-    ++AS_ARRAY(*obj)->refcount;
-  }
-#else
-  switch (obj->type) {
-  case OBJ_STRING:
-  case OBJ_STRUCT:
-  case OBJ_ARRAY: {
-    ++*(obj)->as.refcount;
-    break;
-  }
-  default:
-    break;
+  if (IS_REFCOUNTED(*obj)) {
+    ++*REFCOUNT(*obj);
   }
-#endif
 }
 
 inline void objdecref(Object *obj) {
-#ifdef NAN_BOXING
-  if (IS_STRING(*obj)) {
-    if (--AS_STRING(*obj)->refcount == 0) {
-      dealloc(obj);
-    }
-  } else if (IS_STRUCT(*obj)) {
-    if (--AS_STRUCT(*obj)->refcount == 0) {
-      for (size_t i = 0; i < AS_STRUCT(*obj)->propcount; i++) {
-        objdecref(&AS_STRUCT(*obj)->properties[i]);
-      }
-      dealloc(obj);
-    }
-  } else if (IS_ARRAY(*obj)) {
-    if (--AS_ARRAY(*obj)->refcount == 0) {
-      for (size_t i = 0; i < AS_ARRAY(*obj)->elements.count; i++) {
-        objdecref(&AS_ARRAY(*obj)->elements.data[i]);
-      }
-      dealloc(obj);
-    }
+  if (IS_REFCOUNTED(*obj) && --*REFCOUNT(*obj) == 0) {
+    dealloc(obj);
   }
-#else
-
-  switch (obj->type) {
-  case OBJ_STRING: {
-    if (--*(obj)->as.refcount == 0) {
-      dealloc(obj);
-    }
-    break;
-  }
-  case OBJ_STRUCT: {
-    if (--*(obj)->as.refcount == 0) {
-      for (size_t i = 0; i < AS_STRUCT(*obj)->propcount; i++) {
-        objdecref(&AS_STRUCT(*obj)->properties[i]);
-      }
-      dealloc(obj);
-    }
-    break;
-  }
-  case OBJ_ARRAY: {
-    if (--*(obj)->as.refcount == 0) {
-      for (size_t i = 0; i < AS_ARRAY(*obj)->elements.count; i++) {
-        objdecref(&AS_ARRAY(*obj)->elements.data[i]);
-      }
-      dealloc(obj);
-    }
-    break;
-  }
-  default:
-    break;
-  }
-#endif
 }
 
 #endif
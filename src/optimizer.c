@@ -0,0 +1,504 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "compiler.h"
+#include "optimizer.h"
+
+/* Return the opcode that a superinstruction was fused over, i.e. the
+ * first opcode of its sequence, or the generic opcode that a quickened
+ * one was specialized from. Any other opcode is returned as is. */
+uint8_t unfused_opcode(uint8_t opcode) {
+  switch (opcode) {
+  case OP_ADD_NUM:
+    return OP_ADD;
+  case OP_SUB_NUM:
+    return OP_SUB;
+  case OP_MUL_NUM:
+    return OP_MUL;
+  case OP_DIV_NUM:
+    return OP_DIV;
+  case OP_MOD_NUM:
+    return OP_MOD;
+  case OP_EQ_NUM:
+    return OP_EQ;
+  case OP_GT_NUM:
+    return OP_GT;
+  case OP_LT_NUM:
+    return OP_LT;
+  case OP_DEEPADD_CONST:
+  case OP_DEEPGET_CONST:
+  case OP_DEEPGET_DEEPGET:
+  case OP_FORLOOP_CONST:
+  case OP_FORLOOP_DEEPGET:
+    return OP_DEEPGET;
+  case OP_ADD_DEEPSET:
+    return OP_ADD;
+  case OP_STRCAT_DEEPSET:
+    return OP_STRCAT;
+  case OP_LT_JZ:
+    return OP_LT;
+  case OP_GT_JZ:
+    return OP_GT;
+  case OP_TRUE_NOT:
+    return OP_TRUE;
+  default:
+    return opcode;
+  }
+}
+
+/* Return the number of index operands of the instruction at 'p'. */
+static size_t operand_count(uint8_t *p) {
+  switch (unfused_opcode(*p)) {
+  case OP_CONST:
+  case OP_STR:
+  case OP_SET_GLOBAL:
+  case OP_GET_GLOBAL:
+  case OP_GET_GLOBAL_PTR:
+  case OP_DEEPSET:
+  case OP_DEEPGET:
+  case OP_DEEPGET_PTR:
+  case OP_STRUCT:
+  case OP_ARRAY:
+    return 1;
+  case OP_CALL:
+  case OP_TAILCALL:
+  case OP_SETATTR:
+  case OP_GETATTR:
+  case OP_GETATTR_PTR:
+    return 2;
+  case OP_CALL_METHOD:
+  case OP_TAILCALL_METHOD:
+    return 3;
+  case OP_STRUCT_BLUEPRINT:
+    return 2 + operand_at(p, 1) * 2;
+  case OP_IMPL:
+    return 2 + operand_at(p, 1) * 3;
+  default:
+    return 0;
+  }
+}
+
+/* Return the length (opcode included) of the instruction at 'offset'.
+ *
+ * A fused opcode only replaces the opcode of the first instruction in
+ * the sequence, and the rest of the sequence is kept in place, so the
+ * length is that of the instruction it replaced. This way, the code
+ * can always be walked as it was emitted by the compiler. */
+size_t instruction_length(Bytecode *code, size_t offset) {
+  uint8_t *p = &code->code.data[offset];
+  uint8_t *last = p;
+  switch (unfused_opcode(*p)) {
+  case OP_JMP:
+  case OP_JZ:
+  case OP_JNZ:
+    read_jump(&last);
+    break;
+  default:
+    for (size_t i = operand_count(p); i > 0; i--) {
+      read_operand(&last);
+    }
+    break;
+  }
+  return last - p + 1;
+}
+
+/* Mark every offset in the chunk that control can be transferred to
+ * from somewhere other than the instruction right before it: the
+ * targets of the jumps, the functions called with OP_CALL and OP_TA-
+ * ILCALL, the methods registered with OP_IMPL, and the return addre-
+ * sses of OP_CALL and OP_CALL_METHOD. */
+bool *find_jump_targets(Bytecode *code) {
+  bool *targets = calloc(code->code.count + 1, sizeof(bool));
+
+  for (size_t offset = 0; offset < code->code.count;
+       offset += instruction_length(code, offset)) {
+    uint8_t *p = &code->code.data[offset];
+    switch (*p) {
+    case OP_JMP:
+    case OP_JZ:
+    case OP_JNZ: {
+      targets[jump_target(code->code.data, offset)] = true;
+      break;
+    }
+    case OP_CALL: {
+      targets[operand_at(p, 1)] = true;
+      targets[offset + instruction_length(code, offset)] = true;
+      break;
+    }
+    case OP_TAILCALL: {
+      targets[operand_at(p, 1)] = true;
+      break;
+    }
+    case OP_CALL_METHOD: {
+      targets[offset + instruction_length(code, offset)] = true;
+      break;
+    }
+    case OP_IMPL: {
+      uint32_t method_count = operand_at(p, 1);
+      for (size_t i = 0; i < method_count; i++) {
+        targets[operand_at(p, 2 + i * 3 + 2)] = true;
+      }
+      break;
+    }
+    default:
+      break;
+    }
+  }
+
+  return targets;
+}
+
+static bool is_jump(uint8_t opcode) {
+  return opcode == OP_JMP || opcode == OP_JZ || opcode == OP_JNZ;
+}
+
+/* Return the first instruction at or after 'offset' that has not
+ * been dropped, which is where a jump to 'offset' ends up going. */
+static size_t resolve(Bytecode *code, bool *dropped, size_t offset) {
+  while (offset < code->code.count && dropped[offset]) {
+    offset += instruction_length(code, offset);
+  }
+  return offset;
+}
+
+/* Return the instruction that runs after the one at 'offset', unless
+ * the one at 'offset' jumps. */
+static size_t next_instruction(Bytecode *code, bool *dropped, size_t offset) {
+  return resolve(code, dropped, offset + instruction_length(code, offset));
+}
+
+/* Like find_jump_targets(), but for the code as it is being rewrit-
+ * ten by the peephole optimizer, whose jumps go to 'targets' and not
+ * where their offsets say. The return addresses are left out, since
+ * the vm works them out as it makes the call. */
+static bool *find_live_targets(Bytecode *code, size_t *targets,
+                               bool *dropped) {
+  bool *live = calloc(code->code.count + 1, sizeof(bool));
+
+  for (size_t i = 0; i < code->functions.count; i++) {
+    live[resolve(code, dropped, code->functions.data[i].location)] = true;
+  }
+
+  for (size_t offset = 0; offset < code->code.count;
+       offset += instruction_length(code, offset)) {
+    uint8_t *p = &code->code.data[offset];
+    if (dropped[offset]) {
+      continue;
+    }
+    if (is_jump(*p)) {
+      live[resolve(code, dropped, targets[offset])] = true;
+    } else if (*p == OP_CALL || *p == OP_TAILCALL) {
+      live[resolve(code, dropped, operand_at(p, 1))] = true;
+    } else if (*p == OP_IMPL) {
+      uint32_t method_count = operand_at(p, 1);
+      for (size_t i = 0; i < method_count; i++) {
+        live[resolve(code, dropped, operand_at(p, 2 + i * 3 + 2))] = true;
+      }
+    }
+  }
+
+  return live;
+}
+
+/* Point every jump that goes to a forward OP_JMP at where that OP_JMP
+ * goes, e.g. the jump over the else branch of an 'if' nested in the
+ * then branch of another one, and drop the OP_JMPs that go to the in-
+ * struction right after them, e.g. the jump over a missing else bra-
+ * nch. The backward jumps are left alone: they close the loops, and
+ * the jit counts the iterations of a loop on them (see run_trace()). */
+static bool thread_jumps(Bytecode *code, size_t *targets, bool *dropped) {
+  bool changed = false;
+
+  for (size_t offset = 0; offset < code->code.count;
+       offset += instruction_length(code, offset)) {
+    if (dropped[offset] || !is_jump(code->code.data[offset])) {
+      continue;
+    }
+
+    size_t target = resolve(code, dropped, targets[offset]);
+    while (code->code.data[target] == OP_JMP && targets[target] > target) {
+      target = resolve(code, dropped, targets[target]);
+    }
+    if (target != targets[offset]) {
+      targets[offset] = target;
+      changed = true;
+    }
+
+    if (code->code.data[offset] == OP_JMP &&
+        target == next_instruction(code, dropped, offset)) {
+      dropped[offset] = true;
+      changed = true;
+    }
+  }
+
+  return changed;
+}
+
+/* Turn a conditional jump that comes right after an OP_NOT (e.g. the
+ * one of '>=', which is compiled to 'OP_LT, OP_NOT'), into one with the
+ * opposite condition, and drop the OP_NOT. Likewise, a conditional
+ * jump over a forward OP_JMP (e.g. the one of 'if (x) break;') becomes
+ * one to where the OP_JMP goes, with the opposite condition. Neither
+ * is done if something else jumps to the instruction that would go. */
+static bool invert_branches(Bytecode *code, size_t *targets, bool *dropped) {
+  bool changed = false;
+  bool *live = find_live_targets(code, targets, dropped);
+
+  for (size_t offset = 0; offset < code->code.count;
+       offset += instruction_length(code, offset)) {
+    uint8_t *p = &code->code.data[offset];
+    if (dropped[offset]) {
+      continue;
+    }
+
+    size_t next = next_instruction(code, dropped, offset);
+    if (next >= code->code.count || live[next]) {
+      continue;
+    }
+
+    if (*p == OP_NOT &&
+        (code->code.data[next] == OP_JZ || code->code.data[next] == OP_JNZ)) {
+      code->code.data[next] = code->code.data[next] == OP_JZ ? OP_JNZ : OP_JZ;
+      dropped[offset] = true;
+      changed = true;
+    } else if ((*p == OP_JZ || *p == OP_JNZ) &&
+               code->code.data[next] == OP_JMP && targets[next] > next &&
+               resolve(code, dropped, targets[offset]) ==
+                   next_instruction(code, dropped, next)) {
+      *p = *p == OP_JZ ? OP_JNZ : OP_JZ;
+      targets[offset] = targets[next];
+      dropped[next] = true;
+      changed = true;
+    }
+  }
+
+  free(live);
+  return changed;
+}
+
+/* Mark the instruction at 'offset' as reachable, and queue it up if it
+ * has not been reached before. */
+static void reach(bool *reachable, DynArray_uint32_t *worklist, size_t offset) {
+  if (!reachable[offset]) {
+    reachable[offset] = true;
+    dynarray_insert(worklist, offset);
+  }
+}
+
+/* Drop the instructions that can't be reached from the start of the
+ * chunk or from any of the functions, e.g. an OP_JMP over the else
+ * branch right after a 'return'. The OP_HLT at the end is always kept,
+ * so that every jump has an instruction to go to. */
+static bool drop_dead_code(Bytecode *code, size_t *targets, bool *dropped) {
+  bool changed = false;
+  bool *reachable = calloc(code->code.count + 1, sizeof(bool));
+  DynArray_uint32_t worklist = {0};
+
+  reach(reachable, &worklist, 0);
+  reach(reachable, &worklist, code->code.count - 1);
+  for (size_t i = 0; i < code->functions.count; i++) {
+    reach(reachable, &worklist, code->functions.data[i].location);
+  }
+
+  while (worklist.count > 0) {
+    size_t offset = dynarray_pop(&worklist);
+    uint8_t *p = &code->code.data[offset];
+    size_t next = offset + instruction_length(code, offset);
+
+    if (dropped[offset]) {
+      reach(reachable, &worklist, next);
+      continue;
+    }
+
+    switch (*p) {
+    case OP_JMP:
+      reach(reachable, &worklist, targets[offset]);
+      break;
+    case OP_JZ:
+    case OP_JNZ:
+      reach(reachable, &worklist, targets[offset]);
+      reach(reachable, &worklist, next);
+      break;
+    case OP_CALL:
+      reach(reachable, &worklist, operand_at(p, 1));
+      reach(reachable, &worklist, next);
+      break;
+    case OP_TAILCALL:
+      reach(reachable, &worklist, operand_at(p, 1));
+      break;
+    case OP_IMPL: {
+      uint32_t method_count = operand_at(p, 1);
+      for (size_t i = 0; i < method_count; i++) {
+        reach(reachable, &worklist, operand_at(p, 2 + i * 3 + 2));
+      }
+      reach(reachable, &worklist, next);
+      break;
+    }
+    case OP_TAILCALL_METHOD:
+    case OP_RET:
+    case OP_HLT:
+      break;
+    default:
+      reach(reachable, &worklist, next);
+      break;
+    }
+  }
+
+  for (size_t offset = 0; offset < code->code.count;
+       offset += instruction_length(code, offset)) {
+    if (!reachable[offset] && !dropped[offset]) {
+      dropped[offset] = true;
+      changed = true;
+    }
+  }
+
+  dynarray_free(&worklist);
+  free(reachable);
+  return changed;
+}
+
+/* Clean up the jumps that the compiler emits one statement at a time,
+ * and drop the code that never runs. The rewrites are done on the side
+ * ('targets' and 'dropped') until none of them applies anymore, and
+ * then the chunk is laid out anew in one go (see relocate()), which
+ * moves the jump offsets, the function and method locations, and the
+ * functions along with the code. */
+static void peephole(Bytecode *code) {
+  size_t *targets = calloc(code->code.count + 1, sizeof(size_t));
+  bool *wide = calloc(code->code.count + 1, sizeof(bool));
+  bool *dropped = calloc(code->code.count + 1, sizeof(bool));
+
+  for (size_t offset = 0; offset < code->code.count;
+       offset += instruction_length(code, offset)) {
+    if (is_jump(code->code.data[offset])) {
+      targets[offset] = jump_target(code->code.data, offset);
+    }
+  }
+
+  bool changed = true;
+  while (changed) {
+    changed = thread_jumps(code, targets, dropped);
+    changed |= invert_branches(code, targets, dropped);
+    changed |= drop_dead_code(code, targets, dropped);
+  }
+
+  relocate(code, targets, wide, dropped);
+
+  free(targets);
+  free(wide);
+  free(dropped);
+}
+
+#ifndef NO_SUPERINSTRUCTIONS
+#define SEQUENCE_MAX 9
+
+typedef struct {
+  Opcode fused;
+  size_t length;
+  Opcode sequence[SEQUENCE_MAX];
+} Superinstruction;
+
+/* The sequences worth fusing, picked from the opcode pair histogram
+ * (debug=pairs) of the programs in benchmarks/. At each instruction,
+ * they are tried in this order, so longer sequences must come before
+ * the shorter ones they begin with. */
+static Superinstruction superinstructions[] = {
+    /* The tail of a counted loop (see compile_counted_loop()), with a
+     * constant bound or a local one. */
+    {OP_FORLOOP_CONST,
+     9,
+     {OP_DEEPGET, OP_CONST, OP_ADD, OP_DEEPSET, OP_DEEPGET, OP_CONST, OP_LT,
+      OP_JZ, OP_JMP}},
+    {OP_FORLOOP_DEEPGET,
+     9,
+     {OP_DEEPGET, OP_CONST, OP_ADD, OP_DEEPSET, OP_DEEPGET, OP_DEEPGET, OP_LT,
+      OP_JZ, OP_JMP}},
+    {OP_DEEPADD_CONST, 4, {OP_DEEPGET, OP_CONST, OP_ADD, OP_DEEPSET}},
+    {OP_DEEPGET_CONST, 2, {OP_DEEPGET, OP_CONST}},
+    {OP_DEEPGET_DEEPGET, 2, {OP_DEEPGET, OP_DEEPGET}},
+    {OP_ADD_DEEPSET, 2, {OP_ADD, OP_DEEPSET}},
+    /* 's = s ++ x' and 's ++= x', for the in-place append. */
+    {OP_STRCAT_DEEPSET, 2, {OP_STRCAT, OP_DEEPSET}},
+    {OP_LT_JZ, 2, {OP_LT, OP_JZ}},
+    {OP_GT_JZ, 2, {OP_GT, OP_JZ}},
+    {OP_TRUE_NOT, 2, {OP_TRUE, OP_NOT}},
+};
+
+/* Try to match the superinstruction 'si' at 'offset'. On success,
+ * the length of the matched sequence (in bytes) is returned, other-
+ * wise the function returns 0. A sequence matches only if no jump
+ * lands in the middle of it, since the fused opcode would be skipped
+ * and only the tail of the sequence would run. */
+static size_t match(Bytecode *code, bool *targets, size_t offset,
+                    Superinstruction *si) {
+  size_t end = offset;
+  uint8_t *at[SEQUENCE_MAX];
+
+  for (size_t i = 0; i < si->length; i++) {
+    if (end >= code->code.count || code->code.data[end] != si->sequence[i]) {
+      return 0;
+    }
+    if (i > 0 && targets[end]) {
+      return 0;
+    }
+    at[i] = &code->code.data[end];
+    end += instruction_length(code, end);
+  }
+
+  /* 'local += const' is only fused if both ends use the same slot, and
+   * the tail of a counted loop only if it also tests that slot and has
+   * the short layout (see FORLOOP_LENGTH). */
+  bool loop =
+      si->fused == OP_FORLOOP_CONST || si->fused == OP_FORLOOP_DEEPGET;
+  if (loop || si->fused == OP_DEEPADD_CONST) {
+    uint32_t idx = operand_at(at[0], 0);
+    if (operand_at(at[3], 0) != idx || (loop && operand_at(at[4], 0) != idx)) {
+      return 0;
+    }
+  }
+  if (loop && end - offset != FORLOOP_LENGTH) {
+    return 0;
+  }
+
+  return end - offset;
+}
+
+/* Fuse the common sequences into superinstructions, in place. Only
+ * the opcode of the first instruction in a sequence is overwritten,
+ * so the layout of the chunk stays the same and none of the jump
+ * offsets or method locations need to be fixed up. The handler of
+ * the superinstruction reads the operands of the whole sequence and
+ * leaves the ip on the last byte of it. */
+static void fuse_superinstructions(Bytecode *code) {
+  bool *targets = find_jump_targets(code);
+
+  size_t superinstruction_count =
+      sizeof(superinstructions) / sizeof(superinstructions[0]);
+
+  size_t offset = 0;
+  while (offset < code->code.count) {
+    size_t length = 0;
+
+    for (size_t i = 0; i < superinstruction_count; i++) {
+      length = match(code, targets, offset, &superinstructions[i]);
+      if (length > 0) {
+        code->code.data[offset] = superinstructions[i].fused;
+        break;
+      }
+    }
+
+    offset += length > 0 ? length : instruction_length(code, offset);
+  }
+
+  free(targets);
+}
+#endif
+
+void optimize(Bytecode *code) {
+  peephole(code);
+#ifndef NO_SUPERINSTRUCTIONS
+  fuse_superinstructions(code);
+#endif
+}
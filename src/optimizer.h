@@ -0,0 +1,14 @@
+#ifndef venom_optimizer_h
+#define venom_optimizer_h
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "compiler.h"
+
+uint8_t unfused_opcode(uint8_t opcode);
+size_t instruction_length(Bytecode *code, size_t offset);
+bool *find_jump_targets(Bytecode *code);
+void optimize(Bytecode *code);
+
+#endif
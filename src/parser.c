@@ -175,6 +175,8 @@ static char *operator(Token token) {
     return "<=";
   case TOKEN_PLUSPLUS:
     return "++";
+  case TOKEN_PLUSPLUS_EQUAL:
+    return "++=";
   case TOKEN_GREATER_GREATER:
     return ">>";
   case TOKEN_GREATER_GREATER_EQUAL:
@@ -402,11 +404,11 @@ static Expr or_(Parser *parser, Tokenizer *tokenizer) {
 
 static Expr assignment(Parser *parser, Tokenizer *tokenizer) {
   Expr expr = or_(parser, tokenizer);
-  if (match(parser, tokenizer, 11, TOKEN_EQUAL, TOKEN_PLUS_EQUAL,
+  if (match(parser, tokenizer, 12, TOKEN_EQUAL, TOKEN_PLUS_EQUAL,
             TOKEN_MINUS_EQUAL, TOKEN_STAR_EQUAL, TOKEN_SLASH_EQUAL,
             TOKEN_MOD_EQUAL, TOKEN_AMPERSAND_EQUAL, TOKEN_PIPE_EQUAL,
             TOKEN_CARET_EQUAL, TOKEN_GREATER_GREATER_EQUAL,
-            TOKEN_LESS_LESS_EQUAL)) {
+            TOKEN_LESS_LESS_EQUAL, TOKEN_PLUSPLUS_EQUAL)) {
     char *op = operator(parser->previous);
     Expr right = or_(parser, tokenizer);
     ExprAssign assignexp = {
@@ -729,7 +731,7 @@ static Stmt statement(Parser *parser, Tokenizer *tokenizer) {
   }
 }
 
-static void free_expression(Expr e) {
+void free_expression(Expr e) {
   switch (e.kind) {
   case EXPR_LIT: {
     ExprLit litexpr = TO_EXPR_LIT(e);
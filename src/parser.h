@@ -300,6 +300,7 @@ typedef struct {
 } Parser;
 
 DynArray_Stmt parse(Parser *parser, Tokenizer *tokenizer);
+void free_expression(Expr e);
 void free_stmt(Stmt stmt);
 void init_parser(Parser *parser);
 
@@ -0,0 +1,550 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "optimizer.h"
+#include "register.h"
+
+static const char *register_opcode_names[] = {
+    [R_LOAD] = "R_LOAD",
+    [R_STORE] = "R_STORE",
+    [R_CONST] = "R_CONST",
+    [R_GET_GLOBAL] = "R_GET_GLOBAL",
+    [R_SET_GLOBAL] = "R_SET_GLOBAL",
+    [R_ADD] = "R_ADD",
+    [R_SUB] = "R_SUB",
+    [R_MUL] = "R_MUL",
+    [R_DIV] = "R_DIV",
+    [R_LT] = "R_LT",
+    [R_GT] = "R_GT",
+    [R_ADDK] = "R_ADDK",
+    [R_SUBK] = "R_SUBK",
+    [R_MULK] = "R_MULK",
+    [R_DIVK] = "R_DIVK",
+    [R_LTK] = "R_LTK",
+    [R_GTK] = "R_GTK",
+    [R_NEG] = "R_NEG",
+    [R_JMP] = "R_JMP",
+    [R_JZ] = "R_JZ",
+    [R_JNLT] = "R_JNLT",
+    [R_JNGT] = "R_JNGT",
+    [R_JNLTK] = "R_JNLTK",
+    [R_JNGTK] = "R_JNGTK",
+    [R_CALL] = "R_CALL",
+    [R_CALL_METHOD] = "R_CALL_METHOD",
+    [R_TAILCALL] = "R_TAILCALL",
+    [R_TAILCALL_METHOD] = "R_TAILCALL_METHOD",
+    [R_RET] = "R_RET",
+    [R_STACK] = "R_STACK",
+    [R_HLT] = "R_HLT",
+};
+
+const char *register_opcode_name(uint8_t opcode) {
+  return register_opcode_names[opcode];
+}
+
+void free_register_code(RegisterCode *rcode) {
+  dynarray_free(&rcode->code);
+  free(rcode->offsets);
+}
+
+/* How many objects the instruction at 'p' leaves on the stack,
+ * minus how many it takes off. The instructions that transfer
+ * control are handled by the caller. */
+static int stack_effect(uint8_t *p) {
+  switch (*p) {
+  case OP_PRINT:
+  case OP_ADD:
+  case OP_SUB:
+  case OP_MUL:
+  case OP_DIV:
+  case OP_MOD:
+  case OP_EQ:
+  case OP_GT:
+  case OP_LT:
+  case OP_BITAND:
+  case OP_BITOR:
+  case OP_BITXOR:
+  case OP_BITSHL:
+  case OP_BITSHR:
+  case OP_SET_GLOBAL:
+  case OP_DEEPSET:
+  case OP_SETATTR:
+  case OP_POP:
+  case OP_STRCAT:
+  case OP_SUBSCRIPT:
+    return -1;
+  case OP_TRUE:
+  case OP_NULL:
+  case OP_CONST:
+  case OP_STR:
+  case OP_GET_GLOBAL:
+  case OP_GET_GLOBAL_PTR:
+  case OP_DEEPGET:
+  case OP_DEEPGET_PTR:
+  case OP_STRUCT:
+    return 1;
+  case OP_DEREFSET:
+    return -2;
+  case OP_ARRAYSET:
+    return -3;
+  case OP_ARRAY:
+    return 1 - (int)operand_at(p, 0);
+  default:
+    return 0;
+  }
+}
+
+typedef struct {
+  size_t offset;
+  int depth;
+} Reached;
+
+typedef DynArray(Reached) DynArray_Reached;
+
+/* Record that the instruction at 'offset' is reached with 'depth'
+ * objects on the stack (relative to the frame pointer), and queue it
+ * up if it has not been seen before. Returns false if the instruct-
+ * ion had been reached before with a different depth. */
+static bool reach(Bytecode *code, int *depths, DynArray_Reached *worklist,
+                  size_t offset, int depth) {
+  if (offset >= code->code.count || depth < 0) {
+    return false;
+  }
+  if (depths[offset] != UNREACHABLE) {
+    return depths[offset] == depth;
+  }
+  depths[offset] = depth;
+  Reached reached = {.offset = offset, .depth = depth};
+  dynarray_insert(worklist, reached);
+  return true;
+}
+
+/* Work out the depth of the stack before each instruction, starting
+ * from the top-level code and from every function and method that is
+ * called. The frame of a function starts with its parameters, so the
+ * depth at its location is the parameter count. The instructions that
+ * are never reached are left UNREACHABLE. If the depth at some inst-
+ * ruction is not the same on every path to it, NULL is returned. */
+int *compute_depths(Bytecode *code) {
+  int *depths = malloc(sizeof(int) * code->code.count);
+  for (size_t i = 0; i < code->code.count; i++) {
+    depths[i] = UNREACHABLE;
+  }
+
+  DynArray_Reached worklist = {0};
+  bool ok = reach(code, depths, &worklist, 0, 0);
+
+  while (ok && worklist.count > 0) {
+    Reached reached = dynarray_pop(&worklist);
+    size_t offset = reached.offset;
+    int depth = reached.depth;
+    uint8_t *p = &code->code.data[offset];
+    size_t next = offset + instruction_length(code, offset);
+
+    switch (*p) {
+    case OP_JMP: {
+      ok = reach(code, depths, &worklist, jump_target(code->code.data, offset),
+                 depth);
+      break;
+    }
+    case OP_JZ: {
+      ok = reach(code, depths, &worklist, jump_target(code->code.data, offset),
+                 depth - 1) &&
+           reach(code, depths, &worklist, next, depth - 1);
+      break;
+    }
+    case OP_CALL: {
+      int argcount = operand_at(p, 0);
+      ok = reach(code, depths, &worklist, operand_at(p, 1), argcount) &&
+           reach(code, depths, &worklist, next, depth - argcount + 1);
+      break;
+    }
+    case OP_CALL_METHOD: {
+      /* The object the method is called on is taken off, too. */
+      int argcount = operand_at(p, 1);
+      ok = reach(code, depths, &worklist, next, depth - argcount);
+      break;
+    }
+    case OP_TAILCALL: {
+      /* Like OP_RET, it does not come back. */
+      int argcount = operand_at(p, 0);
+      ok = depth >= argcount &&
+           reach(code, depths, &worklist, operand_at(p, 1), argcount);
+      break;
+    }
+    case OP_TAILCALL_METHOD:
+      ok = depth >= (int)operand_at(p, 1) + 1;
+      break;
+    case OP_IMPL: {
+      uint32_t method_count = operand_at(p, 1);
+      for (size_t i = 0; ok && i < method_count; i++) {
+        ok = reach(code, depths, &worklist, operand_at(p, 2 + i * 3 + 2),
+                   operand_at(p, 2 + i * 3 + 1));
+      }
+      ok = ok && reach(code, depths, &worklist, next, depth);
+      break;
+    }
+    case OP_RET: {
+      /* The return value is on top of whatever is left in the frame. */
+      ok = depth >= 1;
+      break;
+    }
+    case OP_HLT:
+      break;
+    default: {
+      if (*p > OP_HLT) {
+        /* The superinstructions are not translated. */
+        ok = false;
+        break;
+      }
+      ok = reach(code, depths, &worklist, next, depth + stack_effect(p));
+      break;
+    }
+    }
+  }
+
+  dynarray_free(&worklist);
+
+  if (!ok) {
+    free(depths);
+    return NULL;
+  }
+
+  return depths;
+}
+
+static bool is_arithmetic(uint8_t opcode) {
+  return opcode >= R_ADD && opcode <= R_GT;
+}
+
+static bool is_arithmetic_k(uint8_t opcode) {
+  return opcode >= R_ADDK && opcode <= R_GTK;
+}
+
+/* Whether the instruction only reads and writes registers (and so
+ * cannot change a local behind the back of the instructions after
+ * it, the way a call or a stack instruction could through a poin-
+ * ter). All of these write R[a]. */
+static bool is_pure(RegisterInstruction *ins) {
+  return ins->opcode == R_LOAD || ins->opcode == R_STORE ||
+         ins->opcode == R_CONST || ins->opcode == R_NEG ||
+         is_arithmetic(ins->opcode) || is_arithmetic_k(ins->opcode);
+}
+
+static bool reads(RegisterInstruction *ins, uint32_t reg) {
+  switch (ins->opcode) {
+  case R_CONST:
+    return false;
+  case R_LOAD:
+  case R_STORE:
+  case R_NEG:
+    return ins->b == reg;
+  default:
+    return ins->b == reg || (is_arithmetic(ins->opcode) && ins->c == reg);
+  }
+}
+
+#define FORWARD_WINDOW 16
+
+/* Make the arithmetic instruction 'ins' read its left operand from
+ * the local it was loaded from, if the R_LOAD is close enough and
+ * the instructions in between (which compute the right operand) are
+ * pure, leave the local alone and are not jumped to. The R_LOAD is
+ * then removed. Returns true if that was done. */
+static bool forward_left_operand(RegisterCode *rcode, bool *targets,
+                                 RegisterInstruction *ins) {
+  DynArray_RegisterInstruction *code = &rcode->code;
+
+  size_t i = code->count;
+  while (i > 0 && code->count - i < FORWARD_WINDOW) {
+    RegisterInstruction *candidate = &code->data[--i];
+
+    if (candidate->a == ins->b) {
+      if (candidate->opcode != R_LOAD) {
+        return false;
+      }
+
+      uint32_t local = candidate->b;
+      for (size_t j = i + 1; j < code->count; j++) {
+        if (code->data[j].a == local || reads(&code->data[j], ins->b)) {
+          return false;
+        }
+      }
+
+      ins->b = local;
+      if (i == code->count - 1) {
+        ins->depth = candidate->depth;
+        ins->offset = candidate->offset;
+      }
+
+      for (size_t j = i + 1; j < code->count; j++) {
+        code->data[j - 1] = code->data[j];
+        rcode->offsets[code->data[j - 1].offset] = j - 1;
+      }
+      code->count--;
+      return true;
+    }
+
+    if (!is_pure(candidate) || targets[candidate->offset]) {
+      return false;
+    }
+  }
+
+  return false;
+}
+
+/* Append 'ins' to the register code, folding it into the instructions
+ * before it where possible:
+ *
+ * - An arithmetic instruction reads its operands straight from the
+ *   locals (or takes the constant) that were loaded into the tempo-
+ *   raries before it, so 'a + 1' becomes a single R_ADDK.
+ * - A store of the result of an arithmetic instruction into a local
+ *   the instruction read from makes the instruction write the local
+ *   directly, so 'i += 1' becomes a single R_ADDK as well.
+ * - A comparison followed by R_JZ on its result becomes a compare-
+ *   and-branch instruction.
+ * - A negated constant becomes a constant.
+ *
+ * An instruction is only ever folded into the ones before it if no
+ * jump lands on it, since otherwise the folded instructions would be
+ * skipped over on that path. */
+static void emit(RegisterCode *rcode, bool *targets, RegisterInstruction ins) {
+  DynArray_RegisterInstruction *code = &rcode->code;
+  RegisterInstruction *prev =
+      code->count > 0 ? &code->data[code->count - 1] : NULL;
+
+  if (prev && !targets[ins.offset]) {
+    if (is_arithmetic(ins.opcode)) {
+      if (prev->a == ins.c &&
+          (prev->opcode == R_CONST || prev->opcode == R_LOAD)) {
+        if (prev->opcode == R_CONST) {
+          ins.opcode += R_ADDK - R_ADD;
+          ins.k = prev->k;
+        } else {
+          ins.c = prev->b;
+        }
+        ins.depth = prev->depth;
+        ins.offset = prev->offset;
+        code->count--;
+
+        /* The right operand is folded in, so the left one can only be
+         * forwarded if the instruction is not jumped to from here on. */
+        if (targets[ins.offset]) {
+          goto append;
+        }
+      }
+      forward_left_operand(rcode, targets, &ins);
+    } else if (ins.opcode == R_NEG && prev->opcode == R_CONST &&
+               prev->a == ins.b) {
+      prev->k = -prev->k;
+      return;
+    } else if (ins.opcode == R_STORE &&
+               (is_arithmetic(prev->opcode) ||
+                is_arithmetic_k(prev->opcode)) &&
+               prev->a == ins.b &&
+               (prev->b == ins.a ||
+                (is_arithmetic(prev->opcode) && prev->c == ins.a))) {
+      /* The old value of the local was read as a number, so there
+       * is nothing to decrement. */
+      prev->a = ins.a;
+      return;
+    } else if (ins.opcode == R_JZ && prev->a == ins.a) {
+      RegisterOpcode branch;
+      switch (prev->opcode) {
+      case R_LT:
+        branch = R_JNLT;
+        break;
+      case R_GT:
+        branch = R_JNGT;
+        break;
+      case R_LTK:
+        branch = R_JNLTK;
+        break;
+      case R_GTK:
+        branch = R_JNGTK;
+        break;
+      default:
+        branch = R_JZ;
+        break;
+      }
+      if (branch != R_JZ) {
+        prev->opcode = branch;
+        prev->d = ins.d;
+        return;
+      }
+    }
+  }
+
+append:
+  rcode->offsets[ins.offset] = code->count;
+  dynarray_insert(code, ins);
+}
+
+/* Translate the stack bytecode in 'code' into register code. Returns
+ * false (and leaves 'rcode' empty) if the depth of the stack could
+ * not be worked out for every instruction, in which case the program
+ * has to be run on the stack engine instead. */
+bool translate_to_registers(Bytecode *code, RegisterCode *rcode) {
+  memset(rcode, 0, sizeof(RegisterCode));
+
+  int *depths = compute_depths(code);
+  if (!depths) {
+    return false;
+  }
+
+  bool *targets = find_jump_targets(code);
+
+  rcode->offsets = malloc(sizeof(uint32_t) * code->code.count);
+  for (size_t i = 0; i < code->code.count; i++) {
+    rcode->offsets[i] = UINT32_MAX;
+  }
+
+  for (size_t offset = 0; offset < code->code.count;
+       offset += instruction_length(code, offset)) {
+    if (depths[offset] == UNREACHABLE) {
+      continue;
+    }
+
+    uint8_t *p = &code->code.data[offset];
+    uint32_t depth = depths[offset];
+
+    RegisterInstruction ins = {
+        .opcode = R_STACK, .depth = depth, .offset = offset};
+
+    switch (*p) {
+    case OP_CONST:
+      ins.opcode = R_CONST;
+      ins.a = depth;
+      ins.k = code->cp.data[operand_at(p, 0)];
+      break;
+    case OP_DEEPGET:
+      ins.opcode = R_LOAD;
+      ins.a = depth;
+      ins.b = operand_at(p, 0);
+      break;
+    case OP_DEEPSET:
+      ins.opcode = R_STORE;
+      ins.a = operand_at(p, 0);
+      ins.b = depth - 1;
+      break;
+    case OP_GET_GLOBAL:
+      ins.opcode = R_GET_GLOBAL;
+      ins.a = depth;
+      ins.b = operand_at(p, 0);
+      break;
+    case OP_SET_GLOBAL:
+      ins.opcode = R_SET_GLOBAL;
+      ins.a = operand_at(p, 0);
+      ins.b = depth - 1;
+      break;
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_LT:
+    case OP_GT: {
+      switch (*p) {
+      case OP_ADD:
+        ins.opcode = R_ADD;
+        break;
+      case OP_SUB:
+        ins.opcode = R_SUB;
+        break;
+      case OP_MUL:
+        ins.opcode = R_MUL;
+        break;
+      case OP_DIV:
+        ins.opcode = R_DIV;
+        break;
+      case OP_LT:
+        ins.opcode = R_LT;
+        break;
+      default:
+        ins.opcode = R_GT;
+        break;
+      }
+      ins.a = depth - 2;
+      ins.b = depth - 2;
+      ins.c = depth - 1;
+      break;
+    }
+    case OP_NEG:
+      ins.opcode = R_NEG;
+      ins.a = depth - 1;
+      ins.b = depth - 1;
+      break;
+    case OP_JMP:
+      ins.opcode = R_JMP;
+      ins.d = jump_target(code->code.data, offset);
+      break;
+    case OP_JZ:
+      ins.opcode = R_JZ;
+      ins.a = depth - 1;
+      ins.d = jump_target(code->code.data, offset);
+      break;
+    case OP_CALL: {
+      uint32_t argcount = operand_at(p, 0);
+      ins.opcode = R_CALL;
+      ins.a = depth - argcount;
+      ins.d = operand_at(p, 1);
+      break;
+    }
+    case OP_CALL_METHOD: {
+      uint32_t argcount = operand_at(p, 1);
+      ins.opcode = R_CALL_METHOD;
+      ins.a = depth - argcount - 1;
+      ins.b = operand_at(p, 0);
+      ins.c = argcount;
+      ins.d = operand_at(p, 2);
+      break;
+    }
+    case OP_TAILCALL: {
+      uint32_t argcount = operand_at(p, 0);
+      ins.opcode = R_TAILCALL;
+      ins.a = depth - argcount;
+      ins.c = argcount;
+      ins.d = operand_at(p, 1);
+      break;
+    }
+    case OP_TAILCALL_METHOD: {
+      uint32_t argcount = operand_at(p, 1);
+      ins.opcode = R_TAILCALL_METHOD;
+      ins.a = depth - argcount - 1;
+      ins.b = operand_at(p, 0);
+      ins.c = argcount;
+      ins.d = operand_at(p, 2);
+      break;
+    }
+    case OP_RET:
+      ins.opcode = R_RET;
+      ins.a = depth - 1;
+      break;
+    case OP_HLT:
+      ins.opcode = R_HLT;
+      break;
+    default:
+      break;
+    }
+
+    emit(rcode, targets, ins);
+  }
+
+  /* Now that every instruction has its place, point the jumps and the
+   * calls at the register instructions instead of the offsets. */
+  for (size_t i = 0; i < rcode->code.count; i++) {
+    RegisterInstruction *ins = &rcode->code.data[i];
+    if ((ins->opcode >= R_JMP && ins->opcode <= R_JNGTK) ||
+        ins->opcode == R_CALL || ins->opcode == R_TAILCALL) {
+      ins->d = rcode->offsets[ins->d];
+    }
+  }
+
+  free(targets);
+  free(depths);
+
+  return true;
+}
@@ -0,0 +1,105 @@
+#ifndef venom_register_h
+#define venom_register_h
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "compiler.h"
+#include "dynarray.h"
+
+/* The register engine does not have a compiler of its own. The stack
+ * bytecode is translated into register code instead, by working out
+ * the depth of the stack before each instruction. Since the depth is
+ * the same every time an instruction is executed, each stack slot of
+ * a frame can be given a register: the locals are the registers 0..n
+ * (with the parameters first), and the temporaries are the registers
+ * above them. The registers live in the vm's stack, relative to the
+ * current frame pointer, so the instructions that are too rare to be
+ * worth a register form are executed by the stack handlers.
+ *
+ * The operands of the register instructions:
+ *
+ * R_LOAD a b         R[a] = R[b]
+ * R_STORE a b        R[a] = R[b], dropping the old R[a]
+ * R_CONST a k        R[a] = k
+ * R_GET_GLOBAL a b   R[a] = globals[b]
+ * R_SET_GLOBAL a b   globals[a] = R[b], dropping the old global
+ * R_ADD a b c        R[a] = R[b] + R[c] (same for SUB, MUL, DIV, LT, GT)
+ * R_ADDK a b k       R[a] = R[b] + k (same for SUBK, MULK, DIVK, LTK, GTK)
+ * R_NEG a b          R[a] = -R[b]
+ * R_JMP d            jump to d
+ * R_JZ a d           jump to d if R[a] is false
+ * R_JNLT b c d       jump to d unless R[b] < R[c] (same for JNGT)
+ * R_JNLTK b k d      jump to d unless R[b] < k (same for JNGTK)
+ * R_CALL a d         call d, with the new frame starting at R[a]
+ * R_CALL_METHOD a b c d
+ *                    call the method sp[b] on R[a] with c arguments,
+ *                    going through the method cache d
+ * R_TAILCALL a c d   call d with the c arguments starting at R[a], in
+ *                    place of the current frame
+ * R_TAILCALL_METHOD a b c d
+ *                    the same as R_CALL_METHOD, in place of the cur-
+ *                    rent frame
+ * R_RET a            return R[a] to the caller, dropping the frame
+ * R_STACK            run the stack instruction at 'offset'
+ * R_HLT              halt */
+typedef enum {
+  R_LOAD,
+  R_STORE,
+  R_CONST,
+  R_GET_GLOBAL,
+  R_SET_GLOBAL,
+  R_ADD,
+  R_SUB,
+  R_MUL,
+  R_DIV,
+  R_LT,
+  R_GT,
+  R_ADDK,
+  R_SUBK,
+  R_MULK,
+  R_DIVK,
+  R_LTK,
+  R_GTK,
+  R_NEG,
+  R_JMP,
+  R_JZ,
+  R_JNLT,
+  R_JNGT,
+  R_JNLTK,
+  R_JNGTK,
+  R_CALL,
+  R_CALL_METHOD,
+  R_TAILCALL,
+  R_TAILCALL_METHOD,
+  R_RET,
+  R_STACK,
+  R_HLT,
+} RegisterOpcode;
+
+typedef struct {
+  uint8_t opcode;
+  uint32_t a, b, c, d;
+  double k;
+  uint32_t depth;  /* of the stack before the instruction */
+  uint32_t offset; /* of the instruction in the stack bytecode */
+} RegisterInstruction;
+
+typedef DynArray(RegisterInstruction) DynArray_RegisterInstruction;
+
+typedef struct {
+  DynArray_RegisterInstruction code;
+  /* For each offset in the stack bytecode, the index of the register
+   * instruction it was translated to (used to find the methods). */
+  uint32_t *offsets;
+} RegisterCode;
+
+/* The depth of an instruction that is never reached. */
+#define UNREACHABLE (-1)
+
+int *compute_depths(Bytecode *code);
+bool translate_to_registers(Bytecode *code, RegisterCode *rcode);
+void free_register_code(RegisterCode *rcode);
+const char *register_opcode_name(uint8_t opcode);
+
+#endif
@@ -46,10 +46,14 @@ Returns NULL for not found.
 Return type is void*, so make sure to use a pointer of the correct type.
 */
 #define table_get(table, key)                                                  \
+  table_get_hashed((table), (key), hash((key), strlen((key))))
+
+/* Like table_get, for when the hash of the key is already known (as it
+ * is for an interned String, whose hash is kept in it). */
+#define table_get_hashed(table, key, keyhash)                                  \
   access_if_idx_not_null(                                                      \
       &(table)->items[0], sizeof((table)->items[0]),                           \
-      list_find((table)->indexes[hash((key), strlen((key))) % TABLE_MAX],      \
-                (key)))
+      list_find((table)->indexes[(keyhash) % TABLE_MAX], (key)))
 
 #define table_insert(table, key, item)                                         \
   do {                                                                         \
@@ -124,6 +124,9 @@ Token get_token(Tokenizer *tokenizer) {
     return number(tokenizer);
   switch (c) {
   case '+': {
+    if (lookahead(tokenizer, 2, "+=")) {
+      return make_token(tokenizer, TOKEN_PLUSPLUS_EQUAL, 3);
+    }
     if (lookahead(tokenizer, 1, "+")) {
       return make_token(tokenizer, TOKEN_PLUSPLUS, 2);
     }
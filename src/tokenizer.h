@@ -53,6 +53,7 @@ typedef enum {
   TOKEN_CARET_EQUAL,
   TOKEN_TILDE,
   TOKEN_PLUSPLUS,
+  TOKEN_PLUSPLUS_EQUAL,
   TOKEN_IMPL,
   TOKEN_IF,
   TOKEN_ELSE,
@@ -15,20 +15,84 @@
 
 void init_vm(VM *vm) {
   memset(vm, 0, sizeof(VM));
+  for (size_t i = 0; i < GLOBALS_MAX; i++) {
+    vm->globals[i] = NULL_VAL;
+  }
   vm->blueprints = calloc(1, sizeof(Table_StructBlueprint));
 }
 
 void free_vm(VM *vm) {
-  free_table_object(&vm->globals);
+  for (size_t i = 0; i < GLOBALS_MAX; i++) {
+    objdecref(&vm->globals[i]);
+  }
   free_table_struct_blueprints(vm->blueprints);
   free(vm->blueprints);
+  free_intern_table();
+  for (size_t i = 0; i < vm->string_count; i++) {
+    free(vm->strings[i]);
+  }
+  free(vm->strings);
 }
 
-static inline void push(VM *vm, Object obj) { vm->stack[vm->tos++] = obj; }
+/* Build a String for each of the strings in the sp, once, before the
+ * program starts running, so that OP_STR does not have to allocate
+ * one every time it runs. The sp holds every literal only once, so
+ * the same literal is always the same String. They are immortal (see
+ * IMMORTAL_STRING_VAL), and are only freed along with the vm.
+ *
+ * The sp holds the names of the structs, properties and methods too,
+ * and all of these are interned, so that the names can be looked up
+ * with the hash their String already has (see TABLE_GET_NAME), and so
+ * that comparing a literal to an interned string takes no more than a
+ * pointer comparison (see string_equal()). */
+static void load_strings(VM *vm, Bytecode *code) {
+  vm->strings = calloc(code->sp.count, sizeof(String *));
+  vm->string_count = code->sp.count;
+  for (size_t i = 0; i < code->sp.count; i++) {
+    char *chars = code->sp.data[i];
+    vm->strings[i] = intern(new_string(chars, strlen(chars)));
+  }
+}
 
-static inline Object pop(VM *vm) { return vm->stack[--vm->tos]; }
+/* Look up the name at 'idx' in the sp in 'table'. An interned String
+ * always has its hash computed, so the name is not hashed again. */
+#define TABLE_GET_NAME(table, idx)                                             \
+  table_get_hashed((table), code->sp.data[(idx)], vm->strings[(idx)]->hash)
+
+/* The state of the stack that the handlers work on. run() keeps it in
+ * a local, so that once the handlers are inlined, the compiler can keep
+ * the stack pointer and the frame pointer in machine registers across
+ * dispatches, instead of loading and storing vm->tos on every push and
+ * pop (it can't keep vm->tos in a register, since every call out of
+ * run() might read it). vm->tos is only brought up to date for the code
+ * that works with it directly (see sync_tos).
+ *
+ * The object on top of the stack is not cached in a register. The loc-
+ * als live on the stack too, and they are written through 'fp' and th-
+ * rough pointers, so such a cache has to be written through to memory
+ * and reloaded after every pop, which turned out to cost more than the
+ * loads it saves, with either object layout. */
+typedef struct {
+  Object *sp; /* one past the top of stack */
+  Object *fp; /* the frame of the current function */
+} Stack;
+
+static inline void push(Stack *stack, Object obj) { *stack->sp++ = obj; }
+
+static inline Object pop(Stack *stack) { return *--stack->sp; }
+
+static inline Object peek(Stack *stack, int n) { return stack->sp[-1 - n]; }
+
+/* Make vm->tos agree with the stack pointer, for the code outside of
+ * the handlers that works with vm->tos (the jit), and the other way
+ * around once it is done. */
+static inline void sync_tos(VM *vm, Stack *stack) {
+  vm->tos = stack->sp - vm->stack;
+}
 
-static inline Object peek(VM *vm, int n) { return vm->stack[vm->tos - 1 - n]; }
+static inline void reload_tos(VM *vm, Stack *stack) {
+  stack->sp = &vm->stack[vm->tos];
+}
 
 static inline uint64_t clamp(double d) {
   if (d < 0.0) {
@@ -42,16 +106,16 @@ static inline uint64_t clamp(double d) {
 
 #define BINARY_OP(op, wrapper)                                                 \
   do {                                                                         \
-    Object b = pop(vm);                                                        \
-    Object a = pop(vm);                                                        \
+    Object b = pop(stack);                                                     \
+    Object a = pop(stack);                                                     \
     Object obj = wrapper(AS_NUM(a) op AS_NUM(b));                              \
-    push(vm, obj);                                                             \
+    push(stack, obj);                                                          \
   } while (0)
 
 #define BITWISE_OP(op)                                                         \
   do {                                                                         \
-    Object b = pop(vm);                                                        \
-    Object a = pop(vm);                                                        \
+    Object b = pop(stack);                                                     \
+    Object a = pop(stack);                                                     \
                                                                                \
     uint64_t clamped_a = clamp(AS_NUM(a));                                     \
     uint64_t clamped_b = clamp(AS_NUM(b));                                     \
@@ -60,31 +124,57 @@ static inline uint64_t clamp(double d) {
                                                                                \
     Object obj = NUM_VAL((double)result);                                      \
                                                                                \
-    push(vm, obj);                                                             \
+    push(stack, obj);                                                          \
   } while (0)
 
 #define READ_UINT8() (*++(*ip))
 
-#define READ_INT16()                                                           \
+/* Whether the two objects on top of the stack are both numbers. */
+#define NUMBERS_ON_TOP()                                                       \
+  (IS_NUM(peek(stack, 0)) && IS_NUM(peek(stack, 1)))
+
+/* The generic arithmetic and comparison opcodes are quickened into
+ * their numeric forms the first time they run (see QUICK_BINARY_OP),
+ * since numbers are all they can be used on. Anything else is a ru-
+ * ntime error. */
+#define GENERIC_BINARY_OP(op, wrapper, name, quickened)                        \
+  do {                                                                         \
+    if (!NUMBERS_ON_TOP()) {                                                   \
+      unsupported_types(name, peek(stack, 1), peek(stack, 0));                 \
+    }                                                                          \
+    **ip = (quickened);                                                        \
+    BINARY_OP(op, wrapper);                                                    \
+  } while (0)
+
+/* The quickened forms only guard that both operands are still numbers.
+ * If they are not, the opcode is de-quickened back into the generic
+ * form, and the ip is stepped back so that the mainloop dispatches the
+ * generic form next. Calling the generic handler from here instead
+ * would keep the compiler from inlining it into run(), and then 'ip'
+ * and 'stack' could no longer be kept in registers. */
+#define QUICK_BINARY_OP(op, wrapper, generic)                                  \
+  do {                                                                         \
+    if (__builtin_expect(!NUMBERS_ON_TOP(), 0)) {                              \
+      **ip = (generic);                                                        \
+      --(*ip);                                                                 \
+      return;                                                                  \
+    }                                                                          \
+    BINARY_OP(op, wrapper);                                                    \
+  } while (0)
+
+#define READ_JUMP()                                                            \
   /* ip points to one of the jump instructions and                             \
    * there is a 2-byte operand (offset) that comes                             \
-   * after the opcode. The instruction pointer ne-                             \
-   * eds to be incremented to point to the last of                             \
-   * the two operands, and a 16-bit offset constr-                             \
-   * ucted from the two bytes. Then the ip will be                             \
+   * after the opcode, or, in the wide form, 2 more                            \
+   * bytes and a 4-byte offset. The instruction po-                            \
+   * inter needs to be incremented to point to the                             \
+   * last byte of the offset. Then the ip will be                              \
    * incremented by the mainloop again to point to                             \
    * the next opcode that comes after the jump. */                             \
-  (*ip += 2, (int16_t)(((*ip)[-1] << 8) | (*ip)[0]))
-
-#define READ_UINT32()                                                          \
-  (*ip += 4, (uint32_t)(((*ip)[-3] << 24) | ((*ip)[-2] << 16) |                \
-                        ((*ip)[-1] << 8) | (*ip)[0]))
+  (read_jump(ip))
 
-#define READ_DOUBLE()                                                          \
-  (*ip += 8, (((uint64_t)(*ip)[-7] << 56) | ((uint64_t)(*ip)[-6] << 48) |      \
-              ((uint64_t)(*ip)[-5] << 40) | ((uint64_t)(*ip)[-4] << 32) |      \
-              ((uint64_t)(*ip)[-3] << 24) | ((uint64_t)(*ip)[-2] << 16) |      \
-              ((uint64_t)(*ip)[-1] << 8) | (uint64_t)(*ip)[0]))
+/* Read an index operand in either of its forms (see compiler.h). */
+#define READ_OPERAND() (read_operand(ip))
 
 #define PRINT_STACK()                                                          \
   do {                                                                         \
@@ -118,23 +208,39 @@ static inline uint64_t clamp(double d) {
     exit(1);                                                                   \
   } while (0)
 
+/* Raise the runtime error for the binary operator 'op' used on objects
+ * it does not support. It is kept out of line, off the fast paths of
+ * the handlers that check their operands, and the jit's guards call it
+ * as well (see emit_number_guard() in jit.c). */
+__attribute__((noinline, noreturn)) void unsupported_types(const char *op,
+                                                           Object a, Object b) {
+  RUNTIME_ERROR("'%s' operator used on objects of unsupported types: %s and %s",
+                op, get_object_type(&a), get_object_type(&b));
+}
+
 static inline bool check_equality(Object *left, Object *right) {
 #ifdef NAN_BOXING
   if (IS_NUM(*left) && IS_NUM(*right)) {
     return AS_NUM(*left) == AS_NUM(*right);
   }
+  if (IS_STRING(*left) && IS_STRING(*right)) {
+    return string_equal(AS_STRING(*left), AS_STRING(*right));
+  }
   return *left == *right;
 #else
 
+  /* A literal is a string just like the ones built at runtime, even
+   * though its type is not the same. */
+  if (IS_STRING(*left) && IS_STRING(*right)) {
+    return string_equal(AS_STRING(*left), AS_STRING(*right));
+  }
+
   /* Return false if the objects are of different type. */
   if (left->type != right->type) {
     return false;
   }
 
   switch (left->type) {
-  case OBJ_STRING: {
-    return strcmp(AS_STRING(*left)->value, AS_STRING(*right)->value) == 0;
-  }
   case OBJ_STRUCT: {
     return AS_STRUCT(*left) == AS_STRUCT(*right);
   }
@@ -153,35 +259,14 @@ static inline bool check_equality(Object *left, Object *right) {
 #endif
 }
 
-static inline uint32_t adjust_idx(VM *vm, uint32_t idx) {
-  /* 'idx' is adjusted to be relative to the current fra-
-   * me pointer, if there are any. If not, it is returned
-   * back, as is. */
-  if (vm->fp_count > 0) {
-    BytecodePtr fp = vm->fp_stack[vm->fp_count - 1];
-    return fp.location + idx;
-  } else {
-    return idx;
-  }
-}
-
-static inline char *concatenate_strings(char *a, char *b) {
-  int len_a = strlen(a);
-  int len_b = strlen(b);
-  int total_len = len_a + len_b + 1;
-  char *result = malloc(total_len);
-  strcpy(result, a);
-  strcat(result, b);
-  return result;
-}
-
 /* OP_PRINT pops an object off the stack and prints it,
  * prefixing it with "dbg print :: " in debug=vm mode.
  *
  * REFCOUNTING: Since the popped object might be refco-
  * unted, the reference count must be decremented. */
-static inline void handle_op_print(VM *vm, Bytecode *code, uint8_t **ip) {
-  Object object = pop(vm);
+static inline void handle_op_print(VM *vm, Bytecode *code, uint8_t **ip,
+                                   Stack *stack) {
+  Object object = pop(stack);
 
 #ifdef venom_debug_vm
   printf("dbg print :: ");
@@ -196,56 +281,105 @@ static inline void handle_op_print(VM *vm, Bytecode *code, uint8_t **ip) {
 /* OP_ADD pops two objects off the stack, adds them, and
  * pushes the result back on the stack.
  *
- * SAFETY: It is up to the user to ensure the two objec-
- * ts are numbers, because this handler does not do run-
- * time type checks. */
-static inline void handle_op_add(VM *vm, Bytecode *code, uint8_t **ip) {
-  BINARY_OP(+, NUM_VAL);
+ * SAFETY: A runtime error is raised if the two objects
+ * are not numbers. Otherwise, the opcode is quickened
+ * into OP_ADD_NUM. */
+static inline void handle_op_add(VM *vm, Bytecode *code, uint8_t **ip,
+                                 Stack *stack) {
+  GENERIC_BINARY_OP(+, NUM_VAL, "+", OP_ADD_NUM);
+}
+
+/* OP_ADD_NUM is OP_ADD on two numbers. */
+static inline void handle_op_add_num(VM *vm, Bytecode *code, uint8_t **ip,
+                                     Stack *stack) {
+  QUICK_BINARY_OP(+, NUM_VAL, OP_ADD);
 }
 
 /* OP_SUB pops two objects off the stack, subs them, and
  * pushes the result back on the stack.
  *
- * SAFETY: It is up to the user to ensure the two objec-
- * ts are numbers, because this handler does not do run-
- * time type checks. */
-static inline void handle_op_sub(VM *vm, Bytecode *code, uint8_t **ip) {
-  BINARY_OP(-, NUM_VAL);
+ * SAFETY: A runtime error is raised if the two objects
+ * are not numbers. Otherwise, the opcode is quickened
+ * into OP_SUB_NUM. */
+static inline void handle_op_sub(VM *vm, Bytecode *code, uint8_t **ip,
+                                 Stack *stack) {
+  GENERIC_BINARY_OP(-, NUM_VAL, "-", OP_SUB_NUM);
+}
+
+/* OP_SUB_NUM is OP_SUB on two numbers. */
+static inline void handle_op_sub_num(VM *vm, Bytecode *code, uint8_t **ip,
+                                     Stack *stack) {
+  QUICK_BINARY_OP(-, NUM_VAL, OP_SUB);
 }
 
 /* OP_MUL pops two objects off the stack, muls them, and
  * pushes the result back on the stack.
  *
- * SAFETY: It is up to the user to ensure the two objec-
- * ts are numbers, because this handler does not do run-
- * time type checks. */
-static inline void handle_op_mul(VM *vm, Bytecode *code, uint8_t **ip) {
-  BINARY_OP(*, NUM_VAL);
+ * SAFETY: A runtime error is raised if the two objects
+ * are not numbers. Otherwise, the opcode is quickened
+ * into OP_MUL_NUM. */
+static inline void handle_op_mul(VM *vm, Bytecode *code, uint8_t **ip,
+                                 Stack *stack) {
+  GENERIC_BINARY_OP(*, NUM_VAL, "*", OP_MUL_NUM);
+}
+
+/* OP_MUL_NUM is OP_MUL on two numbers. */
+static inline void handle_op_mul_num(VM *vm, Bytecode *code, uint8_t **ip,
+                                     Stack *stack) {
+  QUICK_BINARY_OP(*, NUM_VAL, OP_MUL);
 }
 
 /* OP_DIV pops two objects off the stack, divs them, and
  * pushes the result back on the stack.
  *
- * SAFETY: It is up to the user to ensure the two objec-
- * ts are numbers, because this handler does not do run-
- * time type checks. */
-static inline void handle_op_div(VM *vm, Bytecode *code, uint8_t **ip) {
-  BINARY_OP(/, NUM_VAL);
+ * SAFETY: A runtime error is raised if the two objects
+ * are not numbers. Otherwise, the opcode is quickened
+ * into OP_DIV_NUM. */
+static inline void handle_op_div(VM *vm, Bytecode *code, uint8_t **ip,
+                                 Stack *stack) {
+  GENERIC_BINARY_OP(/, NUM_VAL, "/", OP_DIV_NUM);
+}
+
+/* OP_DIV_NUM is OP_DIV on two numbers. */
+static inline void handle_op_div_num(VM *vm, Bytecode *code, uint8_t **ip,
+                                     Stack *stack) {
+  QUICK_BINARY_OP(/, NUM_VAL, OP_DIV);
 }
 
 /* OP_MOD pops two objects off the stack, mods them, and
  * pushes the result back on the stack.
  *
- * SAFETY: It is up to the user to ensure the two objec-
- * ts are numbers, because this handler does not do run-
- * time type checks. */
-static inline void handle_op_mod(VM *vm, Bytecode *code, uint8_t **ip) {
-  Object b = pop(vm);
-  Object a = pop(vm);
+ * SAFETY: A runtime error is raised if the two objects
+ * are not numbers. Otherwise, the opcode is quickened
+ * into OP_MOD_NUM. */
+static inline void handle_op_mod(VM *vm, Bytecode *code, uint8_t **ip,
+                                 Stack *stack) {
+  if (!NUMBERS_ON_TOP()) {
+    unsupported_types("%", peek(stack, 1), peek(stack, 0));
+  }
+  **ip = OP_MOD_NUM;
+
+  Object b = pop(stack);
+  Object a = pop(stack);
 
   Object obj = NUM_VAL(fmod(AS_NUM(a), AS_NUM(b)));
 
-  push(vm, obj);
+  push(stack, obj);
+}
+
+/* OP_MOD_NUM is OP_MOD on two numbers. */
+static inline void handle_op_mod_num(VM *vm, Bytecode *code, uint8_t **ip,
+                                     Stack *stack) {
+  if (__builtin_expect(!NUMBERS_ON_TOP(), 0)) {
+    **ip = OP_MOD;
+    --(*ip);
+    return;
+  }
+
+  Object b = pop(stack);
+  Object a = pop(stack);
+
+  push(stack, NUM_VAL(fmod(AS_NUM(a), AS_NUM(b))));
 }
 
 /* OP_BITAND pops two objects off the stack, clamps them
@@ -255,7 +389,8 @@ static inline void handle_op_mod(VM *vm, Bytecode *code, uint8_t **ip) {
  * SAFETY: It is up to the user to ensure the two objec-
  * ts are numbers, because this handler does not do run-
  * time type checks. */
-static inline void handle_op_bitand(VM *vm, Bytecode *code, uint8_t **ip) {
+static inline void handle_op_bitand(VM *vm, Bytecode *code, uint8_t **ip,
+                                    Stack *stack) {
   BITWISE_OP(&);
 }
 
@@ -266,7 +401,8 @@ static inline void handle_op_bitand(VM *vm, Bytecode *code, uint8_t **ip) {
  * SAFETY: It is up to the user to ensure the two objec-
  * ts are numbers, because this handler does not do run-
  * time type checks. */
-static inline void handle_op_bitor(VM *vm, Bytecode *code, uint8_t **ip) {
+static inline void handle_op_bitor(VM *vm, Bytecode *code, uint8_t **ip,
+                                   Stack *stack) {
   BITWISE_OP(|);
 }
 
@@ -277,7 +413,8 @@ static inline void handle_op_bitor(VM *vm, Bytecode *code, uint8_t **ip) {
  * SAFETY: It is up to the user to ensure the two objec-
  * ts are numbers, because this handler does not do run-
  * time type checks. */
-static inline void handle_op_bitxor(VM *vm, Bytecode *code, uint8_t **ip) {
+static inline void handle_op_bitxor(VM *vm, Bytecode *code, uint8_t **ip,
+                                    Stack *stack) {
   BITWISE_OP(^);
 }
 
@@ -288,14 +425,15 @@ static inline void handle_op_bitxor(VM *vm, Bytecode *code, uint8_t **ip) {
  * SAFETY: It is up to the user to ensure the object is a
  * number because this handler does not do a runtime type
  * check. */
-static inline void handle_op_bitnot(VM *vm, Bytecode *code, uint8_t **ip) {
-  Object obj = pop(vm);
+static inline void handle_op_bitnot(VM *vm, Bytecode *code, uint8_t **ip,
+                                    Stack *stack) {
+  Object obj = pop(stack);
 
   uint64_t clamped = clamp(AS_NUM(obj));
 
   uint64_t inverted = ~clamped;
 
-  push(vm, NUM_VAL(inverted));
+  push(stack, NUM_VAL(inverted));
 }
 
 /* OP_BITSHL pops two objects off the stack, clamps them
@@ -305,7 +443,8 @@ static inline void handle_op_bitnot(VM *vm, Bytecode *code, uint8_t **ip) {
  * SAFETY: It is up to the user to ensure the two objec-
  * ts are numbers, because this handler does not do run-
  * time type checks. */
-static inline void handle_op_bitshl(VM *vm, Bytecode *code, uint8_t **ip) {
+static inline void handle_op_bitshl(VM *vm, Bytecode *code, uint8_t **ip,
+                                    Stack *stack) {
   BITWISE_OP(<<);
 }
 
@@ -316,51 +455,77 @@ static inline void handle_op_bitshl(VM *vm, Bytecode *code, uint8_t **ip) {
  * SAFETY: It is up to the user to ensure the two objec-
  * ts are numbers, because this handler does not do run-
  * time type checks. */
-static inline void handle_op_bitshr(VM *vm, Bytecode *code, uint8_t **ip) {
+static inline void handle_op_bitshr(VM *vm, Bytecode *code, uint8_t **ip,
+                                    Stack *stack) {
   BITWISE_OP(>>);
 }
 
-/* OP_EQ pops two objects off the stack, clamps them to
- * [0, UINT64_MAX], performs the equality check on them
- * and pushes the result on the stack.
+/* OP_EQ pops two objects off the stack, performs the
+ * equality check on them and pushes the result on the
+ * stack. If the two objects are numbers, the opcode is
+ * quickened into OP_EQ_NUM.
  *
  * REFCOUNTING: Since the two objects might be refcoun-
  * ted, the reference count for both must be decrement-
- * ed.
- *
- * SAFETY: It is up to the user to ensure the two objec-
- * ts are bools, because this handler does not do runti-
- * me type checks. */
-static inline void handle_op_eq(VM *vm, Bytecode *code, uint8_t **ip) {
-  Object b = pop(vm);
-  Object a = pop(vm);
+ * ed, once they have been compared. */
+static inline void handle_op_eq(VM *vm, Bytecode *code, uint8_t **ip,
+                                Stack *stack) {
+  Object b = pop(stack);
+  Object a = pop(stack);
+
+  if (IS_NUM(a) && IS_NUM(b)) {
+    **ip = OP_EQ_NUM;
+  }
+
+  bool equal = check_equality(&a, &b);
 
   objdecref(&a);
   objdecref(&b);
 
-  push(vm, BOOL_VAL(check_equality(&a, &b)));
+  push(stack, BOOL_VAL(equal));
+}
+
+/* OP_EQ_NUM is OP_EQ on two numbers, which skips the type
+ * dispatch of check_equality() and the refcounting. */
+static inline void handle_op_eq_num(VM *vm, Bytecode *code, uint8_t **ip,
+                                    Stack *stack) {
+  QUICK_BINARY_OP(==, BOOL_VAL, OP_EQ);
 }
 
 /* OP_GT pops two objects off the stack, compares them us-
  * ing the GT operation, and pushes the result back on the
  * stack.
  *
- * SAFETY: It is up to the user to ensure the two objects
- * are numbers, because this handler does not do runtime
- * type checks. */
-static inline void handle_op_gt(VM *vm, Bytecode *code, uint8_t **ip) {
-  BINARY_OP(>, BOOL_VAL);
+ * SAFETY: A runtime error is raised if the two objects
+ * are not numbers. Otherwise, the opcode is quickened
+ * into OP_GT_NUM. */
+static inline void handle_op_gt(VM *vm, Bytecode *code, uint8_t **ip,
+                                Stack *stack) {
+  GENERIC_BINARY_OP(>, BOOL_VAL, ">", OP_GT_NUM);
+}
+
+/* OP_GT_NUM is OP_GT on two numbers. */
+static inline void handle_op_gt_num(VM *vm, Bytecode *code, uint8_t **ip,
+                                    Stack *stack) {
+  QUICK_BINARY_OP(>, BOOL_VAL, OP_GT);
 }
 
 /* OP_LT pops two objects off the stack, compares them us-
  * ing the LT operation, and pushes the result back on the
  * stack.
  *
- * SAFETY: It is up to the user to ensure the two objects
- * are numbers, because this handler does not do runtime
- * type checks. */
-static inline void handle_op_lt(VM *vm, Bytecode *code, uint8_t **ip) {
-  BINARY_OP(<, BOOL_VAL);
+ * SAFETY: A runtime error is raised if the two objects
+ * are not numbers. Otherwise, the opcode is quickened
+ * into OP_LT_NUM. */
+static inline void handle_op_lt(VM *vm, Bytecode *code, uint8_t **ip,
+                                Stack *stack) {
+  GENERIC_BINARY_OP(<, BOOL_VAL, "<", OP_LT_NUM);
+}
+
+/* OP_LT_NUM is OP_LT on two numbers. */
+static inline void handle_op_lt_num(VM *vm, Bytecode *code, uint8_t **ip,
+                                    Stack *stack) {
+  QUICK_BINARY_OP(<, BOOL_VAL, OP_LT);
 }
 
 /* OP_NOT pops an object off the stack, performs the
@@ -370,9 +535,10 @@ static inline void handle_op_lt(VM *vm, Bytecode *code, uint8_t **ip) {
  * SAFETY: It is up to the user to ensure the object
  * is a bool, because this handler does not do a ru-
  * ntime type check. */
-static inline void handle_op_not(VM *vm, Bytecode *code, uint8_t **ip) {
-  Object obj = pop(vm);
-  push(vm, BOOL_VAL(AS_BOOL(obj) ^ 1));
+static inline void handle_op_not(VM *vm, Bytecode *code, uint8_t **ip,
+                                 Stack *stack) {
+  Object obj = pop(stack);
+  push(stack, BOOL_VAL(AS_BOOL(obj) ^ 1));
 }
 
 /* OP_NEG pops an object off the stack, performs the
@@ -382,121 +548,147 @@ static inline void handle_op_not(VM *vm, Bytecode *code, uint8_t **ip) {
  * SAFETY: It is up to the user to ensure the object is
  * a number, because this handler does not do a runtime
  * type check. */
-static inline void handle_op_neg(VM *vm, Bytecode *code, uint8_t **ip) {
-  Object original = pop(vm);
+static inline void handle_op_neg(VM *vm, Bytecode *code, uint8_t **ip,
+                                 Stack *stack) {
+  Object original = pop(stack);
   Object negated = NUM_VAL(-AS_NUM(original));
-  push(vm, negated);
+  push(stack, negated);
 }
 
 /* OP_TRUE pushes a bool object ('true') on the stack. */
-static inline void handle_op_true(VM *vm, Bytecode *code, uint8_t **ip) {
-  push(vm, BOOL_VAL(true));
+static inline void handle_op_true(VM *vm, Bytecode *code, uint8_t **ip,
+                                  Stack *stack) {
+  push(stack, BOOL_VAL(true));
 }
 
 /* OP_NULL pushes a null object on the stack. */
-static inline void handle_op_null(VM *vm, Bytecode *code, uint8_t **ip) {
-  push(vm, NULL_VAL);
+static inline void handle_op_null(VM *vm, Bytecode *code, uint8_t **ip,
+                                  Stack *stack) {
+  push(stack, NULL_VAL);
 }
 
-/* OP_CONST reads a 4-byte index of the constant in the
+/* OP_CONST reads an index of the constant in the
  * chunk's cp, constructs an object with that value and
  * pushes it on the stack. */
-static inline void handle_op_const(VM *vm, Bytecode *code, uint8_t **ip) {
-  union {
-    double d;
-    uint64_t raw;
-  } num;
-  num.raw = READ_DOUBLE();
-  push(vm, NUM_VAL(num.d));
-}
-
-/* OP_STR reads a 4-byte index of the string in the ch-
- * unk's sp, constructs a string object with that value
- * and pushes it on the stack.
- *
- * REFCOUNTING: Since Strings are refcounted, the newly
- * constructed object has a refcount=1. */
-static inline void handle_op_str(VM *vm, Bytecode *code, uint8_t **ip) {
-  uint32_t idx = READ_UINT32();
-
-  String s = {.refcount = 1, .value = own_string(code->sp.data[idx])};
+static inline void handle_op_const(VM *vm, Bytecode *code, uint8_t **ip,
+                                   Stack *stack) {
+  uint32_t const_idx = READ_OPERAND();
+  push(stack, NUM_VAL(code->cp.data[const_idx]));
+}
 
-  push(vm, STRING_VAL(ALLOC(s)));
+/* OP_STR reads an index of the string in the ch-
+ * unk's sp, and pushes the String that was built for it
+ * when the program was loaded (see load_strings()).
+ *
+ * REFCOUNTING: The String is immortal, so there is no
+ * refcount to increment. */
+static inline void handle_op_str(VM *vm, Bytecode *code, uint8_t **ip,
+                                 Stack *stack) {
+  uint32_t idx = READ_OPERAND();
+  push(stack, IMMORTAL_STRING_VAL(vm->strings[idx]));
 }
 
 /* OP_JZ reads a signed 2-byte offset (that could be ne-
  * gative), pops an object off the stack, and increments
  * the instruction pointer by the offset, if and only if
- * the popped object was 'false'. */
-static inline void handle_op_jz(VM *vm, Bytecode *code, uint8_t **ip) {
-  int16_t offset = READ_INT16();
-  Object obj = pop(vm);
-  if (!AS_BOOL(obj)) {
+ * the popped object was 'false'.
+ *
+ * OP_JNZ, which jumps if the object was 'true' instead,
+ * is handled here too. With a label of its own, gcc ran
+ * out of registers for 'ip' in run(), and spilled it on
+ * every dispatch, which made fib40 15% slower. */
+static inline void handle_op_jz(VM *vm, Bytecode *code, uint8_t **ip,
+                                Stack *stack) {
+  bool jnz = **ip == OP_JNZ;
+  int32_t offset = READ_JUMP();
+  Object obj = pop(stack);
+  if (AS_BOOL(obj) == jnz) {
     *ip += offset;
   }
 }
 
+#ifdef JIT
+/* Let the jit know that the loop at the ip (the target of a backward
+ * jump) is about to run again. If the loop has been traced, the trace
+ * runs until it exits, and the ip is moved to where it left off. */
+static inline void run_trace(VM *vm, Bytecode *code, uint8_t **ip,
+                             Stack *stack) {
+  size_t header = *ip + 1 - code->code.data;
+  sync_tos(vm, stack);
+  size_t resume = jit_loop(&vm->jit, vm, code, header, stack->fp - vm->stack);
+  reload_tos(vm, stack);
+  *ip = &code->code.data[resume] - 1;
+}
+#endif
+
 /* OP_JMP reads a signed 2-byte offset (that could be ne-
  * gative), and increments the instruction pointer by the
  * offset. Unlike OP_JZ, which is a conditional jump, the
  * OP_JMP instruction takes the jump unconditionally. */
-static inline void handle_op_jmp(VM *vm, Bytecode *code, uint8_t **ip) {
-  int16_t offset = READ_INT16();
+static inline void handle_op_jmp(VM *vm, Bytecode *code, uint8_t **ip,
+                                 Stack *stack) {
+  int32_t offset = READ_JUMP();
   *ip += offset;
+#ifdef JIT
+  if (offset < 0) {
+    run_trace(vm, code, ip, stack);
+  }
+#endif
 }
 
-/* OP_SET_GLOBAL reads a 4-byte index of the variable name
- * in the chunk's sp, pops an object off the stack and in-
- * serts it into the vm's globals table under that name.
+/* OP_SET_GLOBAL reads a slot index of the global
+ * variable (assigned by the compiler), pops an object off
+ * the stack and stores it into that slot of the vm's gl-
+ * obals array.
  *
  * REFCOUNTING: We do NOT need to increment the refcount of
- * the object we are inserting into the table because we're
- * merely moving it from one location to another.
- * */
-static inline void handle_op_set_global(VM *vm, Bytecode *code, uint8_t **ip) {
-  uint32_t name_idx = READ_UINT32();
-  Object obj = pop(vm);
-  table_insert(&vm->globals, code->sp.data[name_idx], obj);
-}
-
-/* OP_GET_GLOBAL reads a 4-byte index of the variable name
- * in the chunk's sp, looks up an object with that name in
- * the vm's globals table, and pushes it on the stack.
+ * the object we are storing into the slot because we're m-
+ * erely moving it from one location to another. However,
+ * the object being overwritten must be decremented. */
+static inline void handle_op_set_global(VM *vm, Bytecode *code, uint8_t **ip,
+                                        Stack *stack) {
+  uint32_t slot = READ_OPERAND();
+  Object obj = pop(stack);
+  objdecref(&vm->globals[slot]);
+  vm->globals[slot] = obj;
+}
+
+/* OP_GET_GLOBAL reads a slot index of the global
+ * variable, and pushes the object in that slot of the vm's
+ * globals array on the stack.
  *
  * REFCOUNTING: Since the object will be present in yet an-
  * other location, the refcount must be incremented. */
-static inline void handle_op_get_global(VM *vm, Bytecode *code, uint8_t **ip) {
-  uint32_t name_idx = READ_UINT32();
-  Object *obj = table_get_unchecked(&vm->globals, code->sp.data[name_idx]);
-  push(vm, *obj);
+static inline void handle_op_get_global(VM *vm, Bytecode *code, uint8_t **ip,
+                                        Stack *stack) {
+  uint32_t slot = READ_OPERAND();
+  Object *obj = &vm->globals[slot];
+  push(stack, *obj);
   objincref(obj);
 }
 
-/* OP_GET_GLOBAL_PTR reads a 4-byte index of the variable
- * name in the chunk's sp, looks up the object under that
- * name in in the vm's globals table, and pushes its add-
- * ress on the stack. */
+/* OP_GET_GLOBAL_PTR reads a slot index of the glo-
+ * bal variable, and pushes the address of that slot in the
+ * vm's globals array on the stack. */
 static inline void handle_op_get_global_ptr(VM *vm, Bytecode *code,
-                                            uint8_t **ip) {
-  uint32_t name_idx = READ_UINT32();
-  Object *object_ptr =
-      table_get_unchecked(&vm->globals, code->sp.data[name_idx]);
-  push(vm, PTR_VAL(object_ptr));
+                                            uint8_t **ip, Stack *stack) {
+  uint32_t slot = READ_OPERAND();
+  push(stack, PTR_VAL(&vm->globals[slot]));
 }
 
-/* OP_DEEPSET reads a 4-byte index (1-based) of the obj-
- * ect being modified, which is adjusted and used to set
- * the object in that position to the popped object.
+/* OP_DEEPSET reads an index of the object being modi-
+ * fied, relative to the frame pointer 'fp', and sets the
+ * object in that position to the popped object.
  *
  * REFCOUNTING: Since the object being set will be over-
  * written, its reference count must be decremented bef-
  * ore putting the popped object into that position. */
-static inline void handle_op_deepset(VM *vm, Bytecode *code, uint8_t **ip) {
-  uint32_t idx = READ_UINT32();
-  uint32_t adjusted_idx = adjust_idx(vm, idx);
-  Object obj = pop(vm);
-  objdecref(&vm->stack[adjusted_idx]);
-  vm->stack[adjusted_idx] = obj;
+static inline void handle_op_deepset(VM *vm, Bytecode *code, uint8_t **ip,
+                                     Stack *stack) {
+  uint32_t idx = READ_OPERAND();
+  Object obj = pop(stack);
+  objdecref(&stack->fp[idx]);
+  stack->fp[idx] = obj;
 }
 
 /* OP_DEREFSET pops two objects off the stack which are
@@ -509,72 +701,107 @@ static inline void handle_op_deepset(VM *vm, Bytecode *code, uint8_t **ip) {
  * REFCOUNTING: We do NOT need to incref/decref the obj-
  * ect here because we're merely moving it from one loc-
  * ation to another. */
-static inline void handle_op_derefset(VM *vm, Bytecode *code, uint8_t **ip) {
-  Object item = pop(vm);
-  Object ptr = pop(vm);
+static inline void handle_op_derefset(VM *vm, Bytecode *code, uint8_t **ip,
+                                      Stack *stack) {
+  Object item = pop(stack);
+  Object ptr = pop(stack);
 
   *AS_PTR(ptr) = item;
 }
 
-/* OP_DEEPGET reads a 4-byte index (1-based) of the obj-
- * ect being accessed, which is adjusted and used to get
- * the object in that position and push it on the stack.
+/* OP_DEEPGET reads an index of the object being acc-
+ * essed, relative to the frame pointer 'fp', and pushes
+ * the object in that position on the stack.
  *
  * REFCOUNTING: Since the object being accessed will now
  * be available in yet another location, we need to inc-
  * rement its refcount. */
-static inline void handle_op_deepget(VM *vm, Bytecode *code, uint8_t **ip) {
-  uint32_t idx = READ_UINT32();
-  uint32_t adjusted_idx = adjust_idx(vm, idx);
-  Object obj = vm->stack[adjusted_idx];
-  push(vm, obj);
+static inline void handle_op_deepget(VM *vm, Bytecode *code, uint8_t **ip,
+                                     Stack *stack) {
+  uint32_t idx = READ_OPERAND();
+  Object obj = stack->fp[idx];
+  push(stack, obj);
   objincref(&obj);
 }
 
-/* OP_DEEPGET_PTR reads a 4-byte index (1-based) of the
- * object being accessed, which is adjusted and used to
- * access the object in that position and push its add-
- * ress on the stack. */
-static inline void handle_op_deepget_ptr(VM *vm, Bytecode *code, uint8_t **ip) {
-  uint32_t idx = READ_UINT32();
-  uint32_t adjusted_idx = adjust_idx(vm, idx);
-  Object *object_ptr = &vm->stack[adjusted_idx];
-  push(vm, PTR_VAL(object_ptr));
+/* OP_DEEPGET_PTR reads an index of the object being
+ * accessed, relative to the frame pointer 'fp', and pu-
+ * shes the address of the object in that position on
+ * the stack. */
+static inline void handle_op_deepget_ptr(VM *vm, Bytecode *code, uint8_t **ip,
+                                         Stack *stack) {
+  uint32_t idx = READ_OPERAND();
+  push(stack, PTR_VAL(&stack->fp[idx]));
 }
 
-/* OP_SETATTR reads a 4-byte index of the property name in
- * the chunk's sp, pops two objects off the stack (a value
- * of the property, and the object being modified) and in-
- * serts the value into the object's properties Table. Th-
- * en it pushes the modified object back on the stack.
+/* Look up the index of the property whose name is at 'name_idx' in
+ * the sp on the struct 'obj', going through the inline cache at
+ * 'cache_idx'.
  *
- * SAFETY: the handler will try to ensure that the accessed
- * property is defined on the object being modified. */
-static inline void handle_op_setattr(VM *vm, Bytecode *code, uint8_t **ip) {
-  uint32_t property_name_idx = READ_UINT32();
-
-  Object value = pop(vm);
-  Object obj = pop(vm);
+ * If the cache saw the same blueprint the last time around (a hit),
+ * the index it remembered is returned straight away. Otherwise (a
+ * miss), the property is looked up by name on the blueprint of the
+ * struct, and the cache is updated to remember the result.
+ *
+ * SAFETY: the function will try to ensure that the accessed property
+ * is defined on the struct. */
+static inline uint32_t resolve_property(VM *vm, Bytecode *code, Struct *obj,
+                                        uint32_t name_idx, uint32_t cache_idx) {
+  PropertyCache *cache = &code->property_caches.data[cache_idx];
+  if (cache->blueprint == obj->blueprint) {
+#ifdef venom_debug_ic
+    vm->property_cache_hits++;
+#endif
+    return cache->idx;
+  }
 
-  StructBlueprint *sb =
-      table_get_unchecked(vm->blueprints, AS_STRUCT(obj)->name);
+#ifdef venom_debug_ic
+  vm->property_cache_misses++;
+#endif
 
-  int *idx = table_get(sb->property_indexes, code->sp.data[property_name_idx]);
+  int *idx = TABLE_GET_NAME(obj->blueprint->property_indexes, name_idx);
   if (!idx) {
-    RUNTIME_ERROR("struct '%s' does not have property '%s'",
-                  AS_STRUCT(obj)->name, code->sp.data[property_name_idx]);
+    RUNTIME_ERROR("struct '%s' does not have property '%s'", obj->name,
+                  code->sp.data[name_idx]);
   }
 
-  AS_STRUCT(obj)->properties[*idx] = value;
+  cache->blueprint = obj->blueprint;
+  cache->idx = *idx;
+
+  return *idx;
+}
+
+/* OP_SETATTR reads an index of the property name in
+ * the chunk's sp and an index of its inline cache,
+ * pops two objects off the stack (a value of the property,
+ * and the object being modified) and stores the value into
+ * the object's properties. Then it pushes the modified ob-
+ * ject back on the stack.
+ *
+ * SAFETY: the handler will try to ensure that the accessed
+ * property is defined on the object being modified. */
+static inline void handle_op_setattr(VM *vm, Bytecode *code, uint8_t **ip,
+                                     Stack *stack) {
+  uint32_t property_name_idx = READ_OPERAND();
+  uint32_t cache_idx = READ_OPERAND();
+
+  Object value = pop(stack);
+  Object obj = pop(stack);
+
+  uint32_t idx = resolve_property(vm, code, AS_STRUCT(obj), property_name_idx,
+                                  cache_idx);
 
-  push(vm, obj);
+  AS_STRUCT(obj)->properties[idx] = value;
+
+  push(stack, obj);
 }
 
-/* OP_GETATTR reads a 4-byte index of the property name in
- * the sp. Then, it pops an object off the stack, and loo-
- * ks up the property with that name in its properties Ta-
- * ble. If the property is found, it will be pushed on the
- * stack. Otherwise, a runtime error is raised.
+/* OP_GETATTR reads an index of the property name in
+ * the sp and an index of its inline cache. Then, it
+ * pops an object off the stack, and looks up the property
+ * with that name on it. If the property is found, it will
+ * be pushed on the stack. Otherwise, a runtime error is
+ * raised.
  *
  * REFCOUNTING:
  *
@@ -583,68 +810,64 @@ static inline void handle_op_setattr(VM *vm, Bytecode *code, uint8_t **ip) {
  *
  * Since the popped object will no longer present at the
  * location, its refcount must be decremented. */
-static inline void handle_op_getattr(VM *vm, Bytecode *code, uint8_t **ip) {
-  uint32_t property_name_idx = READ_UINT32();
-  Object obj = pop(vm);
+static inline void handle_op_getattr(VM *vm, Bytecode *code, uint8_t **ip,
+                                     Stack *stack) {
+  uint32_t property_name_idx = READ_OPERAND();
+  uint32_t cache_idx = READ_OPERAND();
+  Object obj = pop(stack);
 
-  StructBlueprint *sb =
-      table_get_unchecked(vm->blueprints, AS_STRUCT(obj)->name);
-  int *idx = table_get(sb->property_indexes, code->sp.data[property_name_idx]);
-  if (!idx) {
-    RUNTIME_ERROR("struct '%s' does not have property '%s'",
-                  AS_STRUCT(obj)->name, code->sp.data[property_name_idx]);
-  }
+  uint32_t idx = resolve_property(vm, code, AS_STRUCT(obj), property_name_idx,
+                                  cache_idx);
 
-  Object property = AS_STRUCT(obj)->properties[*idx];
+  Object property = AS_STRUCT(obj)->properties[idx];
 
-  push(vm, property);
+  push(stack, property);
   objincref(&property);
   objdecref(&obj);
 }
 
-/* OP_GETATTR_PTR reads a 4-byte index of the property name
- * in the chunk's sp. Then, it pops an object off the stack
- * and looks up the property with that name in the object's
- * properties Table. If the property is found, a pointer to
- * it is pushed on the stack (conveniently, table_get() re-
- * turns a pointer). Otherwise, a runtime error is raised.
+/* OP_GETATTR_PTR reads an index of the property name
+ * in the chunk's sp and an index of its inline cache.
+ * Then, it pops an object off the stack and looks up the
+ * property with that name on it. If the property is found,
+ * a pointer to it is pushed on the stack. Otherwise, a ru-
+ * ntime error is raised.
  *
  * REFCOUNTING: Since the popped object will no longer pre-
  * sent at that location, its refcount must be decremented. */
-static inline void handle_op_getattr_ptr(VM *vm, Bytecode *code, uint8_t **ip) {
-  uint32_t property_name_idx = READ_UINT32();
-  Object object = pop(vm);
+static inline void handle_op_getattr_ptr(VM *vm, Bytecode *code, uint8_t **ip,
+                                         Stack *stack) {
+  uint32_t property_name_idx = READ_OPERAND();
+  uint32_t cache_idx = READ_OPERAND();
+  Object object = pop(stack);
 
-  StructBlueprint *sb =
-      table_get_unchecked(vm->blueprints, AS_STRUCT(object)->name);
-  int *idx = table_get(sb->property_indexes, code->sp.data[property_name_idx]);
-  if (!idx) {
-    RUNTIME_ERROR("struct '%s' does not have property '%s'",
-                  AS_STRUCT(object)->name, code->sp.data[property_name_idx]);
-  }
+  uint32_t idx = resolve_property(vm, code, AS_STRUCT(object),
+                                  property_name_idx, cache_idx);
 
-  Object *property = &AS_STRUCT(object)->properties[*idx];
-  push(vm, PTR_VAL(property));
+  Object *property = &AS_STRUCT(object)->properties[idx];
+  push(stack, PTR_VAL(property));
 
   objdecref(&object);
 }
 
-/* OP_STRUCT reads a 4-byte index of the struct name in the
+/* OP_STRUCT reads an index of the struct name in the
  * sp, constructs a struct object with that name and refco-
  * unt set to 1 (while making sure to initialize the prope-
  * rties table properly), and pushes it on the stack.
  *
  * REFCOUNTING: Since Structs are refcounted, the newly co-
  * nstructed object has a refcount=1. */
-static inline void handle_op_struct(VM *vm, Bytecode *code, uint8_t **ip) {
-  uint32_t structname = READ_UINT32();
+static inline void handle_op_struct(VM *vm, Bytecode *code, uint8_t **ip,
+                                    Stack *stack) {
+  uint32_t structname = READ_OPERAND();
 
-  StructBlueprint *sb = table_get(vm->blueprints, code->sp.data[structname]);
+  StructBlueprint *sb = TABLE_GET_NAME(vm->blueprints, structname);
   if (!sb) {
     RUNTIME_ERROR("struct '%s' is not defined", code->sp.data[structname]);
   }
 
   Struct s = {.name = code->sp.data[structname],
+              .blueprint = sb,
               .propcount = sb->property_indexes->count,
               .refcount = 1,
               .properties =
@@ -654,11 +877,11 @@ static inline void handle_op_struct(VM *vm, Bytecode *code, uint8_t **ip) {
     s.properties[i] = NULL_VAL;
   }
 
-  push(vm, STRUCT_VAL(ALLOC(s)));
+  push(stack, STRUCT_VAL(ALLOC(s)));
 }
 
-/* OP_STRUCT_BLUEPRINT reads a 4-byte name index of the
- * struct name in the sp, then it reads a 4-byte prope-
+/* OP_STRUCT_BLUEPRINT reads a name index of the
+ * struct name in the sp, then it reads a prope-
  * rty count of the said struct (let's call this propc-
  * ount). Then, it loops 'propcount' times and for each
  * property, it reads the name index in the sp, and pr-
@@ -668,15 +891,15 @@ static inline void handle_op_struct(VM *vm, Bytecode *code, uint8_t **ip) {
  * properly, and insert it into the vm's blueprints ta-
  * ble. */
 static inline void handle_op_struct_blueprint(VM *vm, Bytecode *code,
-                                              uint8_t **ip) {
-  uint32_t name_idx = READ_UINT32();
-  uint32_t propcount = READ_UINT32();
+                                              uint8_t **ip, Stack *stack) {
+  uint32_t name_idx = READ_OPERAND();
+  uint32_t propcount = READ_OPERAND();
 
   DynArray_char_ptr properties = {0};
   DynArray_uint32_t prop_indexes = {0};
   for (size_t i = 0; i < propcount; i++) {
-    dynarray_insert(&properties, code->sp.data[READ_UINT32()]);
-    dynarray_insert(&prop_indexes, READ_UINT32());
+    dynarray_insert(&properties, code->sp.data[READ_OPERAND()]);
+    dynarray_insert(&prop_indexes, READ_OPERAND());
   }
 
   StructBlueprint sb = {.name = code->sp.data[name_idx],
@@ -696,44 +919,95 @@ static inline void handle_op_struct_blueprint(VM *vm, Bytecode *code,
   dynarray_free(&prop_indexes);
 }
 
-/* OP_CALL reads a 4-byte number uses it to construct a BytecodePtr
- * object and push it on the frame pointer stack.
+/* OP_CALL reads an argument count and the location of the
+ * function being called. It constructs a BytecodePtr object
+ * and pushes it on the frame pointer stack, points the frame
+ * pointer 'fp' at the start of the new frame, and jumps to one
+ * byte before the function location, so there is only a single
+ * dispatch per call.
  *
- * The address the BytecodePtr points to is the one of the next in-
- * struction that comes after the jump following the opcode and its
- * 4-byte operand.
+ * The address the BytecodePtr points to is the last byte of this
+ * instruction, which is where OP_RET leaves the ip.
  *
  * The location is the starting position of the frame on the stack. */
-static inline void handle_op_call(VM *vm, Bytecode *code, uint8_t **ip) {
-  uint32_t argcount = READ_UINT32();
+#ifdef JIT
+/* Count the call to the function at 'location' that OP_CALL is about
+ * to make, and compile the function once it gets hot (see jit.c). If
+ * the function has been compiled, it is called natively, and true is
+ * returned, with the result of the call in place of the arguments, as
+ * if OP_RET had run. */
+static inline bool call_native(VM *vm, Bytecode *code, Stack *stack,
+                               uint32_t location, uint32_t argcount) {
+  Function *function = vm->jit.functions[location];
+
+  if (!function) {
+    return false;
+  }
 
-  /* Take into account the jump sequence ahead of us (+3). */
-  BytecodePtr ip_obj = {.addr = *(ip) + 3, .location = vm->tos - argcount};
-  vm->fp_stack[vm->fp_count++] = ip_obj;
+  if (!function->native) {
+    if (++function->calls != JIT_THRESHOLD ||
+        !jit_compile(&vm->jit, code, function)) {
+      return false;
+    }
+  }
+
+  Object *frame = stack->sp - argcount;
+  ((JitFunction)function->native)(frame);
+  stack->sp = frame + 1;
+  return true;
 }
+#endif
 
-/* OP_CALL_METHOD reads a 4-byte method name idx in the sp. Then,
- * it pops an object off the stack and looks up the method on it.
- * If the method exists, it performs the function call dance, but
- * this time, it uses a direct jump to one byte before the method
- * location. Besides, the fp it pushes on the stack does not need
- * to take into account the jump sequence ahead of it, because it
- * is not there -- the jump is performed by this instruction. */
-static inline void handle_op_call_method(VM *vm, Bytecode *code, uint8_t **ip) {
-  uint32_t method_name_idx = READ_UINT32();
-  uint32_t argcount = READ_UINT32();
+static inline void handle_op_call(VM *vm, Bytecode *code, uint8_t **ip,
+                                  Stack *stack) {
+  uint32_t argcount = READ_OPERAND();
+  uint32_t location = READ_OPERAND();
 
-  Object object = peek(vm, argcount);
+#ifdef JIT
+  if (call_native(vm, code, stack, location, argcount)) {
+    return;
+  }
+#endif
+
+  stack->fp = stack->sp - argcount;
+  BytecodePtr ip_obj = {.addr = *ip, .location = stack->fp - vm->stack};
+  vm->fp_stack[vm->fp_count++] = ip_obj;
+
+  *ip = &code->code.data[location - 1];
+}
 
-  /* Get the blueprint from the vm->blueprints table. */
-  StructBlueprint *sb =
-      table_get_unchecked(vm->blueprints, AS_STRUCT(object)->name);
+/* Find the method whose name is at 'method_name_idx' in the sp on
+ * the blueprint 'sb', going through the inline cache 'cache'.
+ *
+ * The monomorphic entry is checked first, then the rest of the po-
+ * lymorphic entries. If none of them match, the method is looked up
+ * by name on the blueprint, its arity is checked against 'argcount'
+ * and, unless the site already went megamorphic, a new entry is ma-
+ * de for it. Since the argcount is the same for every call made at
+ * the site, a hit does not need to check the arity again. */
+static inline MethodCacheEntry *resolve_method(VM *vm, Bytecode *code,
+                                               MethodCache *cache,
+                                               StructBlueprint *sb,
+                                               uint32_t method_name_idx,
+                                               uint32_t argcount) {
+  for (size_t i = 0; i < cache->count; i++) {
+    if (cache->entries[i].blueprint == sb) {
+#ifdef venom_debug_ic
+      vm->method_cache_hits++;
+#endif
+      return &cache->entries[i];
+    }
+  }
+
+#ifdef venom_debug_ic
+  vm->method_cache_misses++;
+#endif
 
   /* Look up the method with that name on the blueprint. */
-  Function *method = table_get(sb->methods, code->sp.data[method_name_idx]);
+  Function *method = TABLE_GET_NAME(sb->methods, method_name_idx);
   if (!method) {
     RUNTIME_ERROR("method '%s' is not defined on struct '%s'.",
-                  code->sp.data[method_name_idx], AS_STRUCT(object)->name);
+                  code->sp.data[method_name_idx], sb->name);
   }
 
   /* If the argcount doesn't match the paramcount (-1 for self), bail out. */
@@ -742,37 +1016,153 @@ static inline void handle_op_call_method(VM *vm, Bytecode *code, uint8_t **ip) {
                   method->name, method->paramcount - 1, argcount);
   }
 
-  /* Push the instruction pointer on the frame ptr stack.
-   * No need to take into account the jump sequence (+3). */
-  BytecodePtr ip_obj = {.addr = *ip, .location = vm->tos - method->paramcount};
+  MethodCacheEntry entry = {.blueprint = sb,
+                            .location = method->location,
+                            .paramcount = method->paramcount};
+
+  if (cache->count < METHOD_CACHE_SIZE) {
+    cache->entries[cache->count] = entry;
+    return &cache->entries[cache->count++];
+  }
+
+  /* The site is megamorphic, so there is nowhere to put the entry. */
+  vm->megamorphic_entry = entry;
+  return &vm->megamorphic_entry;
+}
+
+/* OP_CALL_METHOD reads a method name idx in the sp, an
+ * argument count, and an index of the site's inline cache. It
+ * then peeks at the object the method is called on and looks up the
+ * method on it through the cache. If the method exists, it performs
+ * the same function call dance as OP_CALL, with the location of the
+ * method that was looked up. */
+static inline void handle_op_call_method(VM *vm, Bytecode *code, uint8_t **ip,
+                                         Stack *stack) {
+  uint32_t method_name_idx = READ_OPERAND();
+  uint32_t argcount = READ_OPERAND();
+  uint32_t cache_idx = READ_OPERAND();
+
+  Object object = peek(stack, argcount);
+
+  MethodCacheEntry *method =
+      resolve_method(vm, code, &code->method_caches.data[cache_idx],
+                     AS_STRUCT(object)->blueprint, method_name_idx, argcount);
+
+  /* Push the instruction pointer on the frame ptr stack. */
+  stack->fp = stack->sp - method->paramcount;
+  BytecodePtr ip_obj = {.addr = *ip, .location = stack->fp - vm->stack};
   vm->fp_stack[vm->fp_count++] = ip_obj;
 
   /* Direct jump to one byte before the method location. */
   *ip = &code->code.data[method->location - 1];
 }
 
-/* OP_IMPL reads a 4-byte blueprint name idx in the sp,
- * and a 4-byte method count. Then, for each method, it
- * reads a 4-byte method name index, a 4-byte param co-
- * unt for the method, and a 4-byte location of the me-
+/* Drop the frame at 'fp' below the 'count' objects at 'args' (the
+ * parameters, the locals and the temporaries of the function that
+ * makes a tail call), and move those objects, the arguments of the
+ * call, down to the start of the frame, where the callee expects its
+ * parameters. Returns the new stack pointer. */
+static inline Object *replace_frame(Object *fp, Object *args,
+                                    uint32_t count) {
+  for (Object *obj = fp; obj < args; obj++) {
+    if (__builtin_expect(IS_REFCOUNTED(*obj), 0)) {
+      objdecref(obj);
+    }
+  }
+  memmove(fp, args, count * sizeof(Object));
+  return fp + count;
+}
+
+/* Where the interpreter picks up after a tail call. */
+typedef struct {
+  uint8_t *ip;
+  Object *sp;
+} TailCall;
+
+/* OP_TAILCALL has the same operands as OP_CALL, and OP_TAILCALL_METHOD
+ * the same as OP_CALL_METHOD. Since the result of the call is return-
+ * ed right away, the callee takes over the frame of the caller inst-
+ * ead of pushing a frame of its own, and it will return straight to
+ * the caller's caller. This way, the recursion that goes through tail
+ * calls runs in constant space.
+ *
+ * Both are handled here, out of run(), for the same reason as forlo-
+ * op(): inlined, they are enough to get 'ip' spilled in the hot hand-
+ * lers, and they only run once per call anyway. */
+__attribute__((noinline)) static TailCall tailcall(VM *vm, Bytecode *code,
+                                                   uint8_t *pc, Object *fp,
+                                                   Object *sp) {
+  uint8_t **ip = &pc;
+  uint32_t location, paramcount;
+
+  if (*pc == OP_TAILCALL) {
+    paramcount = READ_OPERAND();
+    location = READ_OPERAND();
+  } else {
+    uint32_t method_name_idx = READ_OPERAND();
+    uint32_t argcount = READ_OPERAND();
+    uint32_t cache_idx = READ_OPERAND();
+
+    Object object = sp[-1 - (int)argcount];
+
+    MethodCacheEntry *method = resolve_method(
+        vm, code, &code->method_caches.data[cache_idx],
+        AS_STRUCT(object)->blueprint, method_name_idx, argcount);
+
+    location = method->location;
+    paramcount = method->paramcount;
+  }
+
+  sp = replace_frame(fp, sp - paramcount, paramcount);
+
+  return (TailCall){.ip = &code->code.data[location - 1], .sp = sp};
+}
+
+static inline void handle_op_ret(VM *vm, Bytecode *code, uint8_t **ip,
+                                 Stack *stack);
+
+static inline void handle_op_tailcall(VM *vm, Bytecode *code, uint8_t **ip,
+                                      Stack *stack) {
+#ifdef JIT
+  /* A native call comes back, so the frame is returned from here. */
+  if (**ip == OP_TAILCALL) {
+    uint8_t *pc = *ip;
+    uint32_t argcount = read_operand(&pc);
+    uint32_t location = read_operand(&pc);
+    if (call_native(vm, code, stack, location, argcount)) {
+      handle_op_ret(vm, code, ip, stack);
+      return;
+    }
+  }
+#endif
+
+  TailCall tc = tailcall(vm, code, *ip, stack->fp, stack->sp);
+  stack->sp = tc.sp;
+  *ip = tc.ip;
+}
+
+/* OP_IMPL reads a blueprint name idx in the sp,
+ * and a method count. Then, for each method, it
+ * reads a method name index, a param co-
+ * unt for the method, and a location of the me-
  * thod in the bytecode. Then, it constructs a Function
  * object with all this information and inserts it into
  * the blueprint's methods Table. */
-static inline void handle_op_impl(VM *vm, Bytecode *code, uint8_t **ip) {
-  uint32_t blueprint_name_idx = READ_UINT32();
-  uint32_t method_count = READ_UINT32();
+static inline void handle_op_impl(VM *vm, Bytecode *code, uint8_t **ip,
+                                  Stack *stack) {
+  uint32_t blueprint_name_idx = READ_OPERAND();
+  uint32_t method_count = READ_OPERAND();
 
-  StructBlueprint *sb =
-      table_get(vm->blueprints, code->sp.data[blueprint_name_idx]);
+  StructBlueprint *sb = TABLE_GET_NAME(vm->blueprints, blueprint_name_idx);
   if (!sb) {
     RUNTIME_ERROR("struct '%s' is not defined",
                   code->sp.data[blueprint_name_idx]);
   }
 
   for (size_t i = 0; i < method_count; i++) {
-    uint32_t method_name_idx = READ_UINT32();
-    uint32_t paramcount = READ_UINT32();
-    uint32_t location = READ_UINT32();
+    uint32_t method_name_idx = READ_OPERAND();
+    uint32_t paramcount = READ_OPERAND();
+    uint32_t location = READ_OPERAND();
 
     Function method = {
         .location = location,
@@ -784,20 +1174,43 @@ static inline void handle_op_impl(VM *vm, Bytecode *code, uint8_t **ip) {
   }
 }
 
-/* OP_RET pops a BytecodePtr off the frame pointer stack
- * and sets the instruction pointer to point to the add-
- * ress contained in the BytecodePtr. */
-static inline void handle_op_ret(VM *vm, Bytecode *code, uint8_t **ip) {
-  BytecodePtr retaddr = vm->fp_stack[--vm->fp_count];
-  *ip = retaddr.addr;
+/* OP_RET pops the return value off the stack and a BytecodePtr
+ * off the frame pointer stack. It drops the whole frame at once,
+ * puts the return value at the start of it, where the caller ex-
+ * pects to find it, and sets the instruction pointer to point to
+ * the address contained in the BytecodePtr. The frame pointer 'fp'
+ * is then pointed back at the caller's frame.
+ *
+ * REFCOUNTING: Since the parameters, the locals and the tempor-
+ * aries in the frame are going away, their refcounts must be dec-
+ * remented. The return value is merely moved. */
+static inline void handle_op_ret(VM *vm, Bytecode *code, uint8_t **ip,
+                                 Stack *stack) {
+  Object retval = pop(stack);
+  Object *top = stack->sp;
+  for (Object *obj = stack->fp; obj < top; obj++) {
+    /* Most of the frame is usually numbers, so the refcounted objects
+     * are kept off the fall-through path of the loop. */
+    if (__builtin_expect(IS_REFCOUNTED(*obj), 0)) {
+      objdecref(obj);
+    }
+  }
+  *stack->fp = retval;
+  stack->sp = stack->fp + 1;
+
+  *ip = vm->fp_stack[--vm->fp_count].addr;
+  stack->fp = vm->fp_count > 0
+                  ? &vm->stack[vm->fp_stack[vm->fp_count - 1].location]
+                  : vm->stack;
 }
 
 /* OP_POP pops an object off the stack.
  *
  * REFCOUNTING: Since the popped object might be refcounted,
  * its refcount must be decremented. */
-static inline void handle_op_pop(VM *vm, Bytecode *code, uint8_t **ip) {
-  Object obj = pop(vm);
+static inline void handle_op_pop(VM *vm, Bytecode *code, uint8_t **ip,
+                                 Stack *stack) {
+  Object obj = pop(stack);
   objdecref(&obj);
 }
 
@@ -806,60 +1219,73 @@ static inline void handle_op_pop(VM *vm, Bytecode *code, uint8_t **ip) {
  *
  * REFCOUNTING: Since the object will now be present in one
  * more another location, its refcount must be incremented. */
-static inline void handle_op_deref(VM *vm, Bytecode *code, uint8_t **ip) {
-  Object ptrobj = pop(vm);
+static inline void handle_op_deref(VM *vm, Bytecode *code, uint8_t **ip,
+                                   Stack *stack) {
+  Object ptrobj = pop(stack);
 
-  push(vm, *AS_PTR(ptrobj));
+  push(stack, *AS_PTR(ptrobj));
   objincref(&*AS_PTR(ptrobj));
 }
 
-/* OP_STRCAT pops two objects off the stack, checks whether they
- * are both strings and if so, concatenates them, and pushes the
- * resulting string back on the stack.
+/* Replace the two strings on top of the stack with their concatenat-
+ * ion, and return the new stack pointer. The left string is appended
+ * to in place (see append_in_place()) if the stack holds the only ref-
+ * erence to it, or if the only other one is held by 'local', which is
+ * about to be overwritten with the result. This is kept out of run()
+ * for the same reason that forloop() is.
  *
- * REFCOUNTING:
- *
- * Since Strings are refcounted objects, their refcounts must be
- * decremented.
- *
- * The resulting string is initalized with the refcount of 1. */
-static inline void handle_op_strcat(VM *vm, Bytecode *code, uint8_t **ip) {
-  Object b = pop(vm);
-  Object a = pop(vm);
-
-  if (IS_STRING(a) && IS_STRING(b)) {
-    char *result =
-        concatenate_strings(AS_STRING(a)->value, AS_STRING(b)->value);
-
-    String s = {.refcount = 1, .value = result};
+ * REFCOUNTING: The strings that were on the stack are decremented,
+ * except for the left one when it is the result. A new string starts
+ * out with a refcount of 1. */
+__attribute__((noinline)) static Object *concatenate_on_stack(Object *sp,
+                                                              Object *local) {
+  Object a = sp[-2];
+  Object b = sp[-1];
+  if (!IS_STRING(a) || !IS_STRING(b)) {
+    unsupported_types("++", a, b);
+  }
 
-    push(vm, STRING_VAL(ALLOC(s)));
+  /* An immortal string has a refcount of 1 too, but that reference
+   * belongs to vm->strings, not to the stack. */
+  String *left = AS_STRING(a);
+  bool unique = IS_REFCOUNTED(a) &&
+                (left->refcount == 1 ||
+                 (left->refcount == 2 && local && IS_STRING(*local) &&
+                  AS_STRING(*local) == left));
 
-    objdecref(&b);
+  if (!unique || !append_in_place(left, AS_STRING(b))) {
+    sp[-2] = STRING_VAL(concatenate_strings(left, AS_STRING(b)));
     objdecref(&a);
-  } else {
-    RUNTIME_ERROR(
-        "'++' operator used on objects of unsupported types: %s and %s",
-        get_object_type(&a), get_object_type(&b));
   }
+  objdecref(&b);
+  return sp - 1;
 }
 
-/* OP_ARRAY reads a 4-byte count of the array elements, pops that many ele-
+/* OP_STRCAT pops two objects off the stack, checks whether they
+ * are both strings and if so, concatenates them, and pushes the
+ * resulting string back on the stack. */
+static inline void handle_op_strcat(VM *vm, Bytecode *code, uint8_t **ip,
+                                    Stack *stack) {
+  stack->sp = concatenate_on_stack(stack->sp, NULL);
+}
+
+/* OP_ARRAY reads a count of the array elements, pops that many ele-
  * ments off the stack, inserts them into a dynarray, creates an Array obj-
  * ect, and pushes it on the stack.
  *
  * REFCOUNTING: Since Arrays are refcounted, the new object has refcount=1. */
-static inline void handle_op_array(VM *vm, Bytecode *code, uint8_t **ip) {
-  uint32_t count = READ_UINT32();
+static inline void handle_op_array(VM *vm, Bytecode *code, uint8_t **ip,
+                                   Stack *stack) {
+  uint32_t count = READ_OPERAND();
 
   DynArray_Object elements = {0};
   for (size_t i = 0; i < count; i++) {
-    dynarray_insert(&elements, pop(vm));
+    dynarray_insert(&elements, pop(stack));
   }
 
   Array array = {.refcount = 1, .elements = elements};
 
-  push(vm, ARRAY_VAL(ALLOC(array)));
+  push(stack, ARRAY_VAL(ALLOC(array)));
 }
 
 /* OP_ARRAYSET pops three objects off the stack: the index, the array object,
@@ -868,10 +1294,11 @@ static inline void handle_op_array(VM *vm, Bytecode *code, uint8_t **ip) {
  *
  * REFCOUNTING: We need to make sure to decrement the refcount for the popped
  * array, since arrays are refcounted objects. */
-static inline void handle_op_arrayset(VM *vm, Bytecode *code, uint8_t **ip) {
-  Object value = pop(vm);
-  Object index = pop(vm);
-  Object subscriptee = pop(vm);
+static inline void handle_op_arrayset(VM *vm, Bytecode *code, uint8_t **ip,
+                                      Stack *stack) {
+  Object value = pop(stack);
+  Object index = pop(stack);
+  Object subscriptee = pop(stack);
   Array *array = AS_ARRAY(subscriptee);
   array->elements.data[(int)AS_NUM(index)] = value;
   objdecref(&subscriptee);
@@ -884,15 +1311,257 @@ static inline void handle_op_arrayset(VM *vm, Bytecode *code, uint8_t **ip) {
  * REFCOUNTING: We need to make sure to decrement the refcount for the po-
  * pped array, and increment the refcount for the object we are pushing on
  * the stack. */
-static inline void handle_op_subscript(VM *vm, Bytecode *code, uint8_t **ip) {
-  Object index = pop(vm);
-  Object object = pop(vm);
+static inline void handle_op_subscript(VM *vm, Bytecode *code, uint8_t **ip,
+                                       Stack *stack) {
+  Object index = pop(stack);
+  Object object = pop(stack);
   Object value = AS_ARRAY(object)->elements.data[(int)AS_NUM(index)];
-  push(vm, value);
+  push(stack, value);
   objincref(&value);
   objdecref(&object);
 }
 
+/* The handlers of the superinstructions below are entered with the
+ * ip pointing to the fused opcode, which replaced the opcode of the
+ * first instruction in the sequence. They read the operands of every
+ * instruction in the sequence, skipping over the opcodes in between,
+ * and leave the ip on the last byte of the sequence, just like the
+ * handlers of the individual instructions would. The ones that do
+ * arithmetic or comparisons check that their operands are numbers,
+ * like the generic forms of those instructions do. */
+#define SKIP_OPCODE() (++(*ip))
+
+/* OP_DEEPADD_CONST is 'local += const' (DEEPGET idx, CONST, ADD,
+ * DEEPSET idx), which adds the constant to the local in place.
+ *
+ * SAFETY: A runtime error is raised if the local is not a number.
+ *
+ * REFCOUNTING: The object being overwritten must be decremented,
+ * same as in OP_DEEPSET. */
+static inline void handle_op_deepadd_const(VM *vm, Bytecode *code,
+                                           uint8_t **ip, Stack *stack) {
+  uint32_t idx = READ_OPERAND();
+  SKIP_OPCODE();
+  uint32_t const_idx = READ_OPERAND();
+  SKIP_OPCODE();
+  SKIP_OPCODE();
+  READ_OPERAND();
+
+  Object *obj = &stack->fp[idx];
+  if (__builtin_expect(!IS_NUM(*obj), 0)) {
+    unsupported_types("+", *obj, NUM_VAL(code->cp.data[const_idx]));
+  }
+  Object result = NUM_VAL(AS_NUM(*obj) + code->cp.data[const_idx]);
+  objdecref(obj);
+  *obj = result;
+}
+
+/* OP_DEEPGET_CONST is OP_DEEPGET followed by OP_CONST. */
+static inline void handle_op_deepget_const(VM *vm, Bytecode *code,
+                                           uint8_t **ip, Stack *stack) {
+  handle_op_deepget(vm, code, ip, stack);
+  SKIP_OPCODE();
+  handle_op_const(vm, code, ip, stack);
+}
+
+/* OP_DEEPGET_DEEPGET is two OP_DEEPGETs in a row. */
+static inline void handle_op_deepget_deepget(VM *vm, Bytecode *code,
+                                             uint8_t **ip, Stack *stack) {
+  handle_op_deepget(vm, code, ip, stack);
+  SKIP_OPCODE();
+  handle_op_deepget(vm, code, ip, stack);
+}
+
+/* OP_ADD_DEEPSET is OP_ADD followed by OP_DEEPSET, which stores
+ * the sum straight into the local instead of pushing it first. */
+static inline void handle_op_add_deepset(VM *vm, Bytecode *code,
+                                         uint8_t **ip, Stack *stack) {
+  SKIP_OPCODE();
+  uint32_t idx = READ_OPERAND();
+  if (__builtin_expect(!NUMBERS_ON_TOP(), 0)) {
+    unsupported_types("+", peek(stack, 1), peek(stack, 0));
+  }
+  Object b = pop(stack);
+  Object a = pop(stack);
+  Object *obj = &stack->fp[idx];
+  objdecref(obj);
+  *obj = NUM_VAL(AS_NUM(a) + AS_NUM(b));
+}
+
+/* OP_STRCAT_DEEPSET is OP_STRCAT followed by OP_DEEPSET, which is
+ * how 's = s ++ x' and 's ++= x' end. The left string was pushed by
+ * an OP_DEEPGET of the local that the OP_DEEPSET is about to overwrite,
+ * so the reference of the local does not stand in the way of appending
+ * to the string in place (see concatenate_on_stack()). The OP_DEEPSET
+ * is left to run on its own. */
+static inline void handle_op_strcat_deepset(VM *vm, Bytecode *code,
+                                            uint8_t **ip, Stack *stack) {
+  stack->sp = concatenate_on_stack(stack->sp,
+                                   &stack->fp[operand_at(*ip + 1, 0)]);
+}
+
+/* OP_LT_JZ is OP_LT followed by OP_JZ. The comparison result is
+ * used for the jump right away, without going through the stack. */
+static inline void handle_op_lt_jz(VM *vm, Bytecode *code, uint8_t **ip,
+                                   Stack *stack) {
+  SKIP_OPCODE();
+  int32_t offset = READ_JUMP();
+  if (__builtin_expect(!NUMBERS_ON_TOP(), 0)) {
+    unsupported_types("<", peek(stack, 1), peek(stack, 0));
+  }
+  Object b = pop(stack);
+  Object a = pop(stack);
+  if (!(AS_NUM(a) < AS_NUM(b))) {
+    *ip += offset;
+  }
+}
+
+/* OP_GT_JZ is OP_GT followed by OP_JZ. */
+static inline void handle_op_gt_jz(VM *vm, Bytecode *code, uint8_t **ip,
+                                   Stack *stack) {
+  SKIP_OPCODE();
+  int32_t offset = READ_JUMP();
+  if (__builtin_expect(!NUMBERS_ON_TOP(), 0)) {
+    unsupported_types(">", peek(stack, 1), peek(stack, 0));
+  }
+  Object b = pop(stack);
+  Object a = pop(stack);
+  if (!(AS_NUM(a) > AS_NUM(b))) {
+    *ip += offset;
+  }
+}
+
+/* OP_TRUE_NOT is OP_TRUE followed by OP_NOT (the compiler emits
+ * it for 'false'), and it pushes 'false' on the stack. */
+static inline void handle_op_true_not(VM *vm, Bytecode *code, uint8_t **ip,
+                                      Stack *stack) {
+  SKIP_OPCODE();
+  push(stack, BOOL_VAL(false));
+}
+
+/* The tail of a counted loop (see compile_counted_loop()) is fused in-
+ * to one of the OP_FORLOOP instructions, which step the local by the
+ * constant, compare it against the bound, and then either jump back to
+ * the body or out of the loop. Since the tail is only fused if it has
+ * the short layout (see FORLOOP_LENGTH), the operands are at fixed
+ * offsets from the opcode:
+ *
+ *   0 DEEPGET idx    5 DEEPSET idx    11 LT
+ *   2 CONST step     7 DEEPGET idx    12 JZ exit
+ *   4 ADD            9 CONST/DEEPGET  15 JMP body
+ *                      bound
+ *
+ * This returns the instruction pointer to continue from. It is kept
+ * out of run() on purpose: inlined, it leaves the mainloop short of
+ * registers, and 'ip' and 'stack' get spilled in every other handler,
+ * which costs more than the call.
+ *
+ * SAFETY: A runtime error is raised if the local or the bound is not
+ * a number, as it would be by OP_ADD or OP_LT. */
+__attribute__((noinline)) static uint8_t *forloop(Bytecode *code, uint8_t *ip,
+                                                  Object *fp, Object bound) {
+  Object *obj = &fp[ip[1]];
+  double step = code->cp.data[ip[3]];
+  if (__builtin_expect(!IS_NUM(*obj), 0)) {
+    unsupported_types("+", *obj, NUM_VAL(step));
+  }
+  *obj = NUM_VAL(AS_NUM(*obj) + step);
+  if (__builtin_expect(!IS_NUM(bound), 0)) {
+    unsupported_types("<", *obj, bound);
+  }
+
+  int16_t offset;
+  if (AS_NUM(*obj) < AS_NUM(bound)) {
+    memcpy(&offset, ip + 16, sizeof(offset));
+    return ip + FORLOOP_LENGTH - 1 + offset;
+  }
+  memcpy(&offset, ip + 13, sizeof(offset));
+  return ip + 14 + offset;
+}
+
+/* OP_FORLOOP_CONST is the tail of a counted loop whose bound is a con-
+ * stant. The jump back to the body is where a trace of the loop can
+ * be entered, same as in OP_JMP. */
+static inline void handle_op_forloop_const(VM *vm, Bytecode *code,
+                                           uint8_t **ip, Stack *stack) {
+  uint8_t *start = *ip;
+  Object bound = NUM_VAL(code->cp.data[start[10]]);
+  *ip = forloop(code, start, stack->fp, bound);
+#ifdef JIT
+  if (*ip < start) {
+    run_trace(vm, code, ip, stack);
+  }
+#endif
+}
+
+/* OP_FORLOOP_DEEPGET is the tail of a counted loop whose bound is an-
+ * other local. */
+static inline void handle_op_forloop_deepget(VM *vm, Bytecode *code,
+                                             uint8_t **ip, Stack *stack) {
+  uint8_t *start = *ip;
+  *ip = forloop(code, start, stack->fp, stack->fp[start[10]]);
+#ifdef JIT
+  if (*ip < start) {
+    run_trace(vm, code, ip, stack);
+  }
+#endif
+}
+
+#undef SKIP_OPCODE
+
+#ifdef venom_debug_pairs
+/* Counts of how many times the opcode in the second dimension was
+ * dispatched right after the one in the first dimension. They are
+ * used to pick the sequences that are worth fusing into superins-
+ * tructions (build with opt=no_superinstructions to see the pairs
+ * the compiler emits, before any of them are fused). */
+static size_t pair_counts[UINT8_MAX + 1][UINT8_MAX + 1];
+
+typedef struct {
+  uint8_t first;
+  uint8_t second;
+  size_t count;
+} OpcodePair;
+
+static int compare_pairs(const void *a, const void *b) {
+  size_t count_a = ((const OpcodePair *)a)->count;
+  size_t count_b = ((const OpcodePair *)b)->count;
+  return (count_a < count_b) - (count_a > count_b);
+}
+
+static void print_pair_histogram(void) {
+  DynArray(OpcodePair) pairs = {0};
+  size_t total = 0;
+
+  for (size_t i = 0; i <= UINT8_MAX; i++) {
+    for (size_t j = 0; j <= UINT8_MAX; j++) {
+      if (pair_counts[i][j] > 0) {
+        OpcodePair pair = {.first = i, .second = j, .count = pair_counts[i][j]};
+        dynarray_insert(&pairs, pair);
+        total += pair_counts[i][j];
+      }
+    }
+  }
+
+  qsort(pairs.data, pairs.count, sizeof(OpcodePair), compare_pairs);
+
+  fprintf(stderr, "opcode pairs (%zu dispatches):\n", total);
+  for (size_t i = 0; i < pairs.count; i++) {
+    fprintf(stderr, "%12zu %6.2f%%  %s, %s\n", pairs.data[i].count,
+            100.0 * pairs.data[i].count / total,
+            opcode_name(pairs.data[i].first),
+            opcode_name(pairs.data[i].second));
+  }
+
+  dynarray_free(&pairs);
+}
+
+#define COUNT_PAIR()                                                           \
+  (pair_counts[prev_opcode][ip[1]]++, prev_opcode = ip[1])
+#else
+#define COUNT_PAIR()
+#endif
+
 #ifdef venom_debug_vm
 static inline const char *print_current_instruction(uint8_t opcode) {
   switch (opcode) {
@@ -970,6 +1639,10 @@ static inline const char *print_current_instruction(uint8_t opcode) {
     return "OP_CALL";
   case OP_CALL_METHOD:
     return "OP_CALL_METHOD";
+  case OP_TAILCALL:
+    return "OP_TAILCALL";
+  case OP_TAILCALL_METHOD:
+    return "OP_TAILCALL_METHOD";
   case OP_RET:
     return "OP_RET";
   case OP_POP:
@@ -988,6 +1661,44 @@ static inline const char *print_current_instruction(uint8_t opcode) {
     return "OP_SUBSCRIPT";
   case OP_HLT:
     return "OP_HLT";
+  case OP_DEEPADD_CONST:
+    return "OP_DEEPADD_CONST";
+  case OP_DEEPGET_CONST:
+    return "OP_DEEPGET_CONST";
+  case OP_DEEPGET_DEEPGET:
+    return "OP_DEEPGET_DEEPGET";
+  case OP_ADD_DEEPSET:
+    return "OP_ADD_DEEPSET";
+  case OP_STRCAT_DEEPSET:
+    return "OP_STRCAT_DEEPSET";
+  case OP_LT_JZ:
+    return "OP_LT_JZ";
+  case OP_GT_JZ:
+    return "OP_GT_JZ";
+  case OP_TRUE_NOT:
+    return "OP_TRUE_NOT";
+  case OP_FORLOOP_CONST:
+    return "OP_FORLOOP_CONST";
+  case OP_FORLOOP_DEEPGET:
+    return "OP_FORLOOP_DEEPGET";
+  case OP_ADD_NUM:
+    return "OP_ADD_NUM";
+  case OP_SUB_NUM:
+    return "OP_SUB_NUM";
+  case OP_MUL_NUM:
+    return "OP_MUL_NUM";
+  case OP_DIV_NUM:
+    return "OP_DIV_NUM";
+  case OP_MOD_NUM:
+    return "OP_MOD_NUM";
+  case OP_EQ_NUM:
+    return "OP_EQ_NUM";
+  case OP_GT_NUM:
+    return "OP_GT_NUM";
+  case OP_LT_NUM:
+    return "OP_LT_NUM";
+  case OP_JNZ:
+    return "OP_JNZ";
   default:
     assert(0);
   }
@@ -999,38 +1710,61 @@ void run(VM *vm, Bytecode *code) {
   disassemble(code);
 #endif
 
+  load_strings(vm, code);
+
+#ifdef JIT
+  init_jit(&vm->jit, code);
+#endif
+
   static void *dispatch_table[] = {
-      &&op_print,       &&op_add,
-      &&op_sub,         &&op_mul,
-      &&op_div,         &&op_mod,
-      &&op_eq,          &&op_gt,
-      &&op_lt,          &&op_not,
-      &&op_neg,         &&op_true,
-      &&op_null,        &&op_const,
-      &&op_str,         &&op_jmp,
-      &&op_jz,          &&op_bitand,
-      &&op_bitor,       &&op_bitxor,
-      &&op_bitnot,      &&op_bitshl,
-      &&op_bitshr,      &&op_set_global,
-      &&op_get_global,  &&op_get_global_ptr,
-      &&op_deepset,     &&op_deepget,
-      &&op_deepget_ptr, &&op_setattr,
-      &&op_getattr,     &&op_getattr_ptr,
-      &&op_struct,      &&op_struct_blueprint,
-      &&op_impl,        &&op_call,
-      &&op_call_method, &&op_ret,
-      &&op_pop,         &&op_deref,
-      &&op_derefset,    &&op_strcat,
-      &&op_array,       &&op_arrayset,
-      &&op_subscript,   &&op_hlt,
+      &&op_print,           &&op_add,
+      &&op_sub,             &&op_mul,
+      &&op_div,             &&op_mod,
+      &&op_eq,              &&op_gt,
+      &&op_lt,              &&op_not,
+      &&op_neg,             &&op_true,
+      &&op_null,            &&op_const,
+      &&op_str,             &&op_jmp,
+      &&op_jz,              &&op_bitand,
+      &&op_bitor,           &&op_bitxor,
+      &&op_bitnot,          &&op_bitshl,
+      &&op_bitshr,          &&op_set_global,
+      &&op_get_global,      &&op_get_global_ptr,
+      &&op_deepset,         &&op_deepget,
+      &&op_deepget_ptr,     &&op_setattr,
+      &&op_getattr,         &&op_getattr_ptr,
+      &&op_struct,          &&op_struct_blueprint,
+      &&op_impl,            &&op_call,
+      &&op_call_method,     &&op_tailcall,
+      &&op_tailcall,        &&op_ret, /* OP_TAILCALL_METHOD, OP_RET */
+      &&op_pop,             &&op_deref,
+      &&op_derefset,        &&op_strcat,
+      &&op_array,           &&op_arrayset,
+      &&op_subscript,       &&op_hlt,
+      &&op_deepadd_const,   &&op_deepget_const,
+      &&op_deepget_deepget, &&op_add_deepset,
+      &&op_lt_jz,           &&op_gt_jz,
+      &&op_true_not,        &&op_forloop_const,
+      &&op_forloop_deepget, &&op_strcat_deepset,
+      &&op_add_num,         &&op_sub_num,
+      &&op_mul_num,         &&op_div_num,
+      &&op_mod_num,         &&op_eq_num,
+      &&op_gt_num,          &&op_lt_num,
+      &&op_jz, /* OP_JNZ */
   };
 
 #ifndef venom_debug_vm
-#define DISPATCH() goto *dispatch_table[*++ip]
+#define DISPATCH()                                                             \
+  do {                                                                         \
+    COUNT_PAIR();                                                              \
+    goto *dispatch_table[*++ip];                                               \
+  } while (0)
 #else
 #define DISPATCH()                                                             \
   do {                                                                         \
+    COUNT_PAIR();                                                              \
     printf("current instruction: %s\n", print_current_instruction(*++ip));     \
+    sync_tos(vm, &stack);                                                      \
     PRINT_STACK();                                                             \
     goto *dispatch_table[*ip];                                                 \
   } while (0)
@@ -1038,144 +1772,619 @@ void run(VM *vm, Bytecode *code) {
 
   uint8_t *ip = code->code.data;
 
+  /* The frame pointer of the current function is cached in the stack
+   * state so that accessing a local doesn't have to go through the fp
+   * stack. The top-level code has its locals at the bottom of the st-
+   * ack. */
+  Stack stack = {.sp = &vm->stack[vm->tos], .fp = vm->stack};
+
+#ifdef venom_debug_pairs
+  uint8_t prev_opcode = *ip;
+#endif
+
   goto *dispatch_table[*ip];
 
 op_print:
-  handle_op_print(vm, code, &ip);
+  handle_op_print(vm, code, &ip, &stack);
   DISPATCH();
 op_add:
-  handle_op_add(vm, code, &ip);
+  handle_op_add(vm, code, &ip, &stack);
   DISPATCH();
 op_sub:
-  handle_op_sub(vm, code, &ip);
+  handle_op_sub(vm, code, &ip, &stack);
   DISPATCH();
 op_mul:
-  handle_op_mul(vm, code, &ip);
+  handle_op_mul(vm, code, &ip, &stack);
   DISPATCH();
 op_div:
-  handle_op_div(vm, code, &ip);
+  handle_op_div(vm, code, &ip, &stack);
   DISPATCH();
 op_mod:
-  handle_op_mod(vm, code, &ip);
+  handle_op_mod(vm, code, &ip, &stack);
   DISPATCH();
 op_eq:
-  handle_op_eq(vm, code, &ip);
+  handle_op_eq(vm, code, &ip, &stack);
   DISPATCH();
 op_gt:
-  handle_op_gt(vm, code, &ip);
+  handle_op_gt(vm, code, &ip, &stack);
   DISPATCH();
 op_lt:
-  handle_op_lt(vm, code, &ip);
+  handle_op_lt(vm, code, &ip, &stack);
   DISPATCH();
 op_not:
-  handle_op_not(vm, code, &ip);
+  handle_op_not(vm, code, &ip, &stack);
   DISPATCH();
 op_neg:
-  handle_op_neg(vm, code, &ip);
+  handle_op_neg(vm, code, &ip, &stack);
   DISPATCH();
 op_true:
-  handle_op_true(vm, code, &ip);
+  handle_op_true(vm, code, &ip, &stack);
   DISPATCH();
 op_null:
-  handle_op_null(vm, code, &ip);
+  handle_op_null(vm, code, &ip, &stack);
   DISPATCH();
 op_const:
-  handle_op_const(vm, code, &ip);
+  handle_op_const(vm, code, &ip, &stack);
   DISPATCH();
 op_str:
-  handle_op_str(vm, code, &ip);
+  handle_op_str(vm, code, &ip, &stack);
   DISPATCH();
 op_jmp:
-  handle_op_jmp(vm, code, &ip);
+  handle_op_jmp(vm, code, &ip, &stack);
   DISPATCH();
 op_jz:
-  handle_op_jz(vm, code, &ip);
+  handle_op_jz(vm, code, &ip, &stack);
   DISPATCH();
 op_bitand:
-  handle_op_bitand(vm, code, &ip);
+  handle_op_bitand(vm, code, &ip, &stack);
   DISPATCH();
 op_bitor:
-  handle_op_bitor(vm, code, &ip);
+  handle_op_bitor(vm, code, &ip, &stack);
   DISPATCH();
 op_bitxor:
-  handle_op_bitxor(vm, code, &ip);
+  handle_op_bitxor(vm, code, &ip, &stack);
   DISPATCH();
 op_bitnot:
-  handle_op_bitnot(vm, code, &ip);
+  handle_op_bitnot(vm, code, &ip, &stack);
   DISPATCH();
 op_bitshl:
-  handle_op_bitshl(vm, code, &ip);
+  handle_op_bitshl(vm, code, &ip, &stack);
   DISPATCH();
 op_bitshr:
-  handle_op_bitshr(vm, code, &ip);
+  handle_op_bitshr(vm, code, &ip, &stack);
   DISPATCH();
 op_set_global:
-  handle_op_set_global(vm, code, &ip);
+  handle_op_set_global(vm, code, &ip, &stack);
   DISPATCH();
 op_get_global:
-  handle_op_get_global(vm, code, &ip);
+  handle_op_get_global(vm, code, &ip, &stack);
   DISPATCH();
 op_get_global_ptr:
-  handle_op_get_global_ptr(vm, code, &ip);
+  handle_op_get_global_ptr(vm, code, &ip, &stack);
   DISPATCH();
 op_deepset:
-  handle_op_deepset(vm, code, &ip);
+  handle_op_deepset(vm, code, &ip, &stack);
   DISPATCH();
 op_deepget:
-  handle_op_deepget(vm, code, &ip);
+  handle_op_deepget(vm, code, &ip, &stack);
   DISPATCH();
 op_deepget_ptr:
-  handle_op_deepget_ptr(vm, code, &ip);
+  handle_op_deepget_ptr(vm, code, &ip, &stack);
   DISPATCH();
 op_setattr:
-  handle_op_setattr(vm, code, &ip);
+  handle_op_setattr(vm, code, &ip, &stack);
   DISPATCH();
 op_getattr:
-  handle_op_getattr(vm, code, &ip);
+  handle_op_getattr(vm, code, &ip, &stack);
   DISPATCH();
 op_getattr_ptr:
-  handle_op_getattr_ptr(vm, code, &ip);
+  handle_op_getattr_ptr(vm, code, &ip, &stack);
   DISPATCH();
 op_struct:
-  handle_op_struct(vm, code, &ip);
+  handle_op_struct(vm, code, &ip, &stack);
   DISPATCH();
 op_struct_blueprint:
-  handle_op_struct_blueprint(vm, code, &ip);
+  handle_op_struct_blueprint(vm, code, &ip, &stack);
   DISPATCH();
 op_impl:
-  handle_op_impl(vm, code, &ip);
+  handle_op_impl(vm, code, &ip, &stack);
   DISPATCH();
 op_call:
-  handle_op_call(vm, code, &ip);
+  handle_op_call(vm, code, &ip, &stack);
   DISPATCH();
 op_call_method:
-  handle_op_call_method(vm, code, &ip);
+  handle_op_call_method(vm, code, &ip, &stack);
+  DISPATCH();
+op_tailcall:
+  handle_op_tailcall(vm, code, &ip, &stack);
   DISPATCH();
 op_ret:
-  handle_op_ret(vm, code, &ip);
+  handle_op_ret(vm, code, &ip, &stack);
   DISPATCH();
 op_pop:
-  handle_op_pop(vm, code, &ip);
+  handle_op_pop(vm, code, &ip, &stack);
   DISPATCH();
 op_deref:
-  handle_op_deref(vm, code, &ip);
+  handle_op_deref(vm, code, &ip, &stack);
   DISPATCH();
 op_derefset:
-  handle_op_derefset(vm, code, &ip);
+  handle_op_derefset(vm, code, &ip, &stack);
   DISPATCH();
 op_strcat:
-  handle_op_strcat(vm, code, &ip);
+  handle_op_strcat(vm, code, &ip, &stack);
   DISPATCH();
 op_array:
-  handle_op_array(vm, code, &ip);
+  handle_op_array(vm, code, &ip, &stack);
   DISPATCH();
 op_arrayset:
-  handle_op_arrayset(vm, code, &ip);
+  handle_op_arrayset(vm, code, &ip, &stack);
   DISPATCH();
 op_subscript:
-  handle_op_subscript(vm, code, &ip);
+  handle_op_subscript(vm, code, &ip, &stack);
+  DISPATCH();
+op_deepadd_const:
+  handle_op_deepadd_const(vm, code, &ip, &stack);
+  DISPATCH();
+op_deepget_const:
+  handle_op_deepget_const(vm, code, &ip, &stack);
+  DISPATCH();
+op_deepget_deepget:
+  handle_op_deepget_deepget(vm, code, &ip, &stack);
+  DISPATCH();
+op_add_deepset:
+  handle_op_add_deepset(vm, code, &ip, &stack);
+  DISPATCH();
+op_lt_jz:
+  handle_op_lt_jz(vm, code, &ip, &stack);
+  DISPATCH();
+op_gt_jz:
+  handle_op_gt_jz(vm, code, &ip, &stack);
+  DISPATCH();
+op_true_not:
+  handle_op_true_not(vm, code, &ip, &stack);
+  DISPATCH();
+op_forloop_const:
+  handle_op_forloop_const(vm, code, &ip, &stack);
+  DISPATCH();
+op_forloop_deepget:
+  handle_op_forloop_deepget(vm, code, &ip, &stack);
+  DISPATCH();
+op_strcat_deepset:
+  handle_op_strcat_deepset(vm, code, &ip, &stack);
+  DISPATCH();
+op_add_num:
+  handle_op_add_num(vm, code, &ip, &stack);
+  DISPATCH();
+op_sub_num:
+  handle_op_sub_num(vm, code, &ip, &stack);
+  DISPATCH();
+op_mul_num:
+  handle_op_mul_num(vm, code, &ip, &stack);
+  DISPATCH();
+op_div_num:
+  handle_op_div_num(vm, code, &ip, &stack);
+  DISPATCH();
+op_mod_num:
+  handle_op_mod_num(vm, code, &ip, &stack);
+  DISPATCH();
+op_eq_num:
+  handle_op_eq_num(vm, code, &ip, &stack);
+  DISPATCH();
+op_gt_num:
+  handle_op_gt_num(vm, code, &ip, &stack);
+  DISPATCH();
+op_lt_num:
+  handle_op_lt_num(vm, code, &ip, &stack);
   DISPATCH();
 op_hlt:
+#ifdef venom_debug_ic
+  fprintf(stderr, "property caches: %zu hits, %zu misses\n",
+          vm->property_cache_hits, vm->property_cache_misses);
+  fprintf(stderr, "method caches: %zu hits, %zu misses\n",
+          vm->method_cache_hits, vm->method_cache_misses);
+#endif
+#ifdef venom_debug_pairs
+  print_pair_histogram();
+#endif
+#ifdef JIT
+  free_jit(&vm->jit);
+#endif
+  sync_tos(vm, &stack);
+  assert(vm->tos == 0);
+  return;
+}
+
+/* Run the stack instruction at 'ip' on behalf of the register engine,
+ * which keeps vm->tos pointing past the temporaries of the instruction
+ * (see run_register), and passes its 'regs' as the frame pointer 'fp'
+ * of the stack state the handlers work on.
+ * Only the instructions that do not have a register form are run this
+ * way, so none of them transfer control. The quickened forms run as
+ * their generic ones, since a de-quickened instruction relies on the
+ * mainloop to dispatch it again. This is kept out of line,
+ * since inlining all of the handlers into the register engine leaves
+ * the compiler short of registers for 'pc'. */
+__attribute__((noinline)) static void
+run_stack_instruction(VM *vm, Bytecode *code, uint8_t *ip, Object *fp) {
+  Stack stack = {.fp = fp};
+  reload_tos(vm, &stack);
+
+  switch (*ip) {
+  case OP_PRINT:
+    handle_op_print(vm, code, &ip, &stack);
+    break;
+  case OP_ADD:
+  case OP_ADD_NUM:
+    handle_op_add(vm, code, &ip, &stack);
+    break;
+  case OP_SUB:
+  case OP_SUB_NUM:
+    handle_op_sub(vm, code, &ip, &stack);
+    break;
+  case OP_MUL:
+  case OP_MUL_NUM:
+    handle_op_mul(vm, code, &ip, &stack);
+    break;
+  case OP_DIV:
+  case OP_DIV_NUM:
+    handle_op_div(vm, code, &ip, &stack);
+    break;
+  case OP_MOD:
+  case OP_MOD_NUM:
+    handle_op_mod(vm, code, &ip, &stack);
+    break;
+  case OP_EQ:
+  case OP_EQ_NUM:
+    handle_op_eq(vm, code, &ip, &stack);
+    break;
+  case OP_GT:
+  case OP_GT_NUM:
+    handle_op_gt(vm, code, &ip, &stack);
+    break;
+  case OP_LT:
+  case OP_LT_NUM:
+    handle_op_lt(vm, code, &ip, &stack);
+    break;
+  case OP_NOT:
+    handle_op_not(vm, code, &ip, &stack);
+    break;
+  case OP_NEG:
+    handle_op_neg(vm, code, &ip, &stack);
+    break;
+  case OP_TRUE:
+    handle_op_true(vm, code, &ip, &stack);
+    break;
+  case OP_NULL:
+    handle_op_null(vm, code, &ip, &stack);
+    break;
+  case OP_CONST:
+    handle_op_const(vm, code, &ip, &stack);
+    break;
+  case OP_STR:
+    handle_op_str(vm, code, &ip, &stack);
+    break;
+  case OP_BITAND:
+    handle_op_bitand(vm, code, &ip, &stack);
+    break;
+  case OP_BITOR:
+    handle_op_bitor(vm, code, &ip, &stack);
+    break;
+  case OP_BITXOR:
+    handle_op_bitxor(vm, code, &ip, &stack);
+    break;
+  case OP_BITNOT:
+    handle_op_bitnot(vm, code, &ip, &stack);
+    break;
+  case OP_BITSHL:
+    handle_op_bitshl(vm, code, &ip, &stack);
+    break;
+  case OP_BITSHR:
+    handle_op_bitshr(vm, code, &ip, &stack);
+    break;
+  case OP_SET_GLOBAL:
+    handle_op_set_global(vm, code, &ip, &stack);
+    break;
+  case OP_GET_GLOBAL:
+    handle_op_get_global(vm, code, &ip, &stack);
+    break;
+  case OP_GET_GLOBAL_PTR:
+    handle_op_get_global_ptr(vm, code, &ip, &stack);
+    break;
+  case OP_DEEPSET:
+    handle_op_deepset(vm, code, &ip, &stack);
+    break;
+  case OP_DEEPGET:
+    handle_op_deepget(vm, code, &ip, &stack);
+    break;
+  case OP_DEEPGET_PTR:
+    handle_op_deepget_ptr(vm, code, &ip, &stack);
+    break;
+  case OP_SETATTR:
+    handle_op_setattr(vm, code, &ip, &stack);
+    break;
+  case OP_GETATTR:
+    handle_op_getattr(vm, code, &ip, &stack);
+    break;
+  case OP_GETATTR_PTR:
+    handle_op_getattr_ptr(vm, code, &ip, &stack);
+    break;
+  case OP_STRUCT:
+    handle_op_struct(vm, code, &ip, &stack);
+    break;
+  case OP_STRUCT_BLUEPRINT:
+    handle_op_struct_blueprint(vm, code, &ip, &stack);
+    break;
+  case OP_IMPL:
+    handle_op_impl(vm, code, &ip, &stack);
+    break;
+  case OP_POP:
+    handle_op_pop(vm, code, &ip, &stack);
+    break;
+  case OP_DEREF:
+    handle_op_deref(vm, code, &ip, &stack);
+    break;
+  case OP_DEREFSET:
+    handle_op_derefset(vm, code, &ip, &stack);
+    break;
+  case OP_STRCAT:
+    handle_op_strcat(vm, code, &ip, &stack);
+    break;
+  case OP_ARRAY:
+    handle_op_array(vm, code, &ip, &stack);
+    break;
+  case OP_ARRAYSET:
+    handle_op_arrayset(vm, code, &ip, &stack);
+    break;
+  case OP_SUBSCRIPT:
+    handle_op_subscript(vm, code, &ip, &stack);
+    break;
+  default:
+    assert(0);
+  }
+
+  sync_tos(vm, &stack);
+}
+
+/* The register engine. 'regs' points to the start of the current fr-
+ * ame in the vm's stack, and the registers of an instruction are ad-
+ * dressed relative to it. The frame pointer stack is kept the same
+ * way the stack engine keeps it (so that 'regs' can be restored on
+ * return), and the return addresses are kept alongside it.
+ *
+ * With global common subexpression elimination, gcc ends up keeping
+ * 'pc' on the C stack, which puts a store and a load on the critical
+ * path of every dispatch (it is what the gcc manual suggests turning
+ * off for computed goto interpreters), and it nearly halves the time
+ * of the loops in benchmarks/. */
+#if defined(__GNUC__) && !defined(__clang__)
+__attribute__((optimize("no-gcse")))
+#endif
+void run_register(VM *vm, Bytecode *code, RegisterCode *rcode) {
+#ifdef venom_debug_disassembler
+  disassemble_register(rcode);
+#endif
+
+  load_strings(vm, code);
+
+  static void *dispatch_table[] = {
+      &&r_load,  &&r_store, &&r_const, &&r_get_global, &&r_set_global,
+      &&r_add,   &&r_sub,   &&r_mul,   &&r_div,        &&r_lt,
+      &&r_gt,    &&r_addk,  &&r_subk,  &&r_mulk,       &&r_divk,
+      &&r_ltk,   &&r_gtk,   &&r_neg,   &&r_jmp,        &&r_jz,
+      &&r_jnlt,  &&r_jngt,  &&r_jnltk, &&r_jngtk,      &&r_call,
+      &&r_call_method,      &&r_tailcall,  &&r_tailcall_method,
+      &&r_ret,   &&r_stack, &&r_hlt,
+  };
+
+  RegisterInstruction *returns[STACK_MAX];
+  RegisterInstruction *pc = rcode->code.data;
+  Object *regs = vm->stack;
+
+#ifndef venom_debug_vm
+#define REGISTER_GOTO() goto *dispatch_table[pc->opcode]
+#else
+#define REGISTER_GOTO()                                                        \
+  do {                                                                         \
+    vm->tos = regs - vm->stack + pc->depth;                                    \
+    printf("current instruction: %s\n", register_opcode_name(pc->opcode));    \
+    PRINT_STACK();                                                             \
+    goto *dispatch_table[pc->opcode];                                          \
+  } while (0)
+#endif
+
+#define REGISTER_DISPATCH()                                                    \
+  do {                                                                         \
+    ++pc;                                                                      \
+    REGISTER_GOTO();                                                           \
+  } while (0)
+
+#define REGISTER_JUMP(target)                                                  \
+  do {                                                                         \
+    pc = &rcode->code.data[(target)];                                          \
+    REGISTER_GOTO();                                                           \
+  } while (0)
+
+#define REGISTER_BINARY_OP(op, wrapper, right)                                 \
+  do {                                                                         \
+    regs[pc->a] = wrapper(AS_NUM(regs[pc->b]) op(right));                      \
+    REGISTER_DISPATCH();                                                       \
+  } while (0)
+
+/* The arithmetic and the comparisons check that their operands are
+ * numbers, like on the stack engine. The K forms only have to check
+ * the register, since the constant is always a number. */
+#define REGISTER_CHECK(name)                                                   \
+  do {                                                                         \
+    if (__builtin_expect(!IS_NUM(regs[pc->b]) || !IS_NUM(regs[pc->c]), 0)) {   \
+      unsupported_types(name, regs[pc->b], regs[pc->c]);                       \
+    }                                                                          \
+  } while (0)
+
+#define REGISTER_CHECK_K(name)                                                 \
+  do {                                                                         \
+    if (__builtin_expect(!IS_NUM(regs[pc->b]), 0)) {                          \
+      unsupported_types(name, regs[pc->b], NUM_VAL(pc->k));                    \
+    }                                                                          \
+  } while (0)
+
+#define REGISTER_BRANCH(op, right)                                             \
+  do {                                                                         \
+    if (!(AS_NUM(regs[pc->b]) op(right))) {                                    \
+      REGISTER_JUMP(pc->d);                                                    \
+    }                                                                          \
+    REGISTER_DISPATCH();                                                       \
+  } while (0)
+
+  goto *dispatch_table[pc->opcode];
+
+r_load: {
+  Object obj = regs[pc->b];
+  regs[pc->a] = obj;
+  objincref(&obj);
+  REGISTER_DISPATCH();
+}
+r_store: {
+  Object obj = regs[pc->b];
+  objdecref(&regs[pc->a]);
+  regs[pc->a] = obj;
+  REGISTER_DISPATCH();
+}
+r_const:
+  regs[pc->a] = NUM_VAL(pc->k);
+  REGISTER_DISPATCH();
+r_get_global: {
+  Object obj = vm->globals[pc->b];
+  regs[pc->a] = obj;
+  objincref(&obj);
+  REGISTER_DISPATCH();
+}
+r_set_global: {
+  Object obj = regs[pc->b];
+  objdecref(&vm->globals[pc->a]);
+  vm->globals[pc->a] = obj;
+  REGISTER_DISPATCH();
+}
+r_add:
+  REGISTER_CHECK("+");
+  REGISTER_BINARY_OP(+, NUM_VAL, AS_NUM(regs[pc->c]));
+r_sub:
+  REGISTER_CHECK("-");
+  REGISTER_BINARY_OP(-, NUM_VAL, AS_NUM(regs[pc->c]));
+r_mul:
+  REGISTER_CHECK("*");
+  REGISTER_BINARY_OP(*, NUM_VAL, AS_NUM(regs[pc->c]));
+r_div:
+  REGISTER_CHECK("/");
+  REGISTER_BINARY_OP(/, NUM_VAL, AS_NUM(regs[pc->c]));
+r_lt:
+  REGISTER_CHECK("<");
+  REGISTER_BINARY_OP(<, BOOL_VAL, AS_NUM(regs[pc->c]));
+r_gt:
+  REGISTER_CHECK(">");
+  REGISTER_BINARY_OP(>, BOOL_VAL, AS_NUM(regs[pc->c]));
+r_addk:
+  REGISTER_CHECK_K("+");
+  REGISTER_BINARY_OP(+, NUM_VAL, pc->k);
+r_subk:
+  REGISTER_CHECK_K("-");
+  REGISTER_BINARY_OP(-, NUM_VAL, pc->k);
+r_mulk:
+  REGISTER_CHECK_K("*");
+  REGISTER_BINARY_OP(*, NUM_VAL, pc->k);
+r_divk:
+  REGISTER_CHECK_K("/");
+  REGISTER_BINARY_OP(/, NUM_VAL, pc->k);
+r_ltk:
+  REGISTER_CHECK_K("<");
+  REGISTER_BINARY_OP(<, BOOL_VAL, pc->k);
+r_gtk:
+  REGISTER_CHECK_K(">");
+  REGISTER_BINARY_OP(>, BOOL_VAL, pc->k);
+r_neg:
+  regs[pc->a] = NUM_VAL(-AS_NUM(regs[pc->b]));
+  REGISTER_DISPATCH();
+r_jmp:
+  REGISTER_JUMP(pc->d);
+r_jz:
+  if (!AS_BOOL(regs[pc->a])) {
+    REGISTER_JUMP(pc->d);
+  }
+  REGISTER_DISPATCH();
+r_jnlt:
+  REGISTER_CHECK("<");
+  REGISTER_BRANCH(<, AS_NUM(regs[pc->c]));
+r_jngt:
+  REGISTER_CHECK(">");
+  REGISTER_BRANCH(>, AS_NUM(regs[pc->c]));
+r_jnltk:
+  REGISTER_CHECK_K("<");
+  REGISTER_BRANCH(<, pc->k);
+r_jngtk:
+  REGISTER_CHECK_K(">");
+  REGISTER_BRANCH(>, pc->k);
+r_call: {
+  BytecodePtr fp = {.addr = NULL, .location = regs - vm->stack + pc->a};
+  returns[vm->fp_count] = pc;
+  vm->fp_stack[vm->fp_count++] = fp;
+  regs += pc->a;
+  REGISTER_JUMP(pc->d);
+}
+r_call_method: {
+  Object object = regs[pc->a];
+
+  MethodCacheEntry *method = resolve_method(
+      vm, code, &code->method_caches.data[pc->d], AS_STRUCT(object)->blueprint,
+      pc->b, pc->c);
+
+  BytecodePtr fp = {.addr = NULL, .location = regs - vm->stack + pc->a};
+  returns[vm->fp_count] = pc;
+  vm->fp_stack[vm->fp_count++] = fp;
+  regs += pc->a;
+  REGISTER_JUMP(rcode->offsets[method->location]);
+}
+r_tailcall:
+  replace_frame(regs, regs + pc->a, pc->c);
+  REGISTER_JUMP(pc->d);
+r_tailcall_method: {
+  Object object = regs[pc->a];
+
+  MethodCacheEntry *method = resolve_method(
+      vm, code, &code->method_caches.data[pc->d], AS_STRUCT(object)->blueprint,
+      pc->b, pc->c);
+
+  replace_frame(regs, regs + pc->a, pc->c + 1);
+  REGISTER_JUMP(rcode->offsets[method->location]);
+}
+r_ret:
+  for (uint32_t i = 0; i < pc->a; i++) {
+    objdecref(&regs[i]);
+  }
+  regs[0] = regs[pc->a];
+  pc = returns[--vm->fp_count];
+  regs = vm->fp_count > 0
+             ? &vm->stack[vm->fp_stack[vm->fp_count - 1].location]
+             : vm->stack;
+  REGISTER_DISPATCH();
+r_stack:
+  vm->tos = regs - vm->stack + pc->depth;
+  run_stack_instruction(vm, code, &code->code.data[pc->offset], regs);
+  REGISTER_DISPATCH();
+r_hlt:
+  vm->tos = regs - vm->stack + pc->depth;
+#ifdef venom_debug_ic
+  fprintf(stderr, "property caches: %zu hits, %zu misses\n",
+          vm->property_cache_hits, vm->property_cache_misses);
+  fprintf(stderr, "method caches: %zu hits, %zu misses\n",
+          vm->method_cache_hits, vm->method_cache_misses);
+#endif
   assert(vm->tos == 0);
   return;
+
+#undef REGISTER_GOTO
+#undef REGISTER_DISPATCH
+#undef REGISTER_JUMP
+#undef REGISTER_BINARY_OP
+#undef REGISTER_BRANCH
+#undef REGISTER_CHECK
+#undef REGISTER_CHECK_K
 }
@@ -4,20 +4,37 @@
 #define STACK_MAX 1024
 
 #include "compiler.h"
+#include "jit.h"
 #include "object.h"
+#include "register.h"
 #include <stddef.h>
 
-typedef struct {
+typedef struct VM {
   Object stack[STACK_MAX];
   size_t tos; /* top of stack */
-  Table_Object globals;
+  Object globals[GLOBALS_MAX]; /* indexed by slot */
   Table_StructBlueprint *blueprints;
   BytecodePtr fp_stack[STACK_MAX]; /* a stack for frame pointers */
   size_t fp_count;
+  MethodCacheEntry megamorphic_entry;
+  String **strings; /* the string literals, indexed like the sp */
+  size_t string_count;
+#ifdef JIT
+  Jit jit;
+#endif
+#ifdef venom_debug_ic
+  size_t property_cache_hits;
+  size_t property_cache_misses;
+  size_t method_cache_hits;
+  size_t method_cache_misses;
+#endif
 } VM;
 
 void init_vm(VM *vm);
 void free_vm(VM *vm);
 void run(VM *vm, Bytecode *code);
+void run_register(VM *vm, Bytecode *code, RegisterCode *rcode);
+__attribute__((noreturn)) void unsupported_types(const char *op, Object a,
+                                                Object b);
 
 #endif
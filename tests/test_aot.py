@@ -0,0 +1,87 @@
+import subprocess
+
+import pytest
+
+from tests.util import VALGRIND_CMD, CASES_PATH
+from tests.util import assert_output
+
+# The runtime that the generated C is linked against.
+AOT_RUNTIME = ["src/object.c", "src/table.c", "src/util.c"]
+
+VALGRIND = VALGRIND_CMD[: VALGRIND_CMD.index("./venom")]
+
+
+@pytest.mark.parametrize(
+    "case, expected",
+    [
+        ("hot_fn.vnm", [1597, -241455]),
+        ("hot_loops.vnm", [2180, 30926, 501, 228875, 403501, 7, "done"]),
+        ("counted_loop.vnm", [4950, 0, 36, 5, 5, 4]),
+        ("method.vnm", [128]),
+        ("linked_list.vnm", [3.14, False, "Hello, world!"]),
+        ("array.vnm", [128, "Hello, world!", 11]),
+        ("strcat.vnm", ["Hello, world!"]),
+        ("inline.vnm", [9, -7, 100, 91, 50, 0, 3, 4, "small", 12, 13, 50]),
+        ("tail_call.vnm", [5000050000, 500500, 7, 0]),
+        ("string_literal.vnm", ["fizz", "fizz", "fizz", "fizzbuzz", True, False]),
+        ("string_interning.vnm", [True, True, True, False, True, True]),
+        (
+            "folding.vnm",
+            [5, 1, "inf", "-inf", "-0", 0.1 + 0.2, 9, 8, False, "abcd", 6, 6],
+        ),
+        (
+            "special_numbers.vnm",
+            ["inf", "-inf", "-inf", "-0", True, True, True, True],
+        ),
+        (
+            "string_builder.vnm",
+            [
+                "0123456789" * 10,
+                "0123456789" * 10 + "a",
+                "0123456789" * 10 + "b",
+                False,
+                True,
+                True,
+                "0123456789" * 20,
+            ],
+        ),
+        (
+            "string_append.vnm",
+            [
+                "xy",
+                "ab" * 30,
+                "ab" * 30 + "!",
+                "cd" * 30,
+                "ab" * 30 + "!12",
+                "ab" * 30 + "!",
+            ],
+        ),
+    ],
+)
+def test_emit_c(tmp_path, case, expected):
+    source = tmp_path / "program.c"
+    binary = tmp_path / "program"
+
+    process = subprocess.run(
+        ["./venom", "--emit-c", CASES_PATH / case],
+        capture_output=True,
+        check=True,
+    )
+    source.write_bytes(process.stdout)
+
+    subprocess.run(
+        ["cc", "-O2", "-Dvenom_debug_vm", "-Isrc", source]
+        + AOT_RUNTIME
+        + ["-o", binary, "-lm"],
+        check=True,
+    )
+
+    process = subprocess.run(
+        VALGRIND + [binary],
+        capture_output=True,
+        check=True,
+    )
+
+    output = process.stdout.decode("utf-8")
+
+    assert_output(output, expected)
@@ -73,3 +73,52 @@ def test_assignment_property_nested():
     output = process.stdout.decode("utf-8")
 
     assert_output(output, [0, "Hello, world!"])
+
+
+def test_assignment_constants():
+    input_file = CASES_PATH / "constants.vnm"
+
+    process = subprocess.run(
+        VALGRIND_CMD + [input_file],
+        capture_output=True,
+        check=True,
+    )
+
+    output = process.stdout.decode("utf-8")
+
+    assert_output(output, [9, 123456789.125, 0.1 + 0.2, 9007199254740994, 4.25])
+
+
+def test_assignment_wide_operands(tmp_path):
+    # More than 255 globals, locals, constants and strings, so that
+    # their indexes no longer fit in the short form of the operands.
+    count = 300
+    globals_ = "".join("let g%d = %d.5;\n" % (i, i) for i in range(count))
+    locals_ = "".join("  let l%d = \"s%d\";\n" % (i, i) for i in range(count))
+    source = (
+        globals_
+        + "fn main() {\n"
+        + locals_
+        + "  let sum = 0;\n"
+        + "  for (let i = 0; i < 3; i += 1) {\n"
+        + "    sum += g%d + g0;\n" % (count - 1)
+        + "  }\n"
+        + "  print sum;\n"
+        + "  print l%d ++ l0;\n" % (count - 1)
+        + "  return 0;\n"
+        + "}\n"
+        + "main();\n"
+    )
+
+    input_file = tmp_path / "input.vnm"
+    input_file.write_text(source)
+
+    process = subprocess.run(
+        VALGRIND_CMD + [input_file],
+        capture_output=True,
+        check=True,
+    )
+
+    output = process.stdout.decode("utf-8")
+
+    assert_output(output, [3 * (count - 1 + 1.0), "s%ds0" % (count - 1)])
@@ -2,7 +2,7 @@ import subprocess
 import pytest
 import textwrap
 
-from tests.util import VALGRIND_CMD
+from tests.util import VALGRIND_CMD, assert_error
 
 
 @pytest.mark.parametrize(
@@ -31,3 +31,56 @@ def test_comparison(tmp_path, x, y):
         expected = "true" if eval(f"{x} {op} {y}") else "false"
 
         assert f"dbg print :: {expected}\n".encode("utf-8") in process.stdout
+
+
+@pytest.mark.parametrize(
+    "body, op, types",
+    [
+        (f"return a {op} b;", op, "number and string")
+        for op in ["+", "-", "*", "/", "%", "<", ">"]
+    ]
+    + [
+        # The superinstructions check their operands too.
+        ("a += 1; return a;", "+", "string and number"),
+        ("while (a < b) {} return 0;", "<", "number and string"),
+        # So does the step of a counted loop, on both the counter...
+        (
+            "for (let i = 0; i < 3; i += 1) { if (i == 1) i = b; } return 0;",
+            "+",
+            "string and number",
+        ),
+        # ...and the bound.
+        (
+            "for (let i = 0; i < a; i += 1) { a = b; } return 0;",
+            "<",
+            "number and string",
+        ),
+    ],
+)
+def test_unsupported_types(tmp_path, body, op, types):
+    # The first call runs on numbers, so the operator is quickened into
+    # its numeric form before it sees a string.
+    source = textwrap.dedent(
+        f"""\
+        fn f(a, b) {{
+          {body}
+        }}
+        print f(2, 1);
+        print f(1, "x");
+        print f("x", 1);
+        """
+    )
+
+    input_file = tmp_path / "input.vnm"
+    input_file.write_text(source)
+
+    process = subprocess.run(
+        VALGRIND_CMD + [input_file],
+        capture_output=True,
+    )
+
+    error = process.stderr.decode("utf-8")
+
+    expected = f"'{op}' operator used on objects of unsupported types: {types}\n"
+    assert_error(error, [expected])
+    assert process.returncode == 1
@@ -2,7 +2,7 @@ import subprocess
 import pytest
 import textwrap
 
-from tests.util import VALGRIND_CMD
+from tests.util import VALGRIND_CMD, CASES_PATH
 from tests.util import assert_output
 
 
@@ -81,3 +81,21 @@ def test_compound_assignment_other(tmp_path, left, op, right, expected):
     output = process.stdout.decode("utf-8")
 
     assert_output(output, [expected])
+
+
+def test_compound_assignment_nested_loops():
+    # The loops in this program compile to the sequences that get fused
+    # into superinstructions ('local += const', 'local += local', '<' and
+    # '>' followed by a jump, 'false'), with jumps landing right around
+    # them.
+    input_file = CASES_PATH / "compound_assignment_nested_loops.vnm"
+
+    process = subprocess.run(
+        VALGRIND_CMD + [input_file],
+        capture_output=True,
+        check=True,
+    )
+
+    output = process.stdout.decode("utf-8")
+
+    assert_output(output, [0, 1, 4, 10, 20, True, 20])
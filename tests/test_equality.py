@@ -2,7 +2,8 @@ import subprocess
 import pytest
 import textwrap
 
-from tests.util import VALGRIND_CMD, Struct
+from tests.util import VALGRIND_CMD, CASES_PATH, Struct
+from tests.util import assert_output
 
 
 @pytest.mark.parametrize(
@@ -104,3 +105,19 @@ def test_equality_same_object(tmp_path):
     expected = "true"
 
     assert f"dbg print :: {expected}\n".encode("utf-8") in process.stdout
+
+
+def test_equality_quickening():
+    # The comparison in eq() is quickened into its numeric form by the
+    # first calls, and has to fall back to the generic one for the rest.
+    input_file = CASES_PATH / "equality_quickening.vnm"
+
+    process = subprocess.run(
+        VALGRIND_CMD + [input_file],
+        capture_output=True,
+        check=True,
+    )
+
+    output = process.stdout.decode("utf-8")
+
+    assert_output(output, [False, True, False, True, False, False, False, True])
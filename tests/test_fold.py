@@ -0,0 +1,125 @@
+import subprocess
+import pytest
+
+from tests.util import VALGRIND_CMD
+from tests.util import assert_output, assert_error
+
+# The opcodes that a folded expression must not run anymore.
+FOLDED_OPCODES = [
+    "OP_ADD",
+    "OP_SUB",
+    "OP_MUL",
+    "OP_DIV",
+    "OP_MOD",
+    "OP_NEG",
+    "OP_NOT",
+    "OP_LT",
+    "OP_GT",
+    "OP_EQ",
+    "OP_STRCAT",
+    "OP_BITAND",
+    "OP_BITOR",
+    "OP_BITNOT",
+    "OP_BITSHL",
+    "OP_JZ",
+]
+
+
+@pytest.mark.parametrize(
+    "expression, expected",
+    [
+        ("2 * 3 - 1", 5),
+        ("-1", -1),
+        ("-0", "-0"),
+        ("7 % 3", 1),
+        ("1 / 0", "inf"),
+        ("(5 & 3) | 8", 9),
+        ("~0 == 18446744073709551615", True),
+        ("1 << 3", 8),
+        ("!true", False),
+        ("2 >= 1", True),
+        ("0 / 0 >= 1", True),
+        ("0 / 0 == 0 / 0", False),
+        ("1 == true", False),
+        ("null == null", True),
+        ('"ab" ++ "cd"', "abcd"),
+        ('"ab" ++ "cd" == "abcd"', True),
+        ("1 < 2 && 3 > 2", True),
+        ("false || 4", 4),
+        ("true && 4", 4),
+    ],
+)
+def test_fold(tmp_path, expression, expected):
+    input_file = tmp_path / "input.vnm"
+    input_file.write_text("print %s;" % expression)
+
+    process = subprocess.run(
+        VALGRIND_CMD + [input_file],
+        capture_output=True,
+        check=True,
+    )
+
+    output = process.stdout.decode("utf-8")
+
+    assert_output(output, [expected])
+    for opcode in FOLDED_OPCODES:
+        assert f"current instruction: {opcode}\n" not in output
+
+
+# The inner s ++ "b" still has to concatenate, and x + 0 and x * 0 are
+# not identities when x is a string or a nan, so they are left alone.
+@pytest.mark.parametrize(
+    "expression, expected, folded",
+    [
+        ("(x + 1) * 1", 6, ["OP_MUL"]),
+        ("1 * (x + 1)", 6, ["OP_MUL"]),
+        ("(x + 1) / 1", 6, ["OP_DIV"]),
+        ("(x + 1) - 0", 6, ["OP_SUB"]),
+        ("-(-(x + 1))", 6, ["OP_NEG"]),
+        ("!!(x < 6)", True, ["OP_NOT"]),
+        ('(s ++ "b") ++ ""', "ab", []),
+        ("x + 0", 5, []),
+        ("x * 0", 0, []),
+    ],
+)
+def test_fold_identities(tmp_path, expression, expected, folded):
+    input_file = tmp_path / "input.vnm"
+    input_file.write_text('let x = 5; let s = "a"; print %s;' % expression)
+
+    process = subprocess.run(
+        VALGRIND_CMD + [input_file],
+        capture_output=True,
+        check=True,
+    )
+
+    output = process.stdout.decode("utf-8")
+
+    assert_output(output, [expected])
+    for opcode in folded:
+        assert f"current instruction: {opcode}\n" not in output
+
+
+@pytest.mark.parametrize(
+    "expression, op, types",
+    [
+        ('1 + "a"', "+", "number and string"),
+        ("s * 1", "*", "string and number"),
+        ('"a" < 1', "<", "string and number"),
+    ],
+)
+def test_fold_keeps_errors(tmp_path, expression, op, types):
+    input_file = tmp_path / "input.vnm"
+    input_file.write_text('let s = "a"; print %s;' % expression)
+
+    process = subprocess.run(
+        VALGRIND_CMD + [input_file],
+        capture_output=True,
+    )
+    assert process.returncode == 1
+
+    error = process.stderr.decode("utf-8")
+
+    assert_error(
+        error,
+        [f"'{op}' operator used on objects of unsupported types: {types}"],
+    )
@@ -1,4 +1,5 @@
 import subprocess
+import textwrap
 
 from tests.util import VALGRIND_CMD, CASES_PATH
 from tests.util import assert_output, assert_error
@@ -58,3 +59,184 @@ def test_method_undefined():
 
     assert_error(error, ["vm: method 'goodbye' is not defined on struct 'person'.\n"])
     assert process.returncode == 1
+
+
+def test_hot_functions():
+    input_file = CASES_PATH / "hot_fn.vnm"
+
+    process = subprocess.run(
+        VALGRIND_CMD + [input_file],
+        capture_output=True,
+        check=True,
+    )
+
+    output = process.stdout.decode("utf-8")
+
+    assert_output(output, [1597, -241455])
+
+
+def test_hot_functions_unsupported_types():
+    input_file = CASES_PATH / "hot_fn_unsupported_types.vnm"
+
+    process = subprocess.run(
+        VALGRIND_CMD + [input_file],
+        capture_output=True,
+    )
+
+    error = process.stderr.decode("utf-8")
+
+    # By the last call, the function is hot enough to have been compiled
+    # by the jit, whose guards raise the same error as the vm.
+    assert_error(
+        error,
+        ["vm: '<' operator used on objects of unsupported types: string and number"],
+    )
+    assert process.returncode == 1
+
+
+def test_hot_loops():
+    input_file = CASES_PATH / "hot_loops.vnm"
+
+    process = subprocess.run(
+        VALGRIND_CMD + [input_file],
+        capture_output=True,
+        check=True,
+    )
+
+    output = process.stdout.decode("utf-8")
+
+    assert_output(output, [2180, 30926, 501, 228875, 403501, 7, "done"])
+
+
+def test_counted_loops():
+    input_file = CASES_PATH / "counted_loop.vnm"
+
+    process = subprocess.run(
+        VALGRIND_CMD + [input_file],
+        capture_output=True,
+        check=True,
+    )
+
+    output = process.stdout.decode("utf-8")
+
+    assert_output(output, [4950, 0, 36, 5, 5, 4])
+
+
+def test_func_return_drops_frame():
+    input_file = CASES_PATH / "return_frame.vnm"
+
+    process = subprocess.run(
+        VALGRIND_CMD + [input_file],
+        capture_output=True,
+        check=True,
+    )
+
+    output = process.stdout.decode("utf-8")
+
+    assert_output(output, ["item a", "none", 5050, "boxed", "item c!"])
+
+
+def test_func_far_jumps(tmp_path):
+    # The bodies below are longer than a 16-bit jump offset can span,
+    # so the jumps over them, the loop and the calls need wide offsets.
+    body = "x = x + 1;\n" * 5000
+    source = textwrap.dedent(
+        """
+        fn early(a) {
+          return a * 2;
+        }
+
+        struct counter {
+          n;
+        }
+
+        impl counter {
+          fn bump(self) {
+            let x = self.n;
+            %s
+            self.n = x;
+            return self.n;
+          }
+        }
+
+        fn big(x, flag) {
+          if (flag) {
+            %s
+          } else {
+            x = x - 1;
+          }
+          for (let i = 0; i < 2; i += 1) {
+            %s
+          }
+          return early(x);
+        }
+
+        print big(0, true);
+        print big(0, false);
+        let c = counter { n: 1 };
+        print c.bump();
+        print early(21);
+        """
+    ) % (body, body, body)
+
+    input_file = tmp_path / "input.vnm"
+    input_file.write_text(source)
+
+    process = subprocess.run(
+        VALGRIND_CMD + [input_file],
+        capture_output=True,
+        check=True,
+    )
+
+    output = process.stdout.decode("utf-8")
+
+    assert_output(output, [30000, 19998, 5001, 42])
+
+
+def test_peephole():
+    input_file = CASES_PATH / "peephole.vnm"
+
+    process = subprocess.run(
+        VALGRIND_CMD + [input_file],
+        capture_output=True,
+        check=True,
+    )
+
+    output = process.stdout.decode("utf-8")
+
+    assert_output(output, ["small", "medium", "big", 24, 7, "done"])
+    assert "unreachable" not in output
+    # The OP_NOTs of '>=', '<=', '!' and '!=' are folded into the jumps.
+    assert "current instruction: OP_NOT\n" not in output
+
+
+def test_inline():
+    input_file = CASES_PATH / "inline.vnm"
+
+    process = subprocess.run(
+        VALGRIND_CMD + [input_file],
+        capture_output=True,
+        check=True,
+    )
+
+    output = process.stdout.decode("utf-8")
+
+    assert_output(output, [9, -7, 100, 91, 50, 0, 3, 4, "small", 12, 13, 50])
+    # The call to main(), which is too large, is the only one left.
+    assert output.count("current instruction: OP_CALL\n") <= 1
+
+
+def test_tail_call():
+    input_file = CASES_PATH / "tail_call.vnm"
+
+    process = subprocess.run(
+        VALGRIND_CMD + [input_file],
+        capture_output=True,
+        check=True,
+    )
+
+    output = process.stdout.decode("utf-8")
+
+    # Each of the recursions is far deeper than the stack, so the tail
+    # calls must be reusing the frame.
+    assert_output(output, [5000050000, 500500, 7, 0])
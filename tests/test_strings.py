@@ -16,3 +16,89 @@ def test_strcat():
     output = process.stdout.decode("utf-8")
 
     assert_output(output, ["Hello, world!"])
+
+
+def test_string_literal():
+    input_file = CASES_PATH / "string_literal.vnm"
+
+    process = subprocess.run(
+        VALGRIND_CMD + [input_file],
+        capture_output=True,
+        check=True,
+    )
+
+    output = process.stdout.decode("utf-8")
+
+    # The same literal is pushed over and over, stored in a struct and
+    # an array, and concatenated, without ever being freed.
+    assert_output(output, ["fizz", "fizz", "fizz", "fizzbuzz", True, False])
+
+
+def test_string_equality():
+    input_file = CASES_PATH / "string_equality.vnm"
+
+    process = subprocess.run(
+        VALGRIND_CMD + [input_file],
+        capture_output=True,
+        check=True,
+    )
+
+    output = process.stdout.decode("utf-8")
+
+    # Strings are equal when their characters are, whether they are
+    # literals or were built at runtime, and whether they are interned
+    # or longer than INTERN_MAX_LENGTH.
+    assert_output(
+        output, [True, True, False, False, True, True, True, False, False]
+    )
+
+
+def test_string_interning():
+    input_file = CASES_PATH / "string_interning.vnm"
+
+    process = subprocess.run(
+        VALGRIND_CMD + [input_file],
+        capture_output=True,
+        check=True,
+    )
+
+    output = process.stdout.decode("utf-8")
+
+    # Short strings built at runtime are interned, and are dropped from
+    # the intern table as they die, while longer ones are compared by
+    # their characters.
+    assert_output(output, [True, True, True, False, True, True])
+
+
+def test_string_builder():
+    input_file = CASES_PATH / "string_builder.vnm"
+
+    process = subprocess.run(
+        VALGRIND_CMD + [input_file],
+        capture_output=True,
+        check=True,
+    )
+
+    output = process.stdout.decode("utf-8")
+
+    # Strings that share a buffer each see their own characters, even
+    # after other strings have been appended to it.
+    s = "0123456789" * 10
+    assert_output(output, [s, s + "a", s + "b", False, True, True, s + s])
+
+
+def test_string_append():
+    input_file = CASES_PATH / "string_append.vnm"
+
+    process = subprocess.run(
+        VALGRIND_CMD + [input_file],
+        capture_output=True,
+        check=True,
+    )
+
+    output = process.stdout.decode("utf-8")
+
+    # 's ++= x' is 's = s ++ x', and appending to a string in place
+    # leaves the other references to it alone.
+    s = "ab" * 30
+    assert_output(output, ["xy", s, s + "!", "cd" * 30, s + "!12", s + "!"])
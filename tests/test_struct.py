@@ -0,0 +1,34 @@
+import subprocess
+
+from tests.util import VALGRIND_CMD, CASES_PATH
+from tests.util import assert_output
+
+
+def test_property_access_polymorphic():
+    input_file = CASES_PATH / "property_polymorphic.vnm"
+
+    process = subprocess.run(
+        VALGRIND_CMD + [input_file],
+        capture_output=True,
+        check=True,
+    )
+
+    output = process.stdout.decode("utf-8")
+
+    assert_output(output, [0, 2, 10, 3, 20, 2, 30, 3])
+
+
+def test_method_call_polymorphic():
+    input_file = CASES_PATH / "method_polymorphic.vnm"
+
+    process = subprocess.run(
+        VALGRIND_CMD + [input_file],
+        capture_output=True,
+        check=True,
+    )
+
+    output = process.stdout.decode("utf-8")
+
+    # Six struct types at one call site exercise the monomorphic,
+    # the polymorphic, and the megamorphic paths of the method cache.
+    assert_output(output, [(i % 6) * 100 + i for i in range(12)])
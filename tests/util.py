@@ -1,3 +1,4 @@
+import os
 import textwrap
 from pathlib import Path
 
@@ -10,6 +11,10 @@ VALGRIND_CMD = [
     "./venom",
 ]
 
+# Run the suite on the register engine with VENOM_ENGINE=register.
+if os.environ.get("VENOM_ENGINE") == "register":
+    VALGRIND_CMD.append("--register")
+
 CASES_PATH = Path(".") / "tests" / "cases"
 
 